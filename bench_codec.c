@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <time.h>
+
+#include "common.h"
+#include "codec.h"
+
+/* microbenchmark of snapshot codec
+ *
+ *   usage: ./bench_codec [iterations]
+ *
+ *   for each scenario, prints bytes sent per snapshot with the raw
+ *   server_message_t and with the packed codec (frame header
+ *   included), and the time to encode and decode one snapshot.
+ *
+ *   then prints the encode time of one battle tick sent to N users,
+ *   encoding a whole snapshot per user vs. encoding the shared part
+ *   once plus a header per user.
+ */
+
+#define DEFAULT_ITERATIONS 200000
+
+struct scenario_t {
+	const char *name;
+	int map_w, map_h;
+	int nr_bullets, nr_pickups;
+};
+
+static struct scenario_t scenarios[] = {
+	{"default map, quiet",   BATTLE_W, BATTLE_H, 4,  3},
+	{"default map, busy",    BATTLE_W, BATTLE_H, 40, MAX_OTHER},
+	{"default map, full",    BATTLE_W, BATTLE_H, USER_CNT * MAX_BULLETS, MAX_OTHER},
+	{"1000x1000 map, busy",  1000, 1000, 40, MAX_OTHER},
+	{"max map, full",        MAX_MAP_W, MAX_MAP_H, USER_CNT * MAX_BULLETS, MAX_OTHER},
+};
+
+static volatile size_t sink;
+
+double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* items are spread over slots like a battle after a while: bullets
+ * are freed and re-allocated, so used slots are not contiguous */
+void make_snapshot(struct scenario_t *sc, server_message_t *psm) {
+	memset(psm, 0, sizeof(server_message_t));
+	psm->message = SERVER_MESSAGE_BATTLE_INFORMATION;
+	psm->life = rand() % (MAX_LIFE + 1);
+	psm->index = rand() % USER_CNT;
+	psm->bullets_num = rand() % (MAX_BULLETS + 1);
+	psm->map_w = sc->map_w;
+	psm->map_h = sc->map_h;
+
+	for(int i = 0; i < USER_CNT; i++) {
+		psm->user_pos[i].x = rand() % sc->map_w;
+		psm->user_pos[i].y = rand() % sc->map_h;
+	}
+	psm->user_pos[USER_CNT - 1].x = POS_NONE;
+	psm->user_pos[USER_CNT - 1].y = POS_NONE;
+
+	int nr_items = sc->nr_bullets + sc->nr_pickups;
+	for(int n = 0; n < nr_items; n++) {
+		int i = rand() % MAX_ITEM;
+		while(psm->item_kind[i] != ITEM_NONE)
+			i = (i + 1) % MAX_ITEM;
+
+		if(n < sc->nr_bullets)
+			psm->item_kind[i] = ITEM_BULLET;
+		else
+			psm->item_kind[i] = (rand() & 1) ? ITEM_MAGAZINE : ITEM_BLOOD_VIAL;
+		psm->item_pos[i].x = rand() % sc->map_w;
+		psm->item_pos[i].y = rand() % sc->map_h;
+	}
+}
+
+int same_snapshot(server_message_t *a, server_message_t *b) {
+	if(a->life != b->life || a->index != b->index
+	|| a->bullets_num != b->bullets_num
+	|| a->map_w != b->map_w || a->map_h != b->map_h)
+		return false;
+
+	for(int i = 0; i < USER_CNT; i++) {
+		if(a->user_pos[i].x != b->user_pos[i].x
+		|| a->user_pos[i].y != b->user_pos[i].y)
+			return false;
+	}
+
+	for(int i = 0; i < MAX_ITEM; i++) {
+		if(a->item_kind[i] != b->item_kind[i])
+			return false;
+		if(a->item_kind[i] != ITEM_NONE
+		&& (a->item_pos[i].x != b->item_pos[i].x
+		|| a->item_pos[i].y != b->item_pos[i].y))
+			return false;
+	}
+	return true;
+}
+
+#define NR_SAMPLES 64
+
+void run_scenario(struct scenario_t *sc, int iterations) {
+	static server_message_t samples[NR_SAMPLES];
+	static uint8_t packed[NR_SAMPLES][SNAPSHOT_MAX_BYTES];
+	static size_t packed_len[NR_SAMPLES];
+	server_message_t decoded;
+
+	size_t total_bytes = 0;
+	for(int i = 0; i < NR_SAMPLES; i++) {
+		make_snapshot(sc, &samples[i]);
+		packed_len[i] = snapshot_encode(&samples[i], packed[i], SNAPSHOT_MAX_BYTES);
+		if(packed_len[i] == 0
+		|| snapshot_decode(packed[i], packed_len[i], &decoded) < 0
+		|| !same_snapshot(&samples[i], &decoded)) {
+			fprintf(stderr, "%s: snapshot %d doesn't survive round trip\n", sc->name, i);
+			exit(1);
+		}
+		total_bytes += packed_len[i] + FRAME_HEADER_SIZE;
+	}
+
+	double st = now_ns();
+	for(int i = 0; i < iterations; i++) {
+		int s = i % NR_SAMPLES;
+		sink += snapshot_encode(&samples[s], packed[s], SNAPSHOT_MAX_BYTES);
+	}
+	double encode_ns = (now_ns() - st) / iterations;
+
+	st = now_ns();
+	for(int i = 0; i < iterations; i++) {
+		int s = i % NR_SAMPLES;
+		sink += snapshot_decode(packed[s], packed_len[s], &decoded);
+	}
+	double decode_ns = (now_ns() - st) / iterations;
+
+	size_t raw_bytes = FRAME_HEADER_SIZE + sizeof(server_message_t);
+	double packed_bytes = (double)total_bytes / NR_SAMPLES;
+	printf("%-22s %8zu %8.1f %7.1fx %10.1f %10.1f\n", sc->name,
+			raw_bytes, packed_bytes, raw_bytes / packed_bytes,
+			encode_ns, decode_ns);
+}
+
+void run_fan_out(struct scenario_t *sc, int nr_users, int iterations) {
+	static uint8_t packed[SNAPSHOT_MAX_BYTES];
+	server_message_t sm;
+	make_snapshot(sc, &sm);
+
+	double st = now_ns();
+	for(int i = 0; i < iterations; i++) {
+		for(int u = 0; u < nr_users; u++) {
+			sm.index = u % USER_CNT;
+			sink += snapshot_encode(&sm, packed, sizeof(packed));
+		}
+	}
+	double per_user_ns = (now_ns() - st) / iterations;
+
+	st = now_ns();
+	for(int i = 0; i < iterations; i++) {
+		sink += snapshot_encode_shared(&sm, packed + SNAPSHOT_HEADER_SIZE, sizeof(packed) - SNAPSHOT_HEADER_SIZE);
+		for(int u = 0; u < nr_users; u++) {
+			sm.index = u % USER_CNT;
+			sink += snapshot_encode_header(&sm, packed, SNAPSHOT_HEADER_SIZE);
+		}
+	}
+	double shared_ns = (now_ns() - st) / iterations;
+
+	printf("%-22s %8d %12.1f %12.1f\n", sc->name, nr_users, per_user_ns, shared_ns);
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	if(iterations <= 0) iterations = DEFAULT_ITERATIONS;
+
+	srand(1);
+	printf("%-22s %8s %8s %8s %10s %10s\n", "scenario",
+			"raw(B)", "packed", "ratio", "enc(ns)", "dec(ns)");
+	for(int i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+		run_scenario(&scenarios[i], iterations);
+
+	printf("\n%-22s %8s %12s %12s\n", "tick encode", "users",
+			"each(ns)", "shared(ns)");
+	int nr_users[] = {1, USER_CNT, 50};
+	for(int i = 0; i < sizeof(nr_users) / sizeof(nr_users[0]); i++)
+		run_fan_out(&scenarios[1], nr_users[i], iterations / nr_users[i] + 1);
+	return 0;
+}
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "zerocopy.h"
+
+/* loopback benchmark of zero-copy sends
+ *
+ *   usage: ./bench_zerocopy [megabytes per run]
+ *
+ *   a sender thread writes frames of a few sizes to a TCP connection
+ *   on loopback with zero-copy off and on, a receiver thread drains
+ *   it. Prints throughput, CPU time of the sender per GB and the
+ *   fraction of zero-copy sends the kernel completed by copying.
+ *
+ *   on loopback the kernel has to copy data for the receiving socket
+ *   anyway, so completions are mostly reported as copied and zero-copy
+ *   can't win here. Run it against a remote receiver to see the gain.
+ */
+
+#define DEFAULT_MEGABYTES 1024
+#define NR_BUFS 128
+
+typedef struct buf_t {
+	atomic_int refs;
+	uint8_t data[];
+} buf_t;
+
+static void buf_get(void *p) {
+	atomic_fetch_add(&((buf_t *)p)->refs, 1);
+}
+
+static void buf_put(void *p) {
+	atomic_fetch_sub(&((buf_t *)p)->refs, 1);
+}
+
+double cpu_seconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *drain(void *arg) {
+	int fd = *(int *)arg;
+	static uint8_t sink[1 << 16];
+	while(recv(fd, sink, sizeof(sink), 0) > 0);
+	return NULL;
+}
+
+void connect_loopback(int *send_fd, int *recv_fd) {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	if(listener < 0
+	|| bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	|| listen(listener, 1) < 0
+	|| getsockname(listener, (struct sockaddr *)&addr, &addr_len) < 0)
+		eprintf("fail to listen on loopback\n");
+
+	*send_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(*send_fd < 0 || connect(*send_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		eprintf("fail to connect to loopback\n");
+	*recv_fd = accept(listener, NULL, NULL);
+	if(*recv_fd < 0)
+		eprintf("fail to accept on loopback\n");
+	close(listener);
+}
+
+void run(size_t frame_size, size_t total_bytes, int zerocopy) {
+	int send_fd, recv_fd;
+	connect_loopback(&send_fd, &recv_fd);
+
+	pthread_t receiver;
+	pthread_create(&receiver, NULL, drain, &recv_fd);
+
+	buf_t *bufs[NR_BUFS];
+	for(int i = 0; i < NR_BUFS; i++) {
+		bufs[i] = malloc(sizeof(buf_t) + frame_size);
+		if(!bufs[i]) eprintf("fail to alloc frames\n");
+		atomic_init(&bufs[i]->refs, 0);
+		memset(bufs[i]->data, i, frame_size);
+	}
+
+	zc_socket_t zc;
+	zc_init(&zc, send_fd, buf_get, buf_put);
+	if(!zerocopy) zc.enabled = false;
+
+	size_t nr_frames = total_bytes / frame_size, nr_waits = 0;
+	double st_wall = cpu_seconds(CLOCK_MONOTONIC);
+	double st_cpu = cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+
+	for(size_t n = 0; n < nr_frames; n++) {
+		buf_t *buf = bufs[n % NR_BUFS];
+
+		// the frame must not change while the kernel still holds it
+		if(atomic_load(&buf->refs) > 0) {
+			nr_waits ++;
+			while(zc_reap(&zc), atomic_load(&buf->refs) > 0);
+		}
+		buf->data[0] = n;
+
+		struct iovec iov = {buf->data, frame_size};
+		if(zc_send_iov(&zc, &iov, 1, buf) < 0)
+			eprintf("fail to send\n");
+	}
+
+	double cpu = cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - st_cpu;
+	double wall = cpu_seconds(CLOCK_MONOTONIC) - st_wall;
+
+	shutdown(send_fd, SHUT_WR);
+	pthread_join(receiver, NULL);
+	zc_reap(&zc);
+	zc_release_all(&zc);
+
+	double gb = (double)nr_frames * frame_size / 1e9;
+	printf("%8zu %4s %10.2f %10.3f %10.1f%% %8zu\n", frame_size,
+			zerocopy ? "on" : "off", gb / wall, cpu / gb,
+			zc.nr_sent ? 100.0 * zc.nr_copied / zc.nr_sent : 0.0, nr_waits);
+
+	for(int i = 0; i < NR_BUFS; i++)
+		free(bufs[i]);
+	close(send_fd);
+	close(recv_fd);
+}
+
+int main(int argc, char *argv[]) {
+	int megabytes = argc > 1 ? atoi(argv[1]) : DEFAULT_MEGABYTES;
+	if(megabytes <= 0) megabytes = DEFAULT_MEGABYTES;
+
+	printf("%8s %4s %10s %10s %11s %8s\n", "frame(B)", "zc",
+			"GB/s", "cpu(s/GB)", "copied", "waits");
+	size_t frame_sizes[] = {600, 16 << 10, 64 << 10};
+	for(int i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+		run(frame_sizes[i], (size_t)megabytes << 20, false);
+		run(frame_sizes[i], (size_t)megabytes << 20, true);
+	}
+	return 0;
+}
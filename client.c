@@ -1,16 +1,41 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <pthread.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
 
 #include "common.h"
+#include "codec.h"
+#include "shmring.h"
 
 #define LINE_MAX_LEN 20
 
-#define wlog(fmt, ...) write_log("%s:%d: " fmt, user_name, __LINE__, ## __VA_ARGS__)
-#define wlogi(fmt, ...) write_log("%s:%d: ==> " fmt, user_name, __LINE__, ## __VA_ARGS__)
+#define RENDER_FPS 30
+
+#define REPLY_TIMEOUT_MS 5000
+
+// hidden by -std=c11
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+
+#define LOG_FILE "log.txt"
+#define LOG_FILE_BUFFER_SIZE (64 * 1024)
+#define LOG_FLUSH_TICKS (RENDER_FPS / 5)
+
+#define wlog_at(level, fmt, ...) do { \
+	if((level) >= LOG_COMPILE_LEVEL && (level) >= client_log_level) \
+		write_log("%s:%d: " fmt, user_name, __LINE__, ## __VA_ARGS__); \
+} while(0)
+
+#define wlog(fmt, ...) wlog_at(LOG_LEVEL_INFO, fmt, ## __VA_ARGS__)
+#define wlogi(fmt, ...) wlog_at(LOG_LEVEL_DEBUG, "==> " fmt, ## __VA_ARGS__)
 
 static int scr_actual_w = 0;
 static int scr_actual_h = 0;
@@ -23,6 +48,8 @@ static char *user_state_s[] = {
 	[USER_STATE_NOT_LOGIN] = "not login",
 	[USER_STATE_LOGIN]     = "login",
 	[USER_STATE_BATTLE]    = "battle",
+	[USER_STATE_WAIT_TO_BATTLE] = "invited",
+	[USER_STATE_MATCHING]  = "matching",
 };
 
 static int client_fd = -1;
@@ -30,12 +57,17 @@ static int client_fd = -1;
 static struct termio raw_termio;
 
 static char *server_addr = "127.0.0.1";
+static char *unix_path = NULL;
 
-static int global_serv_message = -1;
+// talk over shared memory rings, client_fd only tells hangup
+static int use_shm = false;
+static shm_endpoint_t shm_ep;
 
-pthread_mutex_t cursor_lock = PTHREAD_MUTEX_INITIALIZER;
+// battle watched from ./spectator, -1 when playing
+static int spectate_bid = -1;
 
-char *readline();
+static int client_log_level = LOG_LEVEL_INFO;
+static FILE *log_fp = NULL;
 
 void write_log(const char *format, ...);
 
@@ -47,16 +79,25 @@ void server_say(const char *message);
 
 void tiny_debug(const char *output);
 
-char *accept_input(const char *prompt);
+void error(const char *output);
 
-int accept_yesno(const char *prompt);
+void accept_input(const char *prompt, void (*done)(char *line));
 
 void resume_and_exit(int status);
 
 void display_user_state();
 
+void keep_session_token(server_message_t *psm);
+
+int pass_shm_channel();
+int open_shm_channel();
+
 void flip_screen();
 
+void fb_invalidate();
+
+void draw_current_ui();
+
 struct catalog_t {
 	pos_t pos;
 	const char *title;
@@ -95,6 +136,23 @@ static char *server_message_s[] = {
 	[SERVER_MESSAGE_BATTLE_DISBANDED] = "SERVER_MESSAGE_BATTLE_DISBANDED",
 	[SERVER_MESSAGE_BATTLE_INFORMATION] = "SERVER_MESSAGE_BATTLE_INFORMATION",
 	[SERVER_MESSAGE_YOUR_MAGAZINE_IS_EMPTY] = "SERVER_MESSAGE_YOUR_MAGAZINE_IS_EMPTY",
+	[SERVER_MESSAGE_TERRAIN] = "SERVER_MESSAGE_TERRAIN",
+	[SERVER_MESSAGE_MATCH_FOUND] = "SERVER_MESSAGE_MATCH_FOUND",
+	[SERVER_MESSAGE_PRESENCE] = "SERVER_MESSAGE_PRESENCE",
+	[SERVER_RESPONSE_MATCH_QUEUED] = "SERVER_RESPONSE_MATCH_QUEUED",
+	[SERVER_RESPONSE_MATCH_LEFT] = "SERVER_RESPONSE_MATCH_LEFT",
+	[SERVER_RESPONSE_SHM_CHANNEL_READY] = "SERVER_RESPONSE_SHM_CHANNEL_READY",
+	[SERVER_RESPONSE_CHAT_THROTTLED] = "SERVER_RESPONSE_CHAT_THROTTLED",
+	[SERVER_RESPONSE_FRIEND_REQUEST_SENT] = "SERVER_RESPONSE_FRIEND_REQUEST_SENT",
+	[SERVER_RESPONSE_FRIEND_REQUEST_FAIL] = "SERVER_RESPONSE_FRIEND_REQUEST_FAIL",
+	[SERVER_RESPONSE_NOT_YOUR_FRIEND] = "SERVER_RESPONSE_NOT_YOUR_FRIEND",
+	[SERVER_RESPONSE_USER_PAGE] = "SERVER_RESPONSE_USER_PAGE",
+	[SERVER_RESPONSE_SESSION_RESUMED] = "SERVER_RESPONSE_SESSION_RESUMED",
+	[SERVER_RESPONSE_RESUME_FAIL] = "SERVER_RESPONSE_RESUME_FAIL",
+	[SERVER_RESPONSE_HEARTBEAT] = "SERVER_RESPONSE_HEARTBEAT",
+	[SERVER_MESSAGE_FRIEND_REQUEST] = "SERVER_MESSAGE_FRIEND_REQUEST",
+	[SERVER_MESSAGE_FRIEND_ADDED] = "SERVER_MESSAGE_FRIEND_ADDED",
+	[SERVER_MESSAGE_FRIEND_REMOVED] = "SERVER_MESSAGE_FRIEND_REMOVED",
 	[SERVER_MESSAGE_YOU_ARE_DEAD] = "SERVER_MESSAGE_YOU_ARE_DEAD",
 	[SERVER_MESSAGE_YOU_ARE_SHOOTED] = "SERVER_MESSAGE_YOU_ARE_SHOOTED",
 	[SERVER_MESSAGE_YOU_ARE_TRAPPED_IN_MAGMA] = "SERVER_MESSAGE_YOU_ARE_TRAPPED_IN_MAGMA",
@@ -109,7 +167,41 @@ void strlwr(char *s) {
 	}
 }
 
-int connect_to_server() {
+/* with `nonblock` connecting goes on after return, the socket polls
+ * writable once it is done */
+int start_connect(int sockfd, struct sockaddr *addr, socklen_t len, int nonblock) {
+	if(nonblock)
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+	if(connect(sockfd, addr, len) == -1 && !(nonblock && errno == EINPROGRESS))
+		return -1;
+	return 0;
+}
+
+int connect_to_unix_server(int nonblock) {
+	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if(sockfd < 0) {
+		eprintf("Create Socket Failed!\n");
+	}
+
+	struct sockaddr_un servaddr;
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sun_family = AF_UNIX;
+	strncpy(servaddr.sun_path, unix_path, sizeof(servaddr.sun_path) - 1);
+
+	if(start_connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr), nonblock) == -1) {
+		wlog("can not connect to server %s\n", unix_path);
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+int connect_to_server(int nonblock) {
+	if(unix_path)
+		return connect_to_unix_server(nonblock);
+
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
 	if(sockfd < 0) {
@@ -120,34 +212,54 @@ int connect_to_server() {
 	memset(&servaddr, 0, sizeof(servaddr));
 
 	servaddr.sin_family = AF_INET;
-	servaddr.sin_port = htons(PORT);
+	servaddr.sin_port = htons(spectate_bid >= 0 ? SPECTATOR_PORT : PORT);
 	servaddr.sin_addr.s_addr = inet_addr(server_addr);
 
-	if(connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
-		eprintf("Can Not Connect To Server %s!\n", server_addr);
+	if(start_connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr), nonblock) == -1) {
+		wlog("can not connect to server %s\n", server_addr);
+		close(sockfd);
+		return -1;
 	}
 
 	return sockfd;
 }
 
-void wrap_send(client_message_t *pcm) {
-	size_t total_len = 0;
-	while(total_len < sizeof(client_message_t)) {
-		size_t len = send(client_fd, pcm + total_len, sizeof(client_message_t) - total_len, 0);
-		if(len < 0) {
-			loge("broken pipe\n");
-		}
-
-		total_len += len;
+void shm_wrap_send(client_message_t *pcm) {
+	struct iovec iov = {pcm, sizeof(client_message_t)};
+	while(iov.iov_len > 0) {
+		// the server drains its ring fast, wait a little while full
+		if(shm_send(&shm_ep, &iov, 1) == 0)
+			poll(NULL, 0, 1);
 	}
 }
 
-void wrap_recv(server_message_t *psm) {
+/* liveness
+ *
+ *   a heartbeat goes to the server whenever nothing else has for
+ *   HEARTBEAT_MS and the server answers it, so hearing nothing for
+ *   IDLE_TIMEOUT_MS means the connection is dead even when no error
+ *   says so. The spectator server is not asked.
+ */
+static struct {
+	int quiet_ticks;     // since we last sent
+	int silent_ticks;    // since we last heard from the server
+} liveness;
+
+void wrap_send(client_message_t *pcm) {
+	liveness.quiet_ticks = 0;
+	if(use_shm) {
+		shm_wrap_send(pcm);
+		return;
+	}
+
 	size_t total_len = 0;
-	while(total_len < sizeof(server_message_t)) {
-		size_t len = recv(client_fd, psm + total_len, sizeof(server_message_t) - total_len, 0);
+	while(total_len < sizeof(client_message_t)) {
+		ssize_t len = send(client_fd, (char *)pcm + total_len, sizeof(client_message_t) - total_len, MSG_NOSIGNAL);
 		if(len < 0) {
-			loge("broken pipe\n");
+			if(errno == EINTR)
+				continue;
+			wlog("fail to send to server\n");
+			return;
 		}
 
 		total_len += len;
@@ -160,6 +272,104 @@ void send_command(int command) {
 	wrap_send(&cm);
 }
 
+// return -1 if the server has been silent too long
+int liveness_tick(int ticks) {
+	if(spectate_bid >= 0) return 0;
+
+	liveness.quiet_ticks += ticks;
+	if(liveness.quiet_ticks >= HEARTBEAT_MS * RENDER_FPS / 1000)
+		send_command(CLIENT_COMMAND_HEARTBEAT);
+
+	liveness.silent_ticks += ticks;
+	return liveness.silent_ticks >= IDLE_TIMEOUT_MS * RENDER_FPS / 1000 ? -1 : 0;
+}
+
+/* pending reply
+ *
+ *   a UI action registers the responses it waits for together with a
+ *   continuation before sending its request. Keys are ignored while a
+ *   reply is pending. The event loop calls the continuation when a
+ *   matching response has been handled, with REPLY_TIMEOUT when no
+ *   reply arrives within REPLY_TIMEOUT_MS, or with REPLY_BROKEN when
+ *   the connection is lost.
+ */
+#define REPLY_TIMEOUT -1
+#define REPLY_BROKEN  -2
+
+static struct {
+	const int *expect;
+	int nr_expect;
+	int ticks_left;
+	void (*done)(int message);
+} pending_reply;
+
+void await_reply(const int *expect, int nr_expect, void (*done)(int message)) {
+	pending_reply.expect = expect;
+	pending_reply.nr_expect = nr_expect;
+	pending_reply.ticks_left = REPLY_TIMEOUT_MS * RENDER_FPS / 1000;
+	pending_reply.done = done;
+}
+
+int reply_pending() {
+	return pending_reply.done != NULL;
+}
+
+void complete_reply(int message) {
+	void (*done)(int) = pending_reply.done;
+	pending_reply.done = NULL;
+	pending_reply.expect = NULL;
+	pending_reply.nr_expect = 0;
+	if(done) done(message);
+}
+
+void check_pending_reply(int message) {
+	for(int i = 0; i < pending_reply.nr_expect; i++) {
+		if(pending_reply.expect[i] == message) {
+			complete_reply(message);
+			break;
+		}
+	}
+}
+
+void pending_reply_tick(int ticks) {
+	if(!reply_pending()) return;
+
+	pending_reply.ticks_left -= ticks;
+	if(pending_reply.ticks_left <= 0)
+		complete_reply(REPLY_TIMEOUT);
+}
+
+#define NR_ELEMS(arr) (sizeof(arr) / sizeof(arr[0]))
+
+static const int login_replies[] = {
+	SERVER_RESPONSE_LOGIN_SUCCESS,
+	SERVER_RESPONSE_YOU_HAVE_LOGINED,
+	SERVER_RESPONSE_LOGIN_FAIL_UNREGISTERED_USERID,
+	SERVER_RESPONSE_LOGIN_FAIL_ERROR_PASSWORD,
+	SERVER_RESPONSE_LOGIN_FAIL_DUP_USERID,
+	SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS,
+};
+
+static const int launch_battle_replies[] = {
+	SERVER_RESPONSE_LAUNCH_BATTLE_SUCCESS,
+	SERVER_RESPONSE_LAUNCH_BATTLE_FAIL,
+};
+
+/* report a failed wait, return true if `message` is a reply */
+int check_reply(int message) {
+	if(message == REPLY_TIMEOUT) {
+		wlog("wait for server reply timeout\n");
+		error("server doesn't reply, try again later");
+		return false;
+	}else if(message == REPLY_BROKEN) {
+		wlog("connection broken while waiting for reply\n");
+		error("lost connection to server");
+		return false;
+	}
+	wlog("wait until message=%s\n", server_message_s[message]);
+	return true;
+}
+
 /* all buttons */
 enum {
 	buttonLogin = 0,
@@ -171,13 +381,24 @@ enum {
 	buttonLogout = 6,
 };
 
-int button_login() {
-	wlog("call button handler %s\n", __func__);
-	wlogi("require name\n");
-	char *name = accept_input("your name: ");
-	wlogi("input name '%s'\n", name);
+/* name and password of login and register are asked one after
+ * another, `account_name` keeps the name between the two prompts */
+static char *account_name = NULL;
 
-	char *password = accept_input("password: ");
+void rebuild_friend_list();
+
+void button_login_reply(int message) {
+	if(check_reply(message) && message == SERVER_RESPONSE_LOGIN_SUCCESS) {
+		user_name = account_name;
+		wlogi("set user name to '%s'\n", account_name);
+		// presence may have come first and listed us
+		rebuild_friend_list();
+	}
+	draw_current_ui();
+}
+
+void button_login_password(char *password) {
+	char *name = account_name;
 	wlogi("input password '%s'\n", password);
 
 	bottom_bar_output(0, "try to login with name '%s' ...", name);
@@ -187,39 +408,27 @@ int button_login() {
 	cm.command = CLIENT_COMMAND_USER_LOGIN;
 	strncpy(cm.user_name, name, USERNAME_SIZE - 1);
 	strncpy(cm.password, password, PASSWORD_SIZE - 1);
+	free(password);
 	wlogi("send login message to server\n");
-	global_serv_message = -1;
+	await_reply(login_replies, NR_ELEMS(login_replies), button_login_reply);
 	wrap_send(&cm);
+}
 
-	do {
-		if(global_serv_message == SERVER_RESPONSE_LOGIN_SUCCESS
-		|| global_serv_message == SERVER_RESPONSE_YOU_HAVE_LOGINED
-		|| global_serv_message == SERVER_RESPONSE_LOGIN_FAIL_UNREGISTERED_USERID
-		|| global_serv_message == SERVER_RESPONSE_LOGIN_FAIL_ERROR_PASSWORD
-		|| global_serv_message == SERVER_RESPONSE_LOGIN_FAIL_DUP_USERID
-		|| global_serv_message == SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS)
-			break;
-	} while(1);
-	wlog("wait until message=%s\n", server_message_s[global_serv_message]);
-
-	if(global_serv_message == SERVER_RESPONSE_LOGIN_SUCCESS)
-	{
-		send_command(CLIENT_COMMAND_FETCH_ALL_FRIENDS);
-		user_name = name;
-	}
-
-	wlogi("set user name to '%s'\n", name);
-
-	return 0;
+void button_login_name(char *name) {
+	wlogi("input name '%s'\n", name);
+	account_name = name;
+	accept_input("password: ", button_login_password);
 }
 
-int button_register() {
+int button_login() {
 	wlog("call button handler %s\n", __func__);
 	wlogi("require name\n");
-	char *name = accept_input("your name: ");
-	wlogi("input name '%s'\n", name);
+	accept_input("your name: ", button_login_name);
+	return 0;
+}
 
-	char *password = accept_input("password: ");
+void button_register_password(char *password) {
+	char *name = account_name;
 	wlogi("input password '%s'\n", password);
 
 	bottom_bar_output(0, "register your name '%s' to server...", name);
@@ -229,9 +438,24 @@ int button_register() {
 	cm.command = CLIENT_COMMAND_USER_REGISTER;
 	strncpy(cm.user_name, name, USERNAME_SIZE - 1);
 	strncpy(cm.password, password, PASSWORD_SIZE - 1);
+	free(password);
+	free(name);
+	account_name = NULL;
 	wlogi("send register message to server\n");
 	wrap_send(&cm);
+	draw_current_ui();
+}
+
+void button_register_name(char *name) {
+	wlogi("input name '%s'\n", name);
+	account_name = name;
+	accept_input("password: ", button_register_password);
+}
 
+int button_register() {
+	wlog("call button handler %s\n", __func__);
+	wlogi("require name\n");
+	accept_input("your name: ", button_register_name);
 	return 0;
 }
 
@@ -241,41 +465,36 @@ int button_quit_game() {
 	return 0;
 }
 
+void button_launch_battle_reply(int message) {
+	check_reply(message);
+	draw_current_ui();
+}
+
 int button_launch_battle() {
 	wlog("call button handler %s\n", __func__);
 	wlogi("send `launch battle` message to server\n");
-	global_serv_message=-1;
+	await_reply(launch_battle_replies, NR_ELEMS(launch_battle_replies), button_launch_battle_reply);
 	send_command(CLIENT_COMMAND_LAUNCH_BATTLE);
-	/* wait for server reply */
-	do {
-		if(global_serv_message == SERVER_RESPONSE_LAUNCH_BATTLE_SUCCESS
-		|| global_serv_message == SERVER_RESPONSE_LAUNCH_BATTLE_FAIL)
-			break;
-	} while(1);
-	wlog("wait until message=%s\n", server_message_s[global_serv_message]);
 	return 0;
 }
 
-int button_invite_user() {
-	wlog("call button handler %s\n", __func__);
-	/* send invitation */
-	wlogi("ask friend's name\n");
-	char *name = accept_input("invite who to your battle: ");
+void button_invite_user_name(char *name) {
 	wlogi("friend name '%s'\n", name);
 	client_message_t cm;
 	memset(&cm, 0, sizeof(client_message_t));
 	cm.command = CLIENT_COMMAND_LAUNCH_BATTLE;
 	strncpy(cm.user_name, name, USERNAME_SIZE - 1);
+	free(name);
 	wlogi("send `launch battle` and invitation to server\n");
-	global_serv_message=-1;
+	await_reply(launch_battle_replies, NR_ELEMS(launch_battle_replies), button_launch_battle_reply);
 	wrap_send(&cm);
-	/* wait for server reply */
-	do {
-		if(global_serv_message == SERVER_RESPONSE_LAUNCH_BATTLE_SUCCESS
-		|| global_serv_message == SERVER_RESPONSE_LAUNCH_BATTLE_FAIL)
-			break;
-	} while(1);
-	wlog("wait until message=%s\n", server_message_s[global_serv_message]);
+}
+
+int button_invite_user() {
+	wlog("call button handler %s\n", __func__);
+	/* send invitation */
+	wlogi("ask friend's name\n");
+	accept_input("invite who to your battle: ", button_invite_user_name);
 	return 0;
 }
 
@@ -291,6 +510,7 @@ int button_logout() {
 	user_name = "<unknown>";
 	user_state = USER_STATE_NOT_LOGIN;
 	send_command(CLIENT_COMMAND_USER_LOGOUT);
+	draw_current_ui();
 	bottom_bar_output(0, "logout");
 	return -1;
 }
@@ -401,57 +621,116 @@ void load_cursor_pos() {
 	printf("\033u");
 }
 
-void lock_cursor() {
-	pthread_mutex_lock(&cursor_lock);
+/* menus are laid out for SCR_W x SCR_H, a smaller terminal is
+ * treated as that size, a larger one shows more of battlefield */
+void init_scr_wh() {
+	struct winsize ws;
+	if(ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1) {
+		ws.ws_col = SCR_W;
+		ws.ws_row = SCR_H;
+	}
+	scr_actual_w = ws.ws_col < SCR_W ? SCR_W : ws.ws_col;
+	scr_actual_h = ws.ws_row < SCR_H ? SCR_H : ws.ws_row;
+}
+
+/* key decoder
+ *
+ *   bytes read from stdin are fed one by one, escape sequences
+ *   (arrow keys etc.) are swallowed, KEY_NONE is returned while a
+ *   sequence is incomplete.
+ */
+#define KEY_NONE -1
+
+int decode_key(unsigned char ch) {
+	static enum { KEY_STATE_NORMAL, KEY_STATE_ESC, KEY_STATE_CSI } state;
+	switch(state) {
+		case KEY_STATE_ESC:
+			state = (ch == '[' || ch == 'O') ? KEY_STATE_CSI : KEY_STATE_NORMAL;
+			return KEY_NONE;
+		case KEY_STATE_CSI:
+			if(0x40 <= ch && ch <= 0x7e)
+				state = KEY_STATE_NORMAL;
+			return KEY_NONE;
+		default:
+			if(ch == '\033') {
+				state = KEY_STATE_ESC;
+				return KEY_NONE;
+			}
+			return ch;
+	}
 }
 
-void unlock_cursor() {
-	pthread_mutex_unlock(&cursor_lock);
+/* functions to maintain bar
+ *
+ *   `accept_input` shows a prompt in the bottom bar and feeds the
+ *   following keys into a line editor. `done` receives a strdup'ed
+ *   copy of the line once a non-empty line is entered.
+ */
+static struct {
+	int active;
+	char prompt[100];
+	char line[LINE_MAX_LEN];
+	int len;
+	void (*done)(char *line);
+	char deferred[256];
+} input;
+
+void vbottom_bar_output(int line, const char *format, va_list ap);
+
+void input_redraw(const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	vbottom_bar_output(0, format, ap);
+	va_end(ap);
 }
 
-void init_scr_wh() {
-	struct winsize ws;
-	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
-	scr_actual_w = ws.ws_col;
-	scr_actual_h = ws.ws_row;
+/* put cursor back to the end of the edited line after drawing
+ * somewhere else */
+void restore_input_cursor() {
+	if(input.active)
+		set_cursor(strlen(input.prompt) + input.len, scr_actual_h - 1);
 }
 
-/* functions to maintain bar */
-char *readline() {
-	char ch;
-	int line_ptr = 0;
-	char line[LINE_MAX_LEN];
-	memset(line, 0, sizeof(line));
-	lock_cursor();
-	echo_off();
-	disable_buffer();
-	while((ch = fgetc(stdin)) != '\n') {
-		switch(ch) {
-			case '\033':{
-				ch = fgetc(stdin);
-				ch = fgetc(stdin);
-				assert('A' <= ch && ch <= 'D');
+void accept_input(const char *prompt, void (*done)(char *line)) {
+	strncpy(input.prompt, prompt, sizeof(input.prompt) - 1);
+	memset(input.line, 0, sizeof(input.line));
+	input.len = 0;
+	input.done = done;
+	input.deferred[0] = 0;
+	input.active = true;
+	show_cursor();
+	input_redraw("%s", input.prompt);
+}
+
+void input_key(int ch) {
+	switch(ch) {
+		case '\n':
+			if(input.len == 0) {
+				input_redraw("%s", input.prompt);
 				break;
 			}
-			case 0x7f: //handle backspace(sends delete)
-				if(line_ptr==0)break;
-				line[--line_ptr]='\0';
-				fputc(ch,stdout);
+			input.line[input.len] = 0;
+			input.active = false;
+			hide_cursor();
+			if(input.deferred[0])
+				bottom_bar_output(0, "%s", input.deferred);
+			fflush(stdout);
+			input.done(strdup(input.line));
+			break;
+		case 0x7f: //handle backspace(sends delete)
+			if(input.len == 0) break;
+			input.line[--input.len] = '\0';
+			printf("\b \b");
+			fflush(stdout);
+			break;
+		default:
+			if(input.len < sizeof(input.line) - 1
+			&& 0x20 <= ch && ch < 0x80) {
+				input.line[input.len ++] = ch;
+				fputc(ch, stdout);
 				fflush(stdout);
-				break;
-			default: {
-				if(line_ptr < sizeof(line) - 1
-				&& 0x20 <= ch && ch < 0x80) {
-					line[line_ptr ++] = ch;
-					fputc(ch, stdout);
-					fflush(stdout);
-				}
 			}
-		}
 	}
-	line[line_ptr] = 0;
-	unlock_cursor();
-	return strdup(line);
 }
 
 char *sformat(const char *format, ...) {
@@ -468,38 +747,62 @@ char *sformat(const char *format, ...) {
 	return text;
 }
 
-void bottom_bar_output(int line, const char *format, ...) {
+void vbottom_bar_output(int line, const char *format, va_list ap) {
 	assert(line <= 0);
-	lock_cursor();
-	set_cursor(0, SCR_H - 1 + line);
+	set_cursor(0, scr_actual_h - 1 + line);
 	for(int i = 0; i < scr_actual_w; i++)
 		printf(" ");
-	set_cursor(0, SCR_H - 1 + line);
+	set_cursor(0, scr_actual_h - 1 + line);
 
-	va_list ap;
-	va_start(ap, format);
 	vfprintf(stdout, format, ap);
-	va_end(ap);
 
+	restore_input_cursor();
 	fflush(stdout);
+}
 
-	unlock_cursor();
+/* while a line is being edited, messages for the last line are kept
+ * and shown after the line is entered */
+void bottom_bar_output(int line, const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	if(line == 0 && input.active) {
+		vsnprintf(input.deferred, sizeof(input.deferred), format, ap);
+	}else{
+		vbottom_bar_output(line, format, ap);
+	}
+	va_end(ap);
 }
 
+/* log file is opened once and fully buffered, the event loop flushes
+ * it every LOG_FLUSH_TICKS frames and exit() flushes the rest */
 void write_log(const char *format, ...) {
-	FILE *fp = fopen("log.txt", "a+");
+	if(!log_fp) return;
 
 	va_list ap;
 	va_start(ap, format);
-	vfprintf(fp, format, ap);
+	vfprintf(log_fp, format, ap);
 	va_end(ap);
+}
 
-	fclose(fp);
+void flush_log() {
+	if(log_fp) fflush(log_fp);
 }
 
+void open_log() {
+	client_log_level = log_parse_level(getenv("LOG_LEVEL"), client_log_level);
+	if(client_log_level >= LOG_LEVEL_NONE)
+		return;
+
+	log_fp = fopen(LOG_FILE, "a+");
+	if(!log_fp) return;
+	setvbuf(log_fp, NULL, _IOFBF, LOG_FILE_BUFFER_SIZE);
+}
+
+#define USER_STATE_FMT "name: %s  HP: %d  bullets: %d  state: %s"
+
 void display_user_state() {
 	assert(user_state <= sizeof(user_state_s) / sizeof(user_state_s[0]));
-	bottom_bar_output(-1, "name: %s  HP: %d  bullets: %d  state: %s", user_name, user_hp, user_bullets, user_state_s[user_state]);
+	bottom_bar_output(-1, USER_STATE_FMT, user_name, user_hp, user_bullets, user_state_s[user_state]);
 }
 
 void server_say(const char *message) {
@@ -514,37 +817,13 @@ void error(const char *output) {
 	bottom_bar_output(0, "\033[1;31m[%s]\033[0m %s", "ERROR", output);
 }
 
-char *accept_input(const char *prompt) {
-	char *line;
-	show_cursor();
-	do
-	{
-		bottom_bar_output(0, prompt);
-		line = readline();
-	}while(strncmp(line,"",1)==0);
-	hide_cursor();
-	return line;
-}
-
-int accept_yesno(const char *prompt) {
-	while(1) {
-		char *input = accept_input(prompt);
-		strlwr(input);
-		if(strcmp(input, "y") == 0
-		|| strcmp(input, "yes") == 0) {
-			return true;
-		}else if(strcmp(input, "n") == 0
-		|| strcmp(input, "no") == 0) {
-			return false;
-		}
-	}
-}
-
 void resume_and_exit(int status) {
-	send_command(CLIENT_COMMAND_USER_QUIT);
+	if(spectate_bid < 0)
+		send_command(CLIENT_COMMAND_USER_QUIT);
 	wrap_set_term_attr(&raw_termio);
-	set_cursor(0, SCR_H);
+	set_cursor(0, scr_actual_h - 1);
 	show_cursor();
+	shm_channel_close(&shm_ep);
 	close(client_fd);
 	wlog("====================EXIT====================\n\n\n");
 	exit(status);
@@ -556,11 +835,42 @@ int cmd_quit(char *args) {
 	return 0;
 }
 
+/* users are listed a window at a time, as many as fit the bottom
+ * bar, `ulist more` fetches the next window after `ulist_cursor` */
+static char ulist_prefix[USERNAME_SIZE];
+static char ulist_cursor[USERNAME_SIZE];
+
+int ulist_window() {
+	int n = (scr_actual_w - 24) / (USERNAME_SIZE + 1);
+	if(n < 1) return 1;
+	return n < USER_PAGE_SIZE ? n : USER_PAGE_SIZE;
+}
+
 int cmd_ulist(char *args) {
-	if(user_state==USER_STATE_NOT_LOGIN)
+	if(user_state==USER_STATE_NOT_LOGIN) {
 		bottom_bar_output(0,"Please login first!");
-	else
-		send_command(CLIENT_COMMAND_FETCH_ALL_USERS);
+		return 0;
+	}
+
+	if(args && strcmp(args, "more") == 0) {
+		if(!ulist_cursor[0]) {
+			bottom_bar_output(0, "no more users");
+			return 0;
+		}
+	}else{
+		memset(ulist_prefix, 0, sizeof(ulist_prefix));
+		memset(ulist_cursor, 0, sizeof(ulist_cursor));
+		if(args)
+			strncpy(ulist_prefix, args, USERNAME_SIZE - 1);
+	}
+
+	client_message_t cm;
+	memset(&cm, 0, sizeof(client_message_t));
+	cm.command = CLIENT_COMMAND_LIST_USERS;
+	strncpy(cm.user_name, ulist_prefix, USERNAME_SIZE - 1);
+	strncpy(cm.cursor, ulist_cursor, USERNAME_SIZE - 1);
+	cm.nr_wanted = ulist_window();
+	wrap_send(&cm);
 	return 0;
 }
 
@@ -577,6 +887,17 @@ int cmd_invite(char *args) {
 	return 0;
 }
 
+void cmd_yell_message(char *msg)
+{
+	client_message_t cm;
+	memset(&cm, 0, sizeof(client_message_t));
+	cm.command = CLIENT_COMMAND_SEND_MESSAGE;
+	cm.user_name[0]='\0';
+	strncpy(cm.message, msg, MSG_SIZE - 1);
+	free(msg);
+	wrap_send(&cm);
+}
+
 int cmd_yell(char *args)
 {
 	if(user_state==USER_STATE_NOT_LOGIN)
@@ -584,15 +905,41 @@ int cmd_yell(char *args)
 		bottom_bar_output(0,"Please login first!");
 		return 0;
 	}
-	char *msg=accept_input("Yell at all users: ");
+	accept_input("Yell at all users: ", cmd_yell_message);
+	return 0;
+}
+
+void cmd_say_message(char *msg) {
 	client_message_t cm;
-	cm.command = CLIENT_COMMAND_SEND_MESSAGE;
-	cm.user_name[0]='\0';
+	memset(&cm, 0, sizeof(client_message_t));
+	cm.command = CLIENT_COMMAND_BATTLE_MESSAGE;
 	strncpy(cm.message, msg, MSG_SIZE - 1);
+	free(msg);
 	wrap_send(&cm);
+}
+
+int cmd_say(char *args) {
+	if(user_state != USER_STATE_BATTLE) {
+		bottom_bar_output(0, "you're not in battle");
+		return 0;
+	}
+	accept_input("Say to your battle: ", cmd_say_message);
 	return 0;
 }
 
+static char tell_target[USERNAME_SIZE];
+
+void cmd_tell_message(char *msg)
+{
+	client_message_t cm;
+	memset(&cm, 0, sizeof(client_message_t));
+	cm.command = CLIENT_COMMAND_SEND_MESSAGE;
+	strncpy(cm.user_name, tell_target, USERNAME_SIZE - 1);
+	strncpy(cm.message, msg, MSG_SIZE - 1);
+	free(msg);
+	wrap_send(&cm);
+}
+
 int cmd_tell(char *args)
 {
 	if(user_state==USER_STATE_NOT_LOGIN)
@@ -605,29 +952,77 @@ int cmd_tell(char *args)
 		bottom_bar_output(0, "Input a friend, or try \"yell\"");
 		return 0;
 	}
-	char *msg=accept_input(sformat("Speak to %s: ",args));
+	strncpy(tell_target, args, USERNAME_SIZE - 1);
+	accept_input(sformat("Speak to %s: ",args), cmd_tell_message);
+	return 0;
+}
+
+int send_friend_command(int command, char *args) {
+	if(user_state == USER_STATE_NOT_LOGIN) {
+		bottom_bar_output(0, "Please login first!");
+		return 0;
+	}
+	if(!args) {
+		bottom_bar_output(0, "Input a user");
+		return 0;
+	}
 	client_message_t cm;
-	cm.command = CLIENT_COMMAND_SEND_MESSAGE;
+	memset(&cm, 0, sizeof(client_message_t));
+	cm.command = command;
 	strncpy(cm.user_name, args, USERNAME_SIZE - 1);
-	strncpy(cm.message, msg, MSG_SIZE - 1);
 	wrap_send(&cm);
 	return 0;
 }
 
+int cmd_friend(char *args) {
+	return send_friend_command(CLIENT_COMMAND_ADD_FRIEND, args);
+}
+
+int cmd_accept(char *args) {
+	return send_friend_command(CLIENT_COMMAND_ACCEPT_FRIEND, args);
+}
+
+int cmd_unfriend(char *args) {
+	return send_friend_command(CLIENT_COMMAND_REMOVE_FRIEND, args);
+}
+
+int cmd_match(char *args) {
+	if(user_state == USER_STATE_NOT_LOGIN) {
+		bottom_bar_output(0, "Please login first!");
+	}else if(args && strcmp(args, "cancel") == 0) {
+		send_command(CLIENT_COMMAND_LEAVE_MATCH);
+	}else if(args) {
+		bottom_bar_output(0, "usage: match [cancel]");
+	}else{
+		send_command(CLIENT_COMMAND_JOIN_MATCH);
+	}
+	return 0;
+}
+
 int cmd_help(char *args) {
 	if(args) {
 		if(strcmp(args, "--list") == 0) {
-			bottom_bar_output(0, "quit, help, ulist, invite, yell, tell");
+			bottom_bar_output(0, "quit, help, ulist, invite, yell, say, tell, match, friend, accept, unfriend");
 		}else if(strcmp(args, "quit") == 0) {
 			bottom_bar_output(0, "quit the game and return terminal");
 		}else if(strcmp(args, "ulist") == 0) {
-			bottom_bar_output(0, "list all online friends");
+			bottom_bar_output(0, "list online users, `ulist <prefix>` filters by name, `ulist more` shows the next ones");
 		}else if(strcmp(args, "invite") == 0) {
 			bottom_bar_output(0, "invite friend to your battle(need args)");
 		}else if(strcmp(args, "yell") == 0) {
 			bottom_bar_output(0, "send message to all friends");
+		}else if(strcmp(args, "say") == 0) {
+			bottom_bar_output(0, "send message to users in your battle");
 		}else if(strcmp(args, "tell") == 0) {
 			bottom_bar_output(0, "send message to one friend(need args)");
+		}else if(strcmp(args, "match") == 0) {
+			bottom_bar_output(0, "find a battle with users of your level, `match cancel` to stop");
+		}else if(strcmp(args, "friend") == 0) {
+			bottom_bar_output(0, "ask a user to be your friend(need args)");
+		}else if(strcmp(args, "accept") == 0) {
+			bottom_bar_output(0, "accept a user who asked to be your friend(need args)");
+		}else if(strcmp(args, "unfriend") == 0) {
+			bottom_bar_output(0, "remove a friend, or decline a request(need args)");
 		}else{
 			bottom_bar_output(0, "no help for '%s'", args);
 		}
@@ -645,15 +1040,19 @@ static struct {
 	{"ulist", cmd_ulist},
 	{"invite", cmd_invite},
 	{"yell", cmd_yell},
+	{"say", cmd_say},
 	{"tell", cmd_tell},
+	{"match", cmd_match},
+	{"friend", cmd_friend},
+	{"accept", cmd_accept},
+	{"unfriend", cmd_unfriend},
 	/* ------------------- */
 	{"help", cmd_help},
 };
 
 #define NR_HANDLER (sizeof(command_handler) / sizeof(command_handler[0]))
 
-void read_and_execute_command() {
-	char *command = accept_input("command: ");
+void execute_command(char *command) {
 	wlog("accept command: '%s'\n", command);
 	strtok(command, " \t");
 	char *args = strtok(NULL, " \t");
@@ -661,6 +1060,7 @@ void read_and_execute_command() {
 	for(int i = 0; i < NR_HANDLER; i++) {
 		if(strcmp(command, command_handler[i].cmd) == 0) {
 			command_handler[i].func(args);
+			free(command);
 			return;
 		}
 	}
@@ -668,13 +1068,17 @@ void read_and_execute_command() {
 	if(strlen(command) > 0) {
 		bottom_bar_output(0, "invalid command '%s'", command);
 	}
+	free(command);
+}
+
+void read_and_execute_command() {
+	accept_input("command: ", execute_command);
 }
 
 void flip_screen() {
-	lock_cursor();
-	set_cursor(0, SCR_H);
+	set_cursor(0, scr_actual_h - 1);
 	printf("\033[2J");
-	unlock_cursor();
+	fflush(stdout);
 }
 
 void draw_button(uint32_t button_id) {
@@ -682,7 +1086,6 @@ void draw_button(uint32_t button_id) {
 	int y = buttons[button_id].pos.y;
 	const char *s = buttons[button_id].s;
 	int len = strlen(s);
-	lock_cursor();
 	set_cursor(x, y);
 	printf("┌");
 	for(int i = 0; i < len; i++)
@@ -697,7 +1100,6 @@ void draw_button(uint32_t button_id) {
 	for(int i = 0; i < len; i++)
 		printf("─");
 	printf("┘");
-	unlock_cursor();
 }
 
 void draw_selected_button(uint32_t button_id) {
@@ -705,7 +1107,6 @@ void draw_selected_button(uint32_t button_id) {
 	int y = buttons[button_id].pos.y;
 	const char *s = buttons[button_id].s;
 	int len = strlen(s);
-	lock_cursor();
 	set_cursor(x, y);
 	printf("\033[1m");
 	printf("┏");
@@ -722,7 +1123,6 @@ void draw_selected_button(uint32_t button_id) {
 		printf("━");
 	printf("┛");
 	printf("\033[0m");
-	unlock_cursor();
 }
 
 void draw_catalog(catalog_t *pcl) {
@@ -732,7 +1132,6 @@ void draw_catalog(catalog_t *pcl) {
 	int w = len;
 	if(len < USERNAME_SIZE) w = USERNAME_SIZE;
 
-	lock_cursor();
 	set_cursor(x, y);
 	printf("┌");
 	for(int i = 0; i < len; i++)
@@ -777,151 +1176,206 @@ void draw_catalog(catalog_t *pcl) {
 
 	fflush(stdout);
 
-	unlock_cursor();
 }
 
 
-void run_battle() {
-	wlog("run battle\n");
-	flip_screen();
-	bottom_bar_output(0,"type <TAB> to enter command mode and invite more friends\n");
-	echo_off();
-	disable_buffer();
-	while(user_state == USER_STATE_BATTLE) {
-		int ch = fgetc(stdin);
-		if(ch == 'q') {
-			wlog("type q and quit battle\n");
-			user_state = USER_STATE_LOGIN;
-			send_command(CLIENT_COMMAND_QUIT_BATTLE);
-			send_command(CLIENT_COMMAND_FETCH_ALL_FRIENDS);
-			break;
-		}else if(ch == '\t') {
-			wlog("type <TAB> and enter command mode\n");
-			read_and_execute_command();
-		}
+/* user interface
+ *
+ *   the screen shown is derived from user_state, `sync_ui` switches
+ *   screen when the state has been changed by a key or a server
+ *   message. Keys are dispatched to the line editor when a prompt is
+ *   active, otherwise to the button selector or the battle controls
+ *   of the current screen.
+ */
+enum {
+	UI_START,
+	UI_MAIN,
+	UI_BATTLE,
+};
 
-		switch(ch) {
-			case 'w':send_command(CLIENT_COMMAND_MOVE_UP);break;
-			case 's':send_command(CLIENT_COMMAND_MOVE_DOWN);break;
-			case 'a':send_command(CLIENT_COMMAND_MOVE_LEFT);break;
-			case 'd':send_command(CLIENT_COMMAND_MOVE_RIGHT);break;
-			case ' ':send_command(CLIENT_COMMAND_FIRE);break;
-		}
-	}
+static struct {
+	int st, ed;  // selectable buttons [st, ed)
+} ui_buttons[] = {
+	[UI_START]  = {buttonLogin, buttonQuitGame + 1},
+	[UI_MAIN]   = {buttonLaunchBattle, buttonLogout + 1},
+	[UI_BATTLE] = {0, 0},
+};
 
-	flip_screen();
-	wlog("exit run_battle\n");
+static int ui = UI_START;
+static int sel_button = -1;
+
+void draw_button_in_main_ui() {
+	draw_button(buttonLaunchBattle);
+	draw_button(buttonInviteUser);
+	draw_button(buttonJoinBattle);
+	draw_button(buttonLogout);
+	draw_catalog(&friend_list);
 }
 
-int switch_selected_button_respond_to_key(int st, int ed) {
-	int sel = st - 1;
-	int old_sel = sel;
+void draw_button_in_start_ui() {
+	draw_button(buttonLogin);
+	draw_button(buttonRegister);
+	draw_button(buttonQuitGame);
+}
 
-	if(st >= ed) return st;
+int ui_of_user_state() {
+	switch(user_state) {
+		case USER_STATE_BATTLE: return UI_BATTLE;
+		case USER_STATE_LOGIN:
+		case USER_STATE_MATCHING: return UI_MAIN;
+		default: return UI_START;
+	}
+}
 
-	echo_off();
-	disable_buffer();
-	wlog("enter select button, [%d, %d)\n", st, ed);
-	while(1) {
-		int ch = fgetc(stdin);
-		wlog("capture key '%c' in button ui\n", ch);
-		switch(ch) {
-			case 'a':
-			case 'w':
-				sel --;
-				if(sel < st) sel = ed - 1;
-				break;
-			case 's':
-			case 'd':
-				sel ++;
-				if(sel >= ed) sel = st;
-				break;
-			case '\t':
-				wlog("sel_menu enter command mode\n");
-				read_and_execute_command();
-				sel = st;
-				break;
-		}
+void draw_ui() {
+	switch(ui) {
+		case UI_START:
+			draw_button_in_start_ui();
+			display_user_state();
+			break;
+		case UI_MAIN:
+			draw_button_in_main_ui();
+			display_user_state();
+			break;
+	}
+}
 
-		if(ch == '\n') {
-			if(st <= sel && sel < ed) {
-				break;
-			}else{
-				sel = st;
-			}
-		}
+void enter_ui(int next) {
+	wlog("switch ui from %d to %d with user_state:%d\n", ui, next, user_state);
+	ui = next;
+	sel_button = ui_buttons[ui].st - 1;
+	flip_screen();
+	if(ui == UI_BATTLE) {
+		fb_invalidate();
+		if(spectate_bid >= 0)
+			bottom_bar_output(0, "watching battle #%d, type q to quit\n", spectate_bid);
+		else
+			bottom_bar_output(0,"type <TAB> to enter command mode and invite more friends\n");
+	}
+	draw_ui();
 
-		if(st <= old_sel && old_sel < ed) {
-			draw_button(old_sel);
-		}
+	if(input.active)
+		input_redraw("%s%s", input.prompt, input.line);
+}
 
-		if(st <= sel && sel < ed)
-			draw_selected_button(sel);
-		old_sel = sel;
-	}
+/* switch screen if user_state has changed */
+void sync_ui() {
+	int next = ui_of_user_state();
+	if(next != ui)
+		enter_ui(next);
+}
 
-	echo_on();
-	wlogi("return sel: %d\n", sel);
-	return sel;
+/* called when a button action is finished */
+void draw_current_ui() {
+	int next = ui_of_user_state();
+	if(next != ui)
+		enter_ui(next);
+	else
+		draw_ui();
 }
 
-void draw_button_in_main_ui() {
-	draw_button(buttonLaunchBattle);
-	draw_button(buttonInviteUser);
-	draw_button(buttonJoinBattle);
-	draw_button(buttonLogout);
-	draw_catalog(&friend_list);
+void battle_respond_to_key(int ch) {
+	if(spectate_bid >= 0) {
+		if(ch == 'q')
+			resume_and_exit(0);
+		return;
+	}
+
+	switch(ch) {
+		case 'q':
+			wlog("type q and quit battle\n");
+			user_state = USER_STATE_LOGIN;
+			send_command(CLIENT_COMMAND_QUIT_BATTLE);
+			draw_current_ui();
+			break;
+		case '\t':
+			wlog("type <TAB> and enter command mode\n");
+			read_and_execute_command();
+			break;
+		case 'w':send_command(CLIENT_COMMAND_MOVE_UP);break;
+		case 's':send_command(CLIENT_COMMAND_MOVE_DOWN);break;
+		case 'a':send_command(CLIENT_COMMAND_MOVE_LEFT);break;
+		case 'd':send_command(CLIENT_COMMAND_MOVE_RIGHT);break;
+		case ' ':send_command(CLIENT_COMMAND_FIRE);break;
+	}
 }
 
-void main_ui() {
+/* terminal size changed, redraw everything */
+void redraw_screen() {
+	init_scr_wh();
+	wlog("screen resized to %dx%d\n", scr_actual_w, scr_actual_h);
 	flip_screen();
-	while(1) {
-		draw_button_in_main_ui();
-		display_user_state();
-		int sel = switch_selected_button_respond_to_key(3, 7);
-		wlog("user select %d\n", sel);
+	fb_invalidate();
+	draw_ui();
+	if(ui_buttons[ui].st <= sel_button && sel_button < ui_buttons[ui].ed)
+		draw_selected_button(sel_button);
+	if(input.active)
+		input_redraw("%s%s", input.prompt, input.line);
+}
+
+void switch_selected_button_respond_to_key(int ch) {
+	int st = ui_buttons[ui].st;
+	int ed = ui_buttons[ui].ed;
+	int sel = sel_button;
+	int old_sel = sel;
 
-		int ret_code = buttons[sel].button_func();
-		wlog("button handler return %d\n", ret_code);
+	if(st >= ed) return;
 
-		if(ret_code < 0 || user_state == USER_STATE_NOT_LOGIN) {
-			flip_screen();
-			wlog("quit main ui with user_state:%d\n", user_state);
+	wlog("capture key '%c' in button ui\n", ch);
+	switch(ch) {
+		case 'a':
+		case 'w':
+			sel --;
+			if(sel < st) sel = ed - 1;
 			break;
-		}
+		case 's':
+		case 'd':
+			sel ++;
+			if(sel >= ed) sel = st;
+			break;
+		case '\t':
+			wlog("sel_menu enter command mode\n");
+			read_and_execute_command();
+			sel = st;
+			break;
+	}
 
-		if(user_state == USER_STATE_BATTLE) {
-			wlog("enter battle mode\n");
-			run_battle();
+	if(ch == '\n') {
+		if(st <= sel && sel < ed) {
+			wlog("user select %d@%s\n", sel, buttons[sel].s);
+			sel_button = st - 1;
+			int ret_code = buttons[sel].button_func();
+			wlog("button handler return %d\n", ret_code);
+			// handlers waiting for input or reply redraw when done
+			if(!input.active && !reply_pending())
+				draw_current_ui();
+			return;
+		}else{
+			sel = st;
 		}
 	}
-}
 
-void draw_button_in_start_ui() {
-	draw_button(buttonLogin);
-	draw_button(buttonRegister);
-	draw_button(buttonQuitGame);
+	if(st <= old_sel && old_sel < ed) {
+		draw_button(old_sel);
+	}
+
+	if(st <= sel && sel < ed)
+		draw_selected_button(sel);
+	sel_button = sel;
 }
 
-void start_ui() {
-	wlog("enter start ui\n");
-	bottom_bar_output(0, "type w s a d to switch button, type <TAB> to enter command");
-	while(1) {
-		draw_button_in_start_ui();
-		display_user_state();
-		int sel = switch_selected_button_respond_to_key(0, 3);
-		wlog("user select %d@%s\n", sel, buttons[sel].s);
-		buttons[sel].button_func();
-
-		if(user_state == USER_STATE_LOGIN) {
-			wlog("user state changed into LOGIN\n");
-			wlog("enter main ui\n");
-			main_ui();
-		}
+void respond_to_key(int ch) {
+	if(input.active) {
+		input_key(ch);
+	}else if(reply_pending()) {
+		wlog("ignore key '%c' while waiting for reply\n", ch);
+	}else if(ui == UI_BATTLE) {
+		battle_respond_to_key(ch);
+	}else{
+		switch_selected_button_respond_to_key(ch);
 	}
 }
 
-
 int serv_response_you_have_not_login(server_message_t *psm) {
 	wlog("call message handler %s\n", __func__);
 	server_say("you haven't logined");
@@ -950,6 +1404,7 @@ int serv_response_login_success(server_message_t *psm) {
 	wlog("call message handler %s\n", __func__);
 	wlog("==> try server_say\n");
 	server_say("welcome to simple net-based game");
+	keep_session_token(psm);
 	wlog("==> change user_state from %s into %s\n", user_state_s[user_state], user_state_s[USER_STATE_LOGIN]);
 	user_state = USER_STATE_LOGIN;
 	wlog("==> update user state to screen\n");
@@ -1011,6 +1466,31 @@ int serv_response_all_users_info(server_message_t *psm) {
 	return 0;
 }
 
+int serv_response_user_page(server_message_t *psm) {
+	int len = 0;
+	static char users[(USERNAME_SIZE + 1) * USER_PAGE_SIZE + 1];
+	wlog("call message handler %s\n", __func__);
+
+	for(int i = 0; i < psm->nr_listed && i < USER_PAGE_SIZE; i++) {
+		psm->listed[i].user_name[USERNAME_SIZE - 1] = 0;
+		len += sprintf(users + len, "%s%s", i ? ", " : "", psm->listed[i].user_name);
+	}
+	users[len] = 0;
+
+	psm->page_cursor[USERNAME_SIZE - 1] = 0;
+	if(psm->more)
+		strncpy(ulist_cursor, psm->page_cursor, USERNAME_SIZE - 1);
+	else
+		memset(ulist_cursor, 0, sizeof(ulist_cursor));
+
+	wlog("server response user page: %s\n", users);
+	if(psm->nr_listed == 0)
+		bottom_bar_output(0, "nobody online");
+	else
+		bottom_bar_output(0, "online: %s%s", users, psm->more ? " (`ulist more`)" : "");
+	return 0;
+}
+
 int serv_response_all_friends_info(server_message_t *psm) {
 	int j = 0;
 	wlog("call message handler %s\n", __func__);
@@ -1054,31 +1534,77 @@ int serv_response_invitation_sent(server_message_t *psm) {
 	return 0;
 }
 
-int serv_msg_friend_login(server_message_t *psm) {
+int serv_response_match_queued(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	server_say("waiting for a match, type `match cancel` to stop");
+	user_state = USER_STATE_MATCHING;
+	display_user_state();
+	return 0;
+}
+
+int serv_response_match_left(server_message_t *psm) {
 	wlog("call message handler %s\n", __func__);
+	server_say("left match queue");
+	user_state = USER_STATE_LOGIN;
+	display_user_state();
+	return 0;
+}
+
+/* presence
+ *
+ *   users on server by session slot, kept up to date by
+ *   SERVER_MESSAGE_PRESENCE, the friend list is built from it
+ */
+static struct {
+	char user_name[USERNAME_SIZE];
+	int state;
+} presence[USER_CNT];
+
+int is_online(int state) {
+	return state != USER_STATE_UNUSED && state != USER_STATE_NOT_LOGIN;
+}
+
+void rebuild_friend_list() {
+	int j = 0;
+	memset(friend_list.records, 0, sizeof(friend_list.records));
 	for(int i = 0; i < USER_CNT; i++) {
-		if(friend_list.records[i][0] == 0) {
-			strncpy(friend_list.records[i], psm->friend_name, USERNAME_SIZE - 1);
-			break;
-		}
+		if(is_online(presence[i].state)
+		&& strncmp(presence[i].user_name, user_name, USERNAME_SIZE - 1) != 0)
+			strncpy(friend_list.records[j ++], presence[i].user_name, USERNAME_SIZE - 1);
 	}
-	if(user_state == USER_STATE_LOGIN)
+	if(ui == UI_MAIN)
 		draw_catalog(&friend_list);
-	server_say(sformat("friend %s login\n", psm->friend_name));
-	return 0;
 }
 
-int serv_msg_friend_logout(server_message_t *psm) {
+int serv_msg_presence(server_message_t *psm) {
 	wlog("call message handler %s\n", __func__);
-	for(int i = 0; i < USER_CNT; i++) {
-		if(strncmp(friend_list.records[i], psm->friend_name, USERNAME_SIZE - 1) == 0) {
-			friend_list.records[i][0] = 0;
-			break;
+	if(psm->presence_reset)
+		memset(presence, 0, sizeof(presence));
+
+	for(int i = 0; i < psm->nr_presence && i < USER_CNT; i++) {
+		int slot = psm->presence[i].slot;
+		if(slot >= USER_CNT) continue;
+
+		char *name = psm->presence[i].user_name;
+		int state = psm->presence[i].user_state;
+		name[USERNAME_SIZE - 1] = 0;
+
+		// a slot may change hands within one diff
+		int was_online = is_online(presence[slot].state);
+		int same_user = strncmp(presence[slot].user_name, name, USERNAME_SIZE - 1) == 0;
+		if(!psm->presence_reset) {
+			if(was_online && (!same_user || !is_online(state)))
+				server_say(sformat("friend %s logout", presence[slot].user_name));
+			if(is_online(state) && (!same_user || !was_online)
+			&& strncmp(name, user_name, USERNAME_SIZE - 1) != 0)
+				server_say(sformat("friend %s login", name));
 		}
+
+		strncpy(presence[slot].user_name, name, USERNAME_SIZE - 1);
+		presence[slot].state = state;
 	}
-	if(user_state == USER_STATE_LOGIN)
-		draw_catalog(&friend_list);
-	server_say(sformat("friend %s logout\n", psm->friend_name));
+
+	rebuild_friend_list();
 	return 0;
 }
 
@@ -1117,7 +1643,16 @@ int serv_msg_you_are_invited(server_message_t *psm) {
 int serv_msg_friend_msg(server_message_t *psm)
 {
 	wlog("call message handler %s\n", __func__);
-	server_say(sformat("%s: %s", psm->from_user, psm->msg));
+	static const char *channel_s[] = {
+		[CHAT_GLOBAL] = "",
+		[CHAT_BATTLE] = "[battle] ",
+		[CHAT_DIRECT] = "[to you] ",
+	};
+	const char *channel = psm->channel < NR_ELEMS(channel_s) ? channel_s[psm->channel] : "";
+	psm->from_user[USERNAME_SIZE - 1] = 0;
+	psm->msg[MSG_SIZE - 1] = 0;
+	server_say(sformat("%s%s%s: %s", psm->replayed ? "(earlier) " : "",
+				channel, psm->from_user, psm->msg));
 	return 0;
 }
 
@@ -1127,116 +1662,399 @@ int serv_msg_friend_quit_battle(server_message_t *psm) {
 	return 0;
 }
 
+int serv_msg_match_found(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	server_say("match found, battle begins");
+	user_state = USER_STATE_BATTLE;
+	return 0;
+}
+
 int serv_msg_battle_disbanded(server_message_t *psm) {
 	wlog("call message handler %s\n", __func__);
+	if(spectate_bid >= 0) {
+		server_say("battle is over, wait for the next one in its place");
+		return 0;
+	}
+
 	server_say("battle is disbanded");
+	if(user_state == USER_STATE_BATTLE)
+		user_state = USER_STATE_LOGIN;
 	return 0;
 }
 
-void flip_old_items(server_message_t *psm) {
-	static server_message_t sm = {0};
-	wlog("call flip old items\n");
-	lock_cursor();
-	for(int i = 0; i < USER_CNT; i++) {
-		if(sm.user_pos[i].x >= BATTLE_W
-		|| sm.user_pos[i].y >= BATTLE_H)
-			continue;
+/* battlefield framebuffer
+ *
+ *   a snapshot is drawn into the back buffer, `fb_present` compares
+ *   it with the front buffer (what the terminal shows now) and only
+ *   emits the changed cells. Cursor moves are skipped for adjacent
+ *   cells and short gaps are re-emitted instead of moving the
+ *   cursor. The whole frame is sent by one write().
+ *
+ * camera
+ *
+ *   the battlefield can be much larger than the terminal, buffers
+ *   only cover the view_w x view_h window at (cam_x, cam_y). The
+ *   camera stays still while you move inside the window and re-centers
+ *   on you when you get within CAM_MARGIN cells of its border.
+ *
+ * terrain
+ *
+ *   grass and magma are received once when joining a battle and then
+ *   only as changes. They are drawn into fb_terrain when they change
+ *   or the camera moves, each frame starts from a copy of it. Grass
+ *   hides everything in it.
+ */
+#define FB_GAP_REPRINT 4
+#define FB_CELL_OUT_SIZE 8   // a glyph, at most 3 bytes
+#define FB_MOVE_OUT_SIZE 16  // "\033[<y>;<x>H"
+
+#define CAM_MARGIN 4
 
-		wlog("clear user %d@(%d, %d)\n", i, sm.user_pos[i].x, sm.user_pos[i].y);
-		set_cursor(sm.user_pos[i].x, sm.user_pos[i].y);
-		printf(" ");
+enum {
+	GLYPH_EMPTY,
+	GLYPH_YOU,
+	GLYPH_OTHER,
+	GLYPH_MAGAZINE,
+	GLYPH_MAGMA,
+	GLYPH_GRASS,
+	GLYPH_BLOOD_VIAL,
+	GLYPH_BULLET,
+};
+
+static const char *glyph_s[] = {
+	[GLYPH_EMPTY]      = " ",
+	[GLYPH_YOU]        = "Y",
+	[GLYPH_OTHER]      = "A",
+	[GLYPH_MAGAZINE]   = "+",
+	[GLYPH_MAGMA]      = "╳",
+	[GLYPH_GRASS]      = "█",
+	[GLYPH_BLOOD_VIAL] = "*",
+	[GLYPH_BULLET]     = ".",
+};
+
+static int item_glyph[] = {
+	[ITEM_NONE]       = GLYPH_EMPTY,
+	[ITEM_MAGAZINE]   = GLYPH_MAGAZINE,
+	[ITEM_MAGMA]      = GLYPH_MAGMA,
+	[ITEM_GRASS]      = GLYPH_GRASS,
+	[ITEM_BLOOD_VIAL] = GLYPH_BLOOD_VIAL,
+	[ITEM_END]        = GLYPH_EMPTY,
+	[ITEM_BULLET]     = GLYPH_BULLET,
+};
+
+static int map_w = BATTLE_W, map_h = BATTLE_H;
+static int view_w = 0, view_h = 0;
+static int cam_x = 0, cam_y = 0;
+
+static uint8_t *fb_front = NULL;
+static uint8_t *fb_back = NULL;
+static uint8_t *fb_terrain = NULL;
+static char *fb_out = NULL;
+
+static struct terrain_cell_t {
+	pos_t pos;
+	uint8_t kind;
+} *terrain = NULL;
+static int nr_terrain = 0;
+static int terrain_cap = 0;
+static int terrain_dirty = true;
+
+static int fb_invalid = true;
+
+/* the screen has been cleared or resized, the next frame will resize
+ * the buffers and treat the front buffer as empty */
+void fb_invalidate() {
+	fb_invalid = true;
+}
+
+int clamp(int v, int lo, int hi) {
+	return v < lo ? lo : (v > hi ? hi : v);
+}
+
+void fb_resize() {
+	int w = clamp(map_w, 1, scr_actual_w);
+	int h = clamp(map_h, 1, scr_actual_h - 2);
+
+	if(w != view_w || h != view_h) {
+		free(fb_front);
+		free(fb_back);
+		free(fb_terrain);
+		free(fb_out);
+		fb_front = malloc(w * h);
+		fb_back = malloc(w * h);
+		fb_terrain = malloc(w * h);
+		/* a row moves the cursor once and then again only past more than
+		 * FB_GAP_REPRINT unchanged cells, whose share pays for the move */
+		fb_out = malloc(h * (FB_MOVE_OUT_SIZE + w * FB_CELL_OUT_SIZE));
+		if(!fb_front || !fb_back || !fb_terrain || !fb_out)
+			eprintf("fail to alloc framebuffer\n");
+		view_w = w;
+		view_h = h;
+		wlog("resize view to %dx%d of map %dx%d\n", w, h, map_w, map_h);
 	}
 
-	for(int i = 0; i < MAX_ITEM; i++) {
-		if(sm.item_kind[i] != ITEM_BULLET)
-			continue;
+	memset(fb_front, GLYPH_EMPTY, view_w * view_h);
+	memset(fb_back, GLYPH_EMPTY, view_w * view_h);
+	cam_x = clamp(cam_x, 0, map_w - view_w);
+	cam_y = clamp(cam_y, 0, map_h - view_h);
+	terrain_dirty = true;
+}
 
-		set_cursor(sm.item_pos[i].x, sm.item_pos[i].y);
-		printf(" ");
+int follow_axis(int cam, int you, int view, int map) {
+	if(you < cam + CAM_MARGIN || you >= cam + view - CAM_MARGIN)
+		cam = you - view / 2;
+	return clamp(cam, 0, map - view);
+}
+
+void follow_camera(pos_t you) {
+	if(you.x == POS_NONE || you.y == POS_NONE)
+		return;
+	cam_x = follow_axis(cam_x, you.x, view_w, map_w);
+	cam_y = follow_axis(cam_y, you.y, view_h, map_h);
+}
+
+void fb_draw_terrain() {
+	memset(fb_terrain, GLYPH_EMPTY, view_w * view_h);
+	for(int i = 0; i < nr_terrain; i++) {
+		uint32_t x = terrain[i].pos.x - cam_x;
+		uint32_t y = terrain[i].pos.y - cam_y;
+		if(x < view_w && y < view_h)
+			fb_terrain[y * view_w + x] = item_glyph[terrain[i].kind];
 	}
+}
 
-	fflush(stdout);
+void fb_clear() {
+	memcpy(fb_back, fb_terrain, view_w * view_h);
+}
 
-	unlock_cursor();
-	memcpy(&sm, psm, sizeof(server_message_t));
+/* (x, y) is position on map */
+void fb_put(uint32_t x, uint32_t y, int glyph) {
+	x -= cam_x;
+	y -= cam_y;
+	if(x >= view_w || y >= view_h)
+		return;
+	if(fb_terrain[y * view_w + x] == GLYPH_GRASS)
+		return;
+	fb_back[y * view_w + x] = glyph;
 }
 
-void draw_users(server_message_t *psm) {
-	lock_cursor();
-	for(int i = 0; i < USER_CNT; i++) {
-		if(psm->user_pos[i].x >= BATTLE_W
-		|| psm->user_pos[i].y >= BATTLE_H)
-			continue;
+void wrap_write(int fd, const char *buf, size_t len) {
+	while(len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if(n < 0) {
+			wlog("fail to write to terminal\n");
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
 
-		set_cursor(psm->user_pos[i].x, psm->user_pos[i].y);
-		if(i == psm->index)
-			printf("Y");
-		else
-			printf("A");
+void fb_present() {
+	char *out = fb_out;
+	size_t len = 0;
+
+	for(int y = 0; y < view_h; y++) {
+		uint8_t *front = &fb_front[y * view_w];
+		uint8_t *back = &fb_back[y * view_w];
+		int cx = -1;
+		for(int x = 0; x < view_w; x++) {
+			if(back[x] == front[x])
+				continue;
+
+			if(cx >= 0 && x > cx && x - cx <= FB_GAP_REPRINT) {
+				// cheaper to reprint unchanged cells than to move
+				for(; cx < x; cx++)
+					len += sprintf(out + len, "%s", glyph_s[front[cx]]);
+			}else if(cx != x) {
+				len += sprintf(out + len, "\033[%d;%dH", y + 1, x + 1);
+			}
+
+			len += sprintf(out + len, "%s", glyph_s[back[x]]);
+			front[x] = back[x];
+			cx = x + 1;
+		}
 	}
 
+	if(len == 0) return;
+
 	fflush(stdout);
-	unlock_cursor();
+	wrap_write(STDOUT_FILENO, out, len);
+}
+
+void draw_users(server_message_t *psm) {
+	for(int i = 0; i < USER_CNT; i++) {
+		fb_put(psm->user_pos[i].x, psm->user_pos[i].y,
+				i == psm->index ? GLYPH_YOU : GLYPH_OTHER);
+	}
 }
 
 void draw_items(server_message_t *psm) {
-	lock_cursor();
+	for(int i = 0; i < MAX_ITEM; i++) {
+		if(psm->item_kind[i] == ITEM_NONE
+		|| psm->item_kind[i] >= sizeof(item_glyph) / sizeof(item_glyph[0]))
+			continue;
+
+		fb_put(psm->item_pos[i].x, psm->item_pos[i].y, item_glyph[psm->item_kind[i]]);
+	}
+}
+
+/* battle info is only dumped in debug level and directly formatted
+ * into the buffered log, empty item slots are skipped */
+void log_psm_info(server_message_t *psm) {
+	if(LOG_LEVEL_DEBUG < LOG_COMPILE_LEVEL
+	|| LOG_LEVEL_DEBUG < client_log_level
+	|| !log_fp)
+		return;
+
+	fprintf(log_fp, "%s:%d: battle info:\n", user_name, __LINE__);
+	fprintf(log_fp, "message: %d, life:%d, user_index:%d\n", psm->message, psm->life, psm->index);
+	fprintf(log_fp, "user_pos:");
+	for(int i = 0; i < USER_CNT; i++) {
+		fprintf(log_fp, "(%d,%d), ", psm->user_pos[i].x, psm->user_pos[i].y);
+	}
+
+	fprintf(log_fp, "\nitems:");
 	for(int i = 0; i < MAX_ITEM; i++) {
 		if(psm->item_kind[i] == ITEM_NONE)
 			continue;
+		fprintf(log_fp, "#%d(%d:%d,%d), ", i, psm->item_kind[i], psm->item_pos[i].x, psm->item_pos[i].y);
+	}
+	fprintf(log_fp, "\n\n");
+}
+
+/* latest battle snapshot
+ *
+ *   every snapshot received overwrites the previous one, the frame
+ *   timer only draws the newest snapshot so snapshots arriving faster
+ *   than RENDER_FPS are dropped instead of queueing up.
+ */
+static server_message_t snapshot;
+static int snapshot_fresh = false;
+static int snapshot_valid = false;
 
-		set_cursor(psm->item_pos[i].x, psm->item_pos[i].y);
-		switch(psm->item_kind[i]) {
-			case ITEM_MAGAZINE:printf("+");break;
-			case ITEM_MAGMA:printf("╳");break;
-			case ITEM_GRASS:printf("█");break;
-			case ITEM_BLOOD_VIAL:printf("*");break;
-			case ITEM_BULLET:printf(".");
+int serv_msg_battle_info(server_message_t *psm) {
+	if(user_state == USER_STATE_BATTLE) {
+		log_psm_info(psm);
+		memcpy(&snapshot, psm, sizeof(server_message_t));
+		// the spectator feed says user 0, who isn't us
+		if(spectate_bid >= 0)
+			snapshot.index = USER_CNT;
+		snapshot_fresh = true;
+		snapshot_valid = true;
+		if(psm->map_w != map_w || psm->map_h != map_h) {
+			map_w = psm->map_w;
+			map_h = psm->map_h;
+			fb_invalidate();
 		}
 	}
+	return 0;
+}
+
+void set_terrain(pos_t pos, int kind) {
+	for(int i = 0; i < nr_terrain; i++) {
+		if(terrain[i].pos.x != pos.x || terrain[i].pos.y != pos.y)
+			continue;
+
+		if(kind == ITEM_NONE)
+			terrain[i] = terrain[-- nr_terrain];
+		else
+			terrain[i].kind = kind;
+		return;
+	}
 
-	fflush(stdout);
+	if(kind == ITEM_NONE) return;
 
-	unlock_cursor();
+	if(nr_terrain == terrain_cap) {
+		terrain_cap = terrain_cap ? terrain_cap * 2 : MAX_TERRAIN_CELLS;
+		terrain = realloc(terrain, terrain_cap * sizeof(terrain[0]));
+		if(!terrain) eprintf("fail to alloc terrain\n");
+	}
+
+	terrain[nr_terrain].pos = pos;
+	terrain[nr_terrain].kind = kind;
+	nr_terrain ++;
 }
 
-void log_psm_info(server_message_t *psm) {
-	int len = 0;
-	static char s[1024 * 1024];
-	char *p = s;
-	len += sprintf(p + len, "message: %d, life:%d, user_index:%d\n", psm->message, psm->life, psm->index);
-	len += sprintf(p + len, "user_pos:");
-	for(int i = 0; i < USER_CNT; i++) {
-		len += sprintf(p + len, "(%d,%d), ", psm->user_pos[i].x, psm->user_pos[i].y);
+/* terrain may arrive before the reply of launching or accepting
+ * battle, so it is cached in any state */
+int serv_msg_terrain(server_message_t *psm) {
+	if(psm->terrain_reset) {
+		wlog("reset terrain\n");
+		nr_terrain = 0;
+		snapshot_valid = false;
 	}
 
-	len += sprintf(p + len, "\n");
+	for(int i = 0; i < psm->nr_cells && i < MAX_TERRAIN_CELLS; i++) {
+		if(psm->cell_kind[i] != ITEM_GRASS
+		&& psm->cell_kind[i] != ITEM_MAGMA)
+			psm->cell_kind[i] = ITEM_NONE;
+		set_terrain(psm->cell_pos[i], psm->cell_kind[i]);
+	}
 
-	len += sprintf(p + len, "items:");
-	for(int i = 0; i < MAX_ITEM; i++) {
-		len += sprintf(p + len, "(%d:%d,%d), ", psm->item_kind[i], psm->item_pos[i].x, psm->item_pos[i].y);
+	wlogi("%d terrain cells changed, %d cached\n", psm->nr_cells, nr_terrain);
+	terrain_dirty = true;
+	return 0;
+}
+
+void render_frame() {
+	static int pending = false;
+	static int last_hp = -1, last_bullets = -1;
+
+	if(ui != UI_BATTLE)
+		return;
+
+	if(fb_invalid) {
+		fb_invalid = false;
+		fb_resize();
+		last_hp = last_bullets = -1;
+		pending = true;
 	}
 
-	len += sprintf(p + len, "\n");
+	int compose = false;
+	if(snapshot_fresh) {
+		snapshot_fresh = false;
+		user_bullets = snapshot.bullets_num;
+		user_hp = snapshot.life;
+		// spectators follow the first user alive
+		int who = snapshot.index;
+		for(int i = 0; i < USER_CNT && who >= USER_CNT; i++) {
+			if(snapshot.user_pos[i].x != POS_NONE)
+				who = i;
+		}
+		if(who < USER_CNT) {
+			int old_x = cam_x, old_y = cam_y;
+			follow_camera(snapshot.user_pos[who]);
+			if(cam_x != old_x || cam_y != old_y)
+				terrain_dirty = true;
+		}
+		compose = true;
+	}
 
-	if(len > sizeof(s) - 1)
-		eprintf("buffer overflow\n");
+	if(terrain_dirty) {
+		terrain_dirty = false;
+		fb_draw_terrain();
+		compose = true;
+	}
 
-	wlog("battle info:\n%s\n", s);
-}
+	if(compose) {
+		fb_clear();
+		if(snapshot_valid) {
+			draw_users(&snapshot);
+			draw_items(&snapshot);
+		}
+		pending = true;
+	}
 
-int serv_msg_battle_info(server_message_t *psm) {
-	wlog("call message handler %s\n", __func__);
-	if(user_state == USER_STATE_BATTLE) {
-		log_psm_info(psm);
-		user_bullets = psm->bullets_num;
-		user_hp = psm->life;
-		flip_old_items(psm);
-		draw_users(psm);
-		draw_items(psm);
+	if(!pending) return;
+
+	fb_present();
+	if(user_hp != last_hp || user_bullets != last_bullets) {
+		last_hp = user_hp;
+		last_bullets = user_bullets;
 		display_user_state();
 	}
-	return 0;
+	pending = false;
 }
 
 int serv_msg_you_are_dead(server_message_t *psm) {
@@ -1275,6 +2093,101 @@ int server_message_your_magazine_is_empty(server_message_t *psm) {
 	return 0;
 }
 
+int serv_response_chat_throttled(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	error("you're sending messages too fast, the last one is dropped");
+	return 0;
+}
+
+int serv_response_friend_request_sent(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	server_say(sformat("asked %s to be your friend", psm->friend_name));
+	return 0;
+}
+
+int serv_response_friend_request_fail(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	error(sformat("can't be friend of %s", psm->friend_name));
+	return 0;
+}
+
+int serv_response_not_your_friend(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	server_say(sformat("%s isn't your friend, try `friend %s`", psm->friend_name, psm->friend_name));
+	return 0;
+}
+
+int serv_msg_friend_request(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	server_say(sformat("%s asks to be your friend, type `accept %s`", psm->friend_name, psm->friend_name));
+	return 0;
+}
+
+int serv_msg_friend_added(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	server_say(sformat("%s is your friend now", psm->friend_name));
+	return 0;
+}
+
+int serv_msg_friend_removed(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	server_say(sformat("%s isn't your friend any more", psm->friend_name));
+	return 0;
+}
+
+int serv_response_shm_channel_ready(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	return 0;
+}
+
+/* session resumption
+ *
+ *   with the token given at login a dropped connection is replaced
+ *   within RESUME_GRACE_MS without logging in again, the battle goes
+ *   on where it was. Connecting again is tried every RESUME_RETRY_MS
+ *   by the frame timer. A try never blocks: the connect and the first
+ *   reply over the rings are waited on by the event loop, each for at
+ *   most REPLY_TIMEOUT_MS.
+ */
+#define RESUME_RETRY_MS 500
+
+enum {
+	RESUME_WAITING,      // for the next try
+	RESUME_CONNECTING,   // for the socket to be writable
+	RESUME_OPENING,      // for the server to answer on the rings
+};
+
+static struct {
+	int valid;
+	uint8_t token[RESUME_TOKEN_SIZE];
+	int stage;
+	int ticks_left;      // to the next try, or to give up this one
+	int tries_left;
+} resume;
+
+void keep_session_token(server_message_t *psm) {
+	resume.valid = true;
+	memcpy(resume.token, psm->session_token, RESUME_TOKEN_SIZE);
+}
+
+int serv_response_session_resumed(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	keep_session_token(psm);
+	user_state = psm->session_state;
+	server_say("connection is back");
+	display_user_state();
+	return 0;
+}
+
+int serv_response_resume_fail(server_message_t *psm) {
+	wlog("call message handler %s\n", __func__);
+	resume.valid = false;
+	user_state = USER_STATE_NOT_LOGIN;
+	error("your session is over, please login again");
+	display_user_state();
+	return 0;
+}
+
 static int (*recv_msg_func[])(server_message_t *) = {
 	[SERVER_RESPONSE_REGISTER_SUCCESS] = serv_response_register_success,
 	[SERVER_RESPONSE_REGISTER_FAIL] = serv_response_register_fail,
@@ -1292,8 +2205,16 @@ static int (*recv_msg_func[])(server_message_t *) = {
 	[SERVER_RESPONSE_LAUNCH_BATTLE_SUCCESS] = serv_response_launch_battle_success,
 	[SERVER_RESPONSE_NOBODY_INVITE_YOU] = serv_response_nobody_invite_you,
 	[SERVER_RESPONSE_INVITATION_SENT] = serv_response_invitation_sent,
-	[SERVER_MESSAGE_FRIEND_LOGIN] = serv_msg_friend_login,
-	[SERVER_MESSAGE_FRIEND_LOGOUT] = serv_msg_friend_logout,
+	[SERVER_RESPONSE_MATCH_QUEUED] = serv_response_match_queued,
+	[SERVER_RESPONSE_MATCH_LEFT] = serv_response_match_left,
+	[SERVER_RESPONSE_SHM_CHANNEL_READY] = serv_response_shm_channel_ready,
+	[SERVER_RESPONSE_CHAT_THROTTLED] = serv_response_chat_throttled,
+	[SERVER_RESPONSE_FRIEND_REQUEST_SENT] = serv_response_friend_request_sent,
+	[SERVER_RESPONSE_FRIEND_REQUEST_FAIL] = serv_response_friend_request_fail,
+	[SERVER_RESPONSE_NOT_YOUR_FRIEND] = serv_response_not_your_friend,
+	[SERVER_RESPONSE_USER_PAGE] = serv_response_user_page,
+	[SERVER_RESPONSE_SESSION_RESUMED] = serv_response_session_resumed,
+	[SERVER_RESPONSE_RESUME_FAIL] = serv_response_resume_fail,
 	[SERVER_MESSAGE_FRIEND_ACCEPT_BATTLE] = serv_msg_accept_battle,
 	[SERVER_MESSAGE_FRIEND_REJECT_BATTLE] = serv_msg_reject_battle,
 	[SERVER_MESSAGE_FRIEND_NOT_LOGIN] = serv_msg_friend_not_login,
@@ -1309,55 +2230,423 @@ static int (*recv_msg_func[])(server_message_t *) = {
 	[SERVER_MESSAGE_YOU_GOT_BLOOD_VIAL] = serv_msg_you_got_blood_vial,
 	[SERVER_MESSAGE_YOU_GOT_MAGAZINE] = server_message_you_got_magazine,
 	[SERVER_MESSAGE_YOUR_MAGAZINE_IS_EMPTY] = server_message_your_magazine_is_empty,
+	[SERVER_MESSAGE_TERRAIN] = serv_msg_terrain,
+	[SERVER_MESSAGE_MATCH_FOUND] = serv_msg_match_found,
+	[SERVER_MESSAGE_PRESENCE] = serv_msg_presence,
+	[SERVER_MESSAGE_FRIEND_REQUEST] = serv_msg_friend_request,
+	[SERVER_MESSAGE_FRIEND_ADDED] = serv_msg_friend_added,
+	[SERVER_MESSAGE_FRIEND_REMOVED] = serv_msg_friend_removed,
 };
 
-void *message_monitor(void *args) {
-	server_message_t sm;
-	wlog("monitor thread starts\n");
+void handle_server_message(server_message_t *psm) {
+	if(psm->message >= NR_ELEMS(recv_msg_func)) {
+		wlog("receive unknown server message %d\n", psm->message);
+		return;
+	}
+
+	wlog("receive server message: %s\n", server_message_s[psm->message]);
+	if(recv_msg_func[psm->message]) {
+		wlog("==> call message handler\n");
+		recv_msg_func[psm->message](psm);
+		wlog("==> quit message handler\n");
+	}
+
+	// continue after the handler has updated client state
+	check_pending_reply(psm->message);
+	if(!reply_pending())
+		sync_ui();
+}
+
+void handle_server_frame(uint8_t *payload, size_t len) {
+	static server_message_t sm;
+
+	// it has done its job by arriving
+	if(len > 0 && payload[0] == SERVER_RESPONSE_HEARTBEAT)
+		return;
+
+	if(len > 0 && payload[0] == SERVER_MESSAGE_BATTLE_INFORMATION) {
+		if(snapshot_decode(payload, len, &sm) < 0) {
+			wlog("drop malformed snapshot of %zu bytes\n", len);
+			return;
+		}
+	}else{
+		memset(&sm, 0, sizeof(server_message_t));
+		memcpy(&sm, payload, len);
+	}
+
+	handle_server_message(&sm);
+}
+
+/* recv() without blocking from the socket or the ring */
+ssize_t transport_recv(void *buf, size_t len) {
+	if(!use_shm)
+		return recv(client_fd, buf, len, MSG_DONTWAIT);
+
+	size_t n = shm_recv(&shm_ep, buf, len);
+	if(n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return n;
+}
+
+// frame being received, dropped with the connection
+static uint8_t rx_frame[FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD];
+static size_t rx_len = 0;
+
+/* read all complete frames available on the socket without
+ * blocking, return -1 when the connection is closed */
+int server_readable() {
 	while(1) {
-		wrap_recv(&sm);
-		wlog("receive server message: %s\n", server_message_s[sm.message]);
-		if(recv_msg_func[sm.message]) {
-			wlog("==> call message handler\n");
-			recv_msg_func[sm.message](&sm);
-			wlog("==> quit message handler\n");
+		size_t frame_len = FRAME_HEADER_SIZE;
+		if(rx_len >= FRAME_HEADER_SIZE) {
+			frame_len += rx_frame[0] | (rx_frame[1] << 8);
+			if(frame_len > sizeof(rx_frame)) {
+				wlog("frame of %zu bytes is too large\n", frame_len);
+				return -1;
+			}
+		}
+
+		if(rx_len == frame_len) {
+			rx_len = 0;
+			handle_server_frame(rx_frame + FRAME_HEADER_SIZE, frame_len - FRAME_HEADER_SIZE);
+			continue;
+		}
+
+		ssize_t len = transport_recv(rx_frame + rx_len, frame_len - rx_len);
+		if(len == 0) {
+			return -1;
+		}else if(len < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		rx_len += len;
+		liveness.silent_ticks = 0;
+	}
+}
+
+// the connection is lost, return true if it is going to be resumed
+int start_resuming() {
+	if(!resume.valid || spectate_bid >= 0)
+		return false;
+
+	resume.ticks_left = RESUME_RETRY_MS * RENDER_FPS / 1000;
+	resume.tries_left = RESUME_GRACE_MS / RESUME_RETRY_MS;
+	return true;
+}
+
+void connection_lost() {
+	wlog("connection to server is broken\n");
+	if(start_resuming())
+		bottom_bar_output(0, "lost connection to server, connecting again ...");
+	if(reply_pending())
+		complete_reply(REPLY_BROKEN);
+	else if(!resume.tries_left)
+		error("lost connection to server");
+}
+
+void resume_try_failed(struct pollfd *pfd) {
+	shm_channel_close(&shm_ep);
+	if(client_fd >= 0)
+		close(client_fd);
+	client_fd = -1;
+	pfd->fd = -1;
+	resume.stage = RESUME_WAITING;
+	resume.ticks_left = RESUME_RETRY_MS * RENDER_FPS / 1000;
+	if(resume.tries_left == 0)
+		error("fail to connect to server again");
+}
+
+void resume_wait(struct pollfd *pfd, int stage, int fd, short events) {
+	resume.stage = stage;
+	resume.ticks_left = REPLY_TIMEOUT_MS * RENDER_FPS / 1000;
+	pfd->fd = fd;
+	pfd->events = events;
+}
+
+/* start a try when it is due, `pfd` gets what the try waits on */
+void resume_tick(int ticks, struct pollfd *pfd) {
+	if(resume.tries_left <= 0 && resume.stage == RESUME_WAITING) return;
+
+	resume.ticks_left -= ticks;
+	if(resume.ticks_left > 0) return;
+
+	if(resume.stage != RESUME_WAITING) {
+		wlog("server doesn't answer in %d ms\n", REPLY_TIMEOUT_MS);
+		resume_try_failed(pfd);
+		return;
+	}
+
+	resume.tries_left --;
+	shm_channel_close(&shm_ep);
+	if(client_fd >= 0)
+		close(client_fd);
+	client_fd = connect_to_server(true);
+	if(client_fd < 0) {
+		resume_try_failed(pfd);
+		return;
+	}
+	resume_wait(pfd, RESUME_CONNECTING, client_fd, POLLOUT);
+}
+
+/* go on with the try once `pfd` polled ready, return 0 once connected */
+int resume_step(struct pollfd *pfd) {
+	if(resume.stage == RESUME_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(client_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			wlog("can not connect to server again: %s\n", strerror(err ? err : errno));
+			resume_try_failed(pfd);
+			return -1;
 		}
+		fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
 
-		// delay assignment
-		if(sm.message == SERVER_RESPONSE_LOGIN_SUCCESS
-			|| sm.message == SERVER_RESPONSE_YOU_HAVE_LOGINED
-			|| sm.message == SERVER_RESPONSE_LOGIN_FAIL_UNREGISTERED_USERID
-			|| sm.message == SERVER_RESPONSE_LOGIN_FAIL_ERROR_PASSWORD
-			|| sm.message == SERVER_RESPONSE_LOGIN_FAIL_DUP_USERID
-			|| sm.message == SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS
-			|| sm.message == SERVER_RESPONSE_LAUNCH_BATTLE_SUCCESS
-			|| sm.message == SERVER_RESPONSE_LAUNCH_BATTLE_FAIL)
-		global_serv_message = sm.message;
+		if(use_shm) {
+			if(pass_shm_channel() < 0) {
+				resume_try_failed(pfd);
+				return -1;
+			}
+			resume_wait(pfd, RESUME_OPENING, shm_ep.rx_efd, POLLIN);
+			return -1;
+		}
 	}
-	return NULL;
+
+	wlog("connected again, resume session\n");
+	pfd->fd = -1;
+	resume.stage = RESUME_WAITING;
+	resume.tries_left = 0;
+	rx_len = 0;
+	liveness.silent_ticks = 0;
+
+	client_message_t cm;
+	memset(&cm, 0, sizeof(client_message_t));
+	cm.command = CLIENT_COMMAND_RESUME_SESSION;
+	strncpy(cm.user_name, user_name, USERNAME_SIZE - 1);   // routes it through a gateway
+	memcpy(cm.resume_token, resume.token, RESUME_TOKEN_SIZE);
+	wrap_send(&cm);
+	return 0;
 }
 
-void start_message_monitor() {
-	pthread_t thread;
-	if(pthread_create(&thread, NULL, message_monitor, NULL) != 0) {
-		eprintf("fail to start message monitor.\n");
+void stdin_readable() {
+	unsigned char buf[64];
+	ssize_t len = read(STDIN_FILENO, buf, sizeof(buf));
+	if(len == 0) {
+		wlog("stdin closed\n");
+		resume_and_exit(0);
+	}
+
+	for(int i = 0; i < len; i++) {
+		int key = decode_key(buf[i]);
+		if(key != KEY_NONE)
+			respond_to_key(key);
+	}
+}
+
+void frame_tick(uint64_t ticks) {
+	static uint64_t frames = 0;
+
+	pending_reply_tick(ticks);
+	render_frame();
+
+	frames += ticks;
+	if(frames >= LOG_FLUSH_TICKS) {
+		frames = 0;
+		flush_log();
 	}
 }
 
+static volatile sig_atomic_t winch_pending = false;
+
+void on_winch(int sig) {
+	signal(SIGWINCH, on_winch);
+	winch_pending = true;
+}
+
+/* the only loop of client: waits on keyboard, server socket and the
+ * frame timer, every handler runs to completion without blocking */
+void run_event_loop() {
+	enum { FD_STDIN, FD_SERVER, FD_TIMER, FD_LINK, FD_RESUME, NR_FDS };
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if(timer_fd < 0) {
+		eprintf("fail to create frame timer\n");
+	}
 
-int main() {
+	struct itimerspec frame = {
+		{0, 1000000000L / RENDER_FPS},
+		{0, 1000000000L / RENDER_FPS},
+	};
+	timerfd_settime(timer_fd, 0, &frame, NULL);
+
+	struct pollfd fds[NR_FDS] = {
+		[FD_STDIN]  = {STDIN_FILENO, POLLIN},
+		[FD_SERVER] = {use_shm ? shm_ep.rx_efd : client_fd, POLLIN},
+		[FD_TIMER]  = {timer_fd, POLLIN},
+		// nothing but hangup comes over the socket of a ring
+		[FD_LINK]   = {use_shm ? client_fd : -1, POLLIN},
+		// what a try to resume the session waits on
+		[FD_RESUME] = {-1, 0},
+	};
+
+	signal(SIGWINCH, on_winch);
+
+	wlog("event loop starts\n");
+	while(1) {
+		if(winch_pending) {
+			winch_pending = false;
+			redraw_screen();
+		}
+
+		if(poll(fds, NR_FDS, -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			eprintf("fail to poll\n");
+		}
+
+		if(fds[FD_STDIN].revents) {
+			stdin_readable();
+		}
+
+		if(fds[FD_SERVER].revents && use_shm)
+			shm_clear_kick(&shm_ep);
+
+		if(fds[FD_SERVER].revents || fds[FD_LINK].revents) {
+			if(server_readable() < 0 || fds[FD_LINK].revents) {
+				fds[FD_SERVER].fd = -1;
+				fds[FD_LINK].fd = -1;
+				connection_lost();
+			}
+		}
+
+		if(fds[FD_TIMER].revents) {
+			uint64_t ticks = 0;
+			if(read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+				frame_tick(ticks);
+				if(fds[FD_SERVER].fd >= 0 && liveness_tick(ticks) < 0) {
+					wlog("server is silent for %d ms\n", IDLE_TIMEOUT_MS);
+					fds[FD_SERVER].fd = -1;
+					fds[FD_LINK].fd = -1;
+					connection_lost();
+				}else if(fds[FD_SERVER].fd < 0) {
+					resume_tick(ticks, &fds[FD_RESUME]);
+				}
+			}
+		}
+
+		if(fds[FD_RESUME].fd >= 0 && fds[FD_RESUME].revents
+		&& resume_step(&fds[FD_RESUME]) == 0) {
+			fds[FD_SERVER].fd = use_shm ? shm_ep.rx_efd : client_fd;
+			fds[FD_LINK].fd = use_shm ? client_fd : -1;
+		}
+
+		restore_input_cursor();
+		fflush(stdout);
+	}
+}
+
+/* hand the rings to the server over the Unix socket */
+int pass_shm_channel() {
+	int fds[SHM_NR_FDS];
+	if(shm_channel_create(&shm_ep, fds) < 0) {
+		wlog("fail to create shared memory channel\n");
+		return -1;
+	}
+
+	client_message_t cm;
+	memset(&cm, 0, sizeof(cm));
+	cm.command = CLIENT_COMMAND_SHM_CHANNEL;
+	int ret = send_with_fds(client_fd, &cm, sizeof(cm), fds, SHM_NR_FDS);
+	close(fds[0]);
+	if(ret < 0) {
+		wlog("fail to pass shared memory channel to server\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* the same and wait for the first reply of the server to come over
+ * the rings */
+int open_shm_channel() {
+	if(pass_shm_channel() < 0)
+		return -1;
+
+	struct pollfd pfd = {shm_ep.rx_efd, POLLIN, 0};
+	if(poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0) {
+		wlog("server doesn't answer on shared memory channel\n");
+		return -1;
+	}
+	wlog("shared memory channel is open\n");
+	return 0;
+}
+
+void parse_args(int argc, char *argv[]) {
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+			server_addr = argv[i + 1];
+			i ++;
+		}else if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+			unix_path = argv[i + 1];
+			i ++;
+		}else if(strcmp(argv[i], "-r") == 0) {
+			use_shm = true;
+		}else if(strcmp(argv[i], "-S") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%d", &spectate_bid) == 1
+		&& 0 <= spectate_bid && spectate_bid < USER_CNT) {
+			i ++;
+		}else{
+			eprintf("usage: %s [-h <server ip>] [-u <path> [-r]] [-S <battle>]\n"
+					"  -h  server address, %s by default\n"
+					"  -u  connect to the Unix socket of a local server\n"
+					"  -r  then talk over shared memory rings\n"
+					"  -S  watch a battle from ./spectator on -h, 0 to %d\n",
+					argv[0], server_addr, USER_CNT - 1);
+		}
+	}
+	if(use_shm && !unix_path)
+		eprintf("-r needs -u\n");
+	if(spectate_bid >= 0 && unix_path)
+		eprintf("-S watches over TCP only\n");
+}
+
+void start_spectating() {
+	uint8_t bid = spectate_bid;
+	if(send(client_fd, &bid, 1, MSG_NOSIGNAL) != 1)
+		eprintf("fail to ask for battle #%d\n", spectate_bid);
+	user_name = "spectator";
+	user_state = USER_STATE_BATTLE;
+	wlog("watch battle #%d\n", spectate_bid);
+}
+
+int main(int argc, char *argv[]) {
+	open_log();
 	wlog("====================START====================\n");
-	client_fd = connect_to_server();
+	parse_args(argc, argv);
+	client_fd = connect_to_server(false);
+	if(client_fd < 0)
+		eprintf("Can Not Connect To Server %s!\n", unix_path ? unix_path : server_addr);
+	if(use_shm && open_shm_channel() < 0)
+		eprintf("fail to open shared memory channel\n");
+	if(spectate_bid >= 0)
+		start_spectating();
 
 	system("clear");
 	init_scr_wh();
 	wrap_get_term_attr(&raw_termio);
 	hide_cursor();
+	echo_off();
+	disable_buffer();
 
 	flip_screen();
 
-	start_message_monitor();
-	start_ui();
+	wlog("enter start ui\n");
+	bottom_bar_output(0, "type w s a d to switch button, type <TAB> to enter command");
+	draw_current_ui();
+
+	run_event_loop();
 
 	resume_and_exit(0);
 	return 0;
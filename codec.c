@@ -0,0 +1,206 @@
+#include "codec.h"
+
+void bs_init(bitstream_t *bs, void *buf, size_t cap) {
+	bs->buf = buf;
+	bs->cap = cap;
+	bs->len = 0;
+	bs->acc = 0;
+	bs->nr_bits = 0;
+	bs->overflow = false;
+}
+
+int bits_of(uint32_t n) {
+	int bits = 1;
+	while(bits < 32 && (n - 1) >> bits)
+		bits ++;
+	return bits;
+}
+
+void bs_write(bitstream_t *bs, uint32_t v, int bits) {
+	if(bits < 32)
+		v &= (1u << bits) - 1;
+	bs->acc |= (uint64_t)v << bs->nr_bits;
+	bs->nr_bits += bits;
+
+	// spill whole 32-bit words, bs_flush writes the rest
+	if(bs->nr_bits >= 32) {
+		if(bs->len + 4 <= bs->cap) {
+			for(int i = 0; i < 4; i++)
+				bs->buf[bs->len ++] = (bs->acc >> (i * 8)) & 0xff;
+		}else{
+			bs->overflow = true;
+		}
+		bs->acc >>= 32;
+		bs->nr_bits -= 32;
+	}
+}
+
+void bs_write_varint(bitstream_t *bs, uint32_t v) {
+	while(v >> VARINT_BITS) {
+		bs_write(bs, (v & ((1 << VARINT_BITS) - 1)) | (1 << VARINT_BITS), VARINT_BITS + 1);
+		v >>= VARINT_BITS;
+	}
+	bs_write(bs, v, VARINT_BITS + 1);
+}
+
+size_t bs_flush(bitstream_t *bs) {
+	for(; bs->nr_bits > 0; bs->nr_bits -= 8) {
+		if(bs->len < bs->cap)
+			bs->buf[bs->len ++] = bs->acc & 0xff;
+		else
+			bs->overflow = true;
+		bs->acc >>= 8;
+	}
+	bs->nr_bits = 0;
+	return bs->overflow ? 0 : bs->len;
+}
+
+uint32_t bs_read(bitstream_t *bs, int bits) {
+	while(bs->nr_bits < bits) {
+		if(bs->len < bs->cap) {
+			bs->acc |= (uint64_t)bs->buf[bs->len ++] << bs->nr_bits;
+		}else{
+			bs->overflow = true;
+		}
+		bs->nr_bits += 8;
+	}
+
+	uint32_t v = bs->acc & ((1ull << bits) - 1);
+	bs->acc >>= bits;
+	bs->nr_bits -= bits;
+	return v;
+}
+
+void bs_read_align(bitstream_t *bs) {
+	bs->acc >>= bs->nr_bits % 8;
+	bs->nr_bits -= bs->nr_bits % 8;
+}
+
+uint32_t bs_read_varint(bitstream_t *bs) {
+	uint32_t v = 0;
+	for(int shift = 0; shift < 32; shift += VARINT_BITS) {
+		uint32_t group = bs_read(bs, VARINT_BITS + 1);
+		v |= (group & ((1 << VARINT_BITS) - 1)) << shift;
+		if(!(group >> VARINT_BITS))
+			break;
+	}
+	return v;
+}
+
+static int clamp_field(int v, int max) {
+	return v < 0 ? 0 : (v > max ? max : v);
+}
+
+size_t snapshot_encode_header(const server_message_t *psm, uint8_t *buf, size_t cap) {
+	bitstream_t bs;
+	bs_init(&bs, buf, cap);
+
+	bs_write(&bs, SERVER_MESSAGE_BATTLE_INFORMATION, 8);
+	bs_write(&bs, clamp_field((int8_t)psm->life, MAX_LIFE), bits_of(MAX_LIFE + 1));
+	bs_write(&bs, psm->index, bits_of(USER_CNT));
+	bs_write(&bs, clamp_field(psm->bullets_num, MAX_BULLETS), bits_of(MAX_BULLETS + 1));
+
+	size_t len = bs_flush(&bs);
+	assert(len == 0 || len == SNAPSHOT_HEADER_SIZE);
+	return len;
+}
+
+size_t snapshot_encode_shared(const server_message_t *psm, uint8_t *buf, size_t cap) {
+	bitstream_t bs;
+	bs_init(&bs, buf, cap);
+
+	int x_bits = bits_of(psm->map_w);
+	int y_bits = bits_of(psm->map_h);
+
+	bs_write(&bs, psm->map_w, bits_of(MAX_MAP_W + 1));
+	bs_write(&bs, psm->map_h, bits_of(MAX_MAP_H + 1));
+
+	for(int i = 0; i < USER_CNT; i++) {
+		if(psm->user_pos[i].x >= psm->map_w
+		|| psm->user_pos[i].y >= psm->map_h) {
+			bs_write(&bs, 0, 1);
+		}else{
+			bs_write(&bs, 1, 1);
+			bs_write(&bs, psm->user_pos[i].x, x_bits);
+			bs_write(&bs, psm->user_pos[i].y, y_bits);
+		}
+	}
+
+	int nr_items = 0;
+	for(int i = 0; i < MAX_ITEM; i++) {
+		if(psm->item_kind[i] != ITEM_NONE)
+			nr_items ++;
+	}
+
+	bs_write_varint(&bs, nr_items);
+	for(int i = 0, last = -1; i < MAX_ITEM; i++) {
+		if(psm->item_kind[i] == ITEM_NONE)
+			continue;
+
+		// kind and position fit in one write, at most 3 + 14 + 14 bits
+		uint32_t x = psm->item_pos[i].x & ((1 << x_bits) - 1);
+		uint32_t y = psm->item_pos[i].y & ((1 << y_bits) - 1);
+		bs_write_varint(&bs, i - last - 1);
+		bs_write(&bs, psm->item_kind[i] | (x << ITEM_KIND_BITS) | (y << (ITEM_KIND_BITS + x_bits)), ITEM_KIND_BITS + x_bits + y_bits);
+		last = i;
+	}
+
+	return bs_flush(&bs);
+}
+
+size_t snapshot_encode(const server_message_t *psm, uint8_t *buf, size_t cap) {
+	size_t header_len = snapshot_encode_header(psm, buf, cap);
+	if(header_len == 0) return 0;
+
+	size_t shared_len = snapshot_encode_shared(psm, buf + header_len, cap - header_len);
+	return shared_len ? header_len + shared_len : 0;
+}
+
+int snapshot_decode(const uint8_t *buf, size_t len, server_message_t *psm) {
+	bitstream_t bs;
+	bs_init(&bs, (void *)buf, len);
+
+	memset(psm, 0, sizeof(server_message_t));
+	psm->message = bs_read(&bs, 8);
+	psm->life = bs_read(&bs, bits_of(MAX_LIFE + 1));
+	psm->index = bs_read(&bs, bits_of(USER_CNT));
+	psm->bullets_num = bs_read(&bs, bits_of(MAX_BULLETS + 1));
+	bs_read_align(&bs);
+	psm->map_w = bs_read(&bs, bits_of(MAX_MAP_W + 1));
+	psm->map_h = bs_read(&bs, bits_of(MAX_MAP_H + 1));
+
+	if(psm->message != SERVER_MESSAGE_BATTLE_INFORMATION
+	|| psm->index >= USER_CNT
+	|| psm->map_w == 0 || psm->map_h == 0)
+		return -1;
+
+	int x_bits = bits_of(psm->map_w);
+	int y_bits = bits_of(psm->map_h);
+
+	for(int i = 0; i < USER_CNT; i++) {
+		if(bs_read(&bs, 1)) {
+			psm->user_pos[i].x = bs_read(&bs, x_bits);
+			psm->user_pos[i].y = bs_read(&bs, y_bits);
+		}else{
+			psm->user_pos[i].x = POS_NONE;
+			psm->user_pos[i].y = POS_NONE;
+		}
+	}
+
+	uint32_t nr_items = bs_read_varint(&bs);
+	if(nr_items > MAX_ITEM)
+		return -1;
+
+	for(int n = 0, i = -1; n < nr_items; n++) {
+		uint32_t skipped = bs_read_varint(&bs);
+		if(skipped >= MAX_ITEM || (i += skipped + 1) >= MAX_ITEM || bs.overflow)
+			return -1;
+
+		uint32_t item = bs_read(&bs, ITEM_KIND_BITS + x_bits + y_bits);
+		psm->item_kind[i] = item & ((1 << ITEM_KIND_BITS) - 1);
+		psm->item_pos[i].x = (item >> ITEM_KIND_BITS) & ((1 << x_bits) - 1);
+		psm->item_pos[i].y = item >> (ITEM_KIND_BITS + x_bits);
+	}
+
+	return bs.overflow ? -1 : 0;
+}
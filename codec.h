@@ -0,0 +1,69 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "common.h"
+
+/* bit-packed battle snapshot
+ *
+ *   fields are written LSB first into a bitstream with just enough
+ *   bits for their range. A snapshot is a header of the recipient,
+ *   padded to SNAPSHOT_HEADER_SIZE bytes, followed by the part shared
+ *   by all users of the battle:
+ *
+ *   header
+ *     message                 8 bits, SERVER_MESSAGE_BATTLE_INFORMATION
+ *     life, index, bullets    bits of MAX_LIFE, USER_CNT, MAX_BULLETS
+ *   shared
+ *     map_w, map_h            bits of MAX_MAP_W, MAX_MAP_H
+ *     users                   1 bit present, then position
+ *     number of items         varint
+ *     items                   varint number of empty slots skipped,
+ *                             3 bits kind, position
+ *
+ *   positions are quantized to the map, x takes bits of map_w and y
+ *   takes bits of map_h, e.g. 6 and 4 bits on the default 60x16 map.
+ *   varints are groups of VARINT_BITS data bits and a continue bit.
+ */
+#define VARINT_BITS 3
+#define ITEM_KIND_BITS 3
+
+#define SNAPSHOT_HEADER_SIZE 3
+#define SNAPSHOT_MAX_BYTES (sizeof(server_message_t))
+
+typedef struct bitstream_t {
+	uint8_t *buf;
+	size_t cap;     // bytes
+	size_t len;     // bytes read or written
+	uint64_t acc;
+	int nr_bits;    // bits in acc
+	int overflow;
+} bitstream_t;
+
+void bs_init(bitstream_t *bs, void *buf, size_t cap);
+
+void bs_write(bitstream_t *bs, uint32_t v, int bits);
+void bs_write_varint(bitstream_t *bs, uint32_t v);
+
+/* pad the last byte, return bytes written or 0 if overflowed */
+size_t bs_flush(bitstream_t *bs);
+
+uint32_t bs_read(bitstream_t *bs, int bits);
+uint32_t bs_read_varint(bitstream_t *bs);
+
+/* skip to the next byte boundary */
+void bs_read_align(bitstream_t *bs);
+
+/* bits to store values in [0, n) */
+int bits_of(uint32_t n);
+
+/* return bytes written, 0 if `cap` is too small */
+size_t snapshot_encode_header(const server_message_t *psm, uint8_t *buf, size_t cap);
+size_t snapshot_encode_shared(const server_message_t *psm, uint8_t *buf, size_t cap);
+
+/* header and shared part in one buffer */
+size_t snapshot_encode(const server_message_t *psm, uint8_t *buf, size_t cap);
+
+/* return -1 if `buf` is truncated or malformed */
+int snapshot_decode(const uint8_t *buf, size_t len, server_message_t *psm);
+
+#endif
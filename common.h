@@ -11,6 +11,8 @@
 #include <unistd.h>
 #include <termios.h>
 
+#include "log.h"
+
 #ifndef false
 #define false 0
 #endif
@@ -93,18 +95,16 @@
 #define VT100_COLOR_NORMAL   "38"
 
 
-#define log(fmt, ...) \
-	fprintf(stderr, "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_BLUE "m[LOG] \033[0m" "%s:%d: " fmt, __func__, __LINE__, ## __VA_ARGS__)
+#define log(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
 
 // inner log
-#define logi(fmt, ...) \
-	fprintf(stderr, "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_BLUE "m[LOG] \033[0m" "%s:%d: ==> " fmt, __func__, __LINE__, ## __VA_ARGS__)
+#define logi(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
-#define loge(fmt, ...) \
-	fprintf(stderr, "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_RED "m[ERROR] \033[0m" "%s:%d: " fmt, __func__, __LINE__, ## __VA_ARGS__)
+#define loge(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
 
 #define eprintf(...) do { \
 	loge(__VA_ARGS__); \
+	log_shutdown(); \
 	exit(0); \
 } while(0)
 
@@ -120,9 +120,17 @@
 #define SCR_W 60
 #define SCR_H 18
 
+/* default size of battlefield, server can be started with a larger
+ * map, the client only shows the part around you */
 #define BATTLE_W (SCR_W)
 #define BATTLE_H (SCR_H - 2)
 
+#define MAX_MAP_W 16384
+#define MAX_MAP_H 16384
+
+// coordinate of absent user
+#define POS_NONE 0xFFFF
+
 #define USERNAME_SIZE  7
 #define MSG_SIZE 40
 #define USER_CNT   5
@@ -142,7 +150,34 @@
 
 #define MAX_ITEM (USER_CNT * (MAX_BULLETS) + MAX_OTHER)
 
+// grass and magma, they are not items and never sent in snapshots
+#define MAX_TERRAIN 128
+#define MAX_TERRAIN_CELLS 128 // per terrain message
+
+/* the session of a dropped connection is kept this long for the
+ * client to connect again with the token given at login */
+#define RESUME_GRACE_MS 30000
+#define RESUME_TOKEN_SIZE 16
+
+/* clients send CLIENT_COMMAND_HEARTBEAT when they have had nothing
+ * else to send for HEARTBEAT_MS, the server answers it. Either side
+ * hearing nothing from the other for IDLE_TIMEOUT_MS drops the
+ * connection */
+#define HEARTBEAT_MS 2000
+#define IDLE_TIMEOUT_MS 10000
+
+// users in a page of CLIENT_COMMAND_LIST_USERS
+#define USER_PAGE_SIZE 64
+
 #define PORT 50000
+#define SPECTATOR_PORT 50001  // of ./spectator
+
+/* server sends frames to client: 16-bit little-endian length of
+ * payload, then payload. Payload is a server_message_t, or a packed
+ * battle snapshot (see codec.h) if its first byte is
+ * SERVER_MESSAGE_BATTLE_INFORMATION */
+#define FRAME_HEADER_SIZE 2
+#define MAX_FRAME_PAYLOAD (sizeof(server_message_t))
 
 enum {
 	CLIENT_COMMAND_USER_QUIT,
@@ -162,6 +197,16 @@ enum {
 	CLIENT_COMMAND_MOVE_LEFT,
 	CLIENT_COMMAND_MOVE_RIGHT,
 	CLIENT_COMMAND_FIRE,
+	CLIENT_COMMAND_JOIN_MATCH,
+	CLIENT_COMMAND_LEAVE_MATCH,
+	CLIENT_COMMAND_SHM_CHANNEL,  // Unix socket only, fds of shmring.h passed along
+	CLIENT_COMMAND_BATTLE_MESSAGE,
+	CLIENT_COMMAND_ADD_FRIEND,
+	CLIENT_COMMAND_ACCEPT_FRIEND,
+	CLIENT_COMMAND_REMOVE_FRIEND,     // also declines or cancels a request
+	CLIENT_COMMAND_LIST_USERS,
+	CLIENT_COMMAND_RESUME_SESSION,    // instead of logging in again, with the user name
+	CLIENT_COMMAND_HEARTBEAT,
 	CLIENT_COMMAND_END,
 };
 
@@ -185,6 +230,17 @@ enum {
 	SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE,
 	SERVER_RESPONSE_INVITATION_SENT,
 	SERVER_RESPONSE_NOBODY_INVITE_YOU,
+	SERVER_RESPONSE_MATCH_QUEUED,
+	SERVER_RESPONSE_MATCH_LEFT,
+	SERVER_RESPONSE_SHM_CHANNEL_READY,        // first frame over the channel
+	SERVER_RESPONSE_CHAT_THROTTLED,
+	SERVER_RESPONSE_FRIEND_REQUEST_SENT,
+	SERVER_RESPONSE_FRIEND_REQUEST_FAIL,     // no such user, or too many friends
+	SERVER_RESPONSE_NOT_YOUR_FRIEND,
+	SERVER_RESPONSE_USER_PAGE,
+	SERVER_RESPONSE_SESSION_RESUMED,
+	SERVER_RESPONSE_RESUME_FAIL,
+	SERVER_RESPONSE_HEARTBEAT,
 	/* ----------------------------------------------- */
 	SERVER_MESSAGE_DELIM,
 	SERVER_MESSAGE_FRIEND_LOGIN,
@@ -204,6 +260,19 @@ enum {
 	SERVER_MESSAGE_YOU_GOT_BLOOD_VIAL,
 	SERVER_MESSAGE_YOU_GOT_MAGAZINE,
 	SERVER_MESSAGE_YOUR_MAGAZINE_IS_EMPTY,
+	SERVER_MESSAGE_TERRAIN,
+	SERVER_MESSAGE_MATCH_FOUND,
+	SERVER_MESSAGE_PRESENCE,
+	SERVER_MESSAGE_FRIEND_REQUEST,
+	SERVER_MESSAGE_FRIEND_ADDED,
+	SERVER_MESSAGE_FRIEND_REMOVED,
+};
+
+// chat channel of SERVER_MESSAGE_FRIEND_MESSAGE
+enum {
+	CHAT_GLOBAL,
+	CHAT_BATTLE,
+	CHAT_DIRECT,
 };
 
 enum {
@@ -235,16 +304,19 @@ enum {
  * unused  -->  not login  -->  unused  // login fail
  *
  * login  <-->  invited to battle  <-->  battle
+ *
+ * login  <-->  matching  -->  battle
  * */
 #define USER_STATE_UNUSED          0
 #define USER_STATE_NOT_LOGIN       1
 #define USER_STATE_LOGIN           2
 #define USER_STATE_BATTLE          3
 #define USER_STATE_WAIT_TO_BATTLE  4
+#define USER_STATE_MATCHING        5
 
 typedef struct pos_t {
-	uint8_t x;
-	uint8_t y; 
+	uint16_t x;
+	uint16_t y;
 } pos_t;
 
 // format of messages sended from client to server
@@ -255,6 +327,14 @@ typedef struct client_message_t {
 	{
 		char message[MSG_SIZE];
 		char password[PASSWORD_SIZE];
+		uint8_t resume_token[RESUME_TOKEN_SIZE];
+
+		/* listing of users whose name starts with `user_name`,
+		 * after `cursor` of the last page, empty for the first */
+		struct {
+			char cursor[USERNAME_SIZE];
+			uint16_t nr_wanted;          // 0 for all
+		};
 	};
 } client_message_t;
 
@@ -269,6 +349,13 @@ typedef struct server_message_t {
 		// support at most five users
 		char friend_name[USERNAME_SIZE];
 
+		/* token of SERVER_RESPONSE_LOGIN_SUCCESS, a new one and the
+		 * state of the session with SERVER_RESPONSE_SESSION_RESUMED */
+		struct {
+			uint8_t session_token[RESUME_TOKEN_SIZE];
+			uint8_t session_state;
+		};
+
 		struct {
 			char user_name[USERNAME_SIZE];
 			uint8_t user_state;
@@ -276,6 +363,7 @@ typedef struct server_message_t {
 
 		struct {
 			uint8_t life, index, bullets_num;
+			uint16_t map_w, map_h;
 			pos_t user_pos[USER_CNT];
 			uint8_t item_kind[MAX_ITEM];
 			pos_t item_pos[MAX_ITEM];
@@ -284,7 +372,44 @@ typedef struct server_message_t {
 		struct {
 			char from_user[USERNAME_SIZE];
 			char msg[MSG_SIZE];
+			uint8_t channel;         // CHAT_*
+			uint8_t replayed;        // from history
 		}; // for message
+
+		/* terrain cells of battle, sent when joining a battle with
+		 * `terrain_reset` set and then only for changed cells, kind
+		 * ITEM_NONE removes the terrain of a cell */
+		struct {
+			uint8_t terrain_reset;
+			uint8_t nr_cells;
+			uint8_t cell_kind[MAX_TERRAIN_CELLS];
+			pos_t cell_pos[MAX_TERRAIN_CELLS];
+		};
+
+		/* a page of CLIENT_COMMAND_LIST_USERS sorted by name,
+		 * `more` if users after `page_cursor` are left */
+		struct {
+			uint8_t nr_listed;
+			uint8_t more;
+			char page_cursor[USERNAME_SIZE];
+			struct {
+				char user_name[USERNAME_SIZE];
+				uint8_t user_state;
+			} listed[USER_PAGE_SIZE];
+		};
+
+		/* friends by session slot, all online friends after login
+		 * or a change of friends with `presence_reset` set and then
+		 * only changed slots */
+		struct {
+			uint8_t presence_reset;
+			uint8_t nr_presence;
+			struct {
+				uint8_t slot;
+				uint8_t user_state;
+				char user_name[USERNAME_SIZE];
+			} presence[USER_CNT];
+		};
 	};
 } server_message_t;
 
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+#include "feed.h"
+
+#define MAX_FRAME (FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD)
+
+feed_t *feed_create(const char *path) {
+	// keep the inode, spectators may have the old feed mapped
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(fd < 0 || ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(feed_t)) == -1) {
+		loge("fail to create feed %s: %s\n", path, strerror(errno));
+		if(fd >= 0) close(fd);
+		return NULL;
+	}
+
+	feed_t *feed = mmap(NULL, sizeof(feed_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(feed == MAP_FAILED) {
+		loge("fail to map feed %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	for(int i = 0; i < USER_CNT; i++) {
+		atomic_init(&feed->rings[i].epoch, 0);
+		atomic_init(&feed->rings[i].head, 0);
+		atomic_init(&feed->rings[i].keyframe, 0);
+	}
+	feed->nr_rings = USER_CNT;
+	atomic_thread_fence(memory_order_release);
+	feed->magic = FEED_MAGIC;
+	return feed;
+}
+
+const feed_t *feed_open(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) == -1 || st.st_size < sizeof(feed_t)) {
+		loge("no feed at %s\n", path);
+		if(fd >= 0) close(fd);
+		return NULL;
+	}
+
+	const feed_t *feed = mmap(NULL, sizeof(feed_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(feed == MAP_FAILED) {
+		loge("fail to map feed %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if(feed->magic != FEED_MAGIC || feed->nr_rings != USER_CNT) {
+		loge("feed %s is of another build\n", path);
+		munmap((void *)feed, sizeof(feed_t));
+		return NULL;
+	}
+	return feed;
+}
+
+void feed_begin(feed_ring_t *ring) {
+	atomic_store(&ring->keyframe, atomic_load(&ring->head));
+	uint32_t epoch = atomic_load(&ring->epoch);
+	atomic_store(&ring->epoch, epoch + (epoch & 1 ? 2 : 1));
+}
+
+void feed_end(feed_ring_t *ring) {
+	uint32_t epoch = atomic_load(&ring->epoch);
+	if(epoch & 1)
+		atomic_store(&ring->epoch, epoch + 1);
+}
+
+static void copy_in(feed_ring_t *ring, uint64_t pos, const void *buf, size_t len) {
+	size_t idx = pos & (FEED_RING_SIZE - 1);
+	size_t first = len < FEED_RING_SIZE - idx ? len : FEED_RING_SIZE - idx;
+	memcpy(ring->data + idx, buf, first);
+	memcpy(ring->data, (const uint8_t *)buf + first, len - first);
+}
+
+static void copy_out(const feed_ring_t *ring, uint64_t pos, void *buf, size_t len) {
+	size_t idx = pos & (FEED_RING_SIZE - 1);
+	size_t first = len < FEED_RING_SIZE - idx ? len : FEED_RING_SIZE - idx;
+	memcpy(buf, ring->data + idx, first);
+	memcpy((uint8_t *)buf + first, ring->data, len - first);
+}
+
+void feed_write(feed_ring_t *ring, int kind, const struct iovec *iov, int iovcnt) {
+	size_t len = 0;
+	for(int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if(len > MAX_FRAME) {
+		loge("frame of %zu bytes doesn't fit in feed\n", len);
+		return;
+	}
+
+	/* a reader that sees any byte written below also sees the head
+	 * published before, and so knows the record may be torn */
+	atomic_thread_fence(memory_order_release);
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint8_t header[FEED_RECORD_HEADER_SIZE] = {kind, len & 0xff, len >> 8};
+	copy_in(ring, head, header, FEED_RECORD_HEADER_SIZE);
+
+	uint64_t pos = head + FEED_RECORD_HEADER_SIZE;
+	for(int i = 0; i < iovcnt; i++) {
+		copy_in(ring, pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	atomic_store_explicit(&ring->head, pos, memory_order_release);
+}
+
+void feed_mark_keyframe(feed_ring_t *ring) {
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	feed_write(ring, FEED_KEYFRAME, NULL, 0);
+	atomic_store_explicit(&ring->keyframe, head, memory_order_release);
+}
+
+// bytes at `pos` can't be rewritten until the writer passes `head`
+static int lapped(uint64_t head, uint64_t pos) {
+	return pos > head || head - pos + FEED_MAX_RECORD > FEED_RING_SIZE;
+}
+
+int feed_read(const feed_ring_t *ring, uint64_t *pos, int *kind, uint8_t *buf, size_t *len) {
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if(*pos == head) return 0;
+	if(lapped(head, *pos)) return -1;
+
+	uint8_t header[FEED_RECORD_HEADER_SIZE];
+	copy_out(ring, *pos, header, FEED_RECORD_HEADER_SIZE);
+	*kind = header[0];
+	*len = header[1] | (header[2] << 8);
+	if(*len > MAX_FRAME) return -1;
+	copy_out(ring, *pos + FEED_RECORD_HEADER_SIZE, buf, *len);
+
+	atomic_thread_fence(memory_order_acquire);
+	if(lapped(atomic_load_explicit(&ring->head, memory_order_relaxed), *pos))
+		return -1;
+
+	*pos += FEED_RECORD_HEADER_SIZE + *len;
+	return 1;
+}
@@ -0,0 +1,79 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#include "common.h"
+
+/* spectator feed
+ *
+ *   the server publishes the frames of every battle into a file mapped
+ *   by the spectator server (see spectator.c), one ring per battle. A
+ *   ring is written only by the simulation worker ticking the battle
+ *   and is never waited on, so the number of spectators costs the
+ *   simulation nothing. Readers map the file read-only, copy a record
+ *   out and check afterwards that the writer hasn't lapped it.
+ *
+ *   record
+ *     kind                    1 byte, FEED_*
+ *     length                  2 bytes little endian
+ *     frame                   as sent to users, length prefix included
+ *
+ *   every FEED_KEYFRAME_TICKS the battle writes a FEED_KEYFRAME marker
+ *   followed by its whole terrain before the snapshot of the tick,
+ *   `keyframe` tells where the latest marker starts. A reader joining or lapped resumes there. Battle
+ *   snapshots carry the full state anyway, only terrain goes by diffs.
+ *
+ *   `epoch` is odd while a battle runs in the slot and bumped when it
+ *   starts and ends.
+ */
+#define FEED_MAGIC 0x44454546          // "FEED"
+#define FEED_PATH "/dev/shm/shooter-feed"
+#define FEED_RING_SIZE (1024 * 1024)   // power of 2
+#define FEED_KEYFRAME_TICKS 40
+#define FEED_RECORD_HEADER_SIZE 3
+#define FEED_MAX_RECORD (FEED_RECORD_HEADER_SIZE + FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD)
+
+enum {
+	FEED_KEYFRAME,    // empty, terrain reset follows
+	FEED_TERRAIN,
+	FEED_SNAPSHOT,
+};
+
+typedef struct feed_ring_t {
+	_Atomic uint32_t epoch;
+	char pad0[60];
+	_Atomic uint64_t head;      // bytes written
+	_Atomic uint64_t keyframe;  // offset of the latest keyframe marker
+	char pad1[48];
+	uint8_t data[FEED_RING_SIZE];
+} feed_ring_t;
+
+typedef struct feed_t {
+	uint32_t magic;
+	uint32_t nr_rings;
+	char pad[56];
+	feed_ring_t rings[USER_CNT];
+} feed_t;
+
+/* create or truncate the feed file at `path` and map it */
+feed_t *feed_create(const char *path);
+
+/* map an existing feed file read-only, NULL on error */
+const feed_t *feed_open(const char *path);
+
+/* writer side, only the worker ticking the battle writes its ring */
+void feed_begin(feed_ring_t *ring);
+void feed_end(feed_ring_t *ring);
+void feed_mark_keyframe(feed_ring_t *ring);
+void feed_write(feed_ring_t *ring, int kind, const struct iovec *iov, int iovcnt);
+
+/* read the frame of the record at `*pos` into `buf` of
+ * FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD bytes and advance `*pos`,
+ * return 1 if read, 0 if there is none yet or -1 if the writer has
+ * lapped `*pos` */
+int feed_read(const feed_ring_t *ring, uint64_t *pos, int *kind, uint8_t *buf, size_t *len);
+
+#endif
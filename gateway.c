@@ -0,0 +1,766 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "common.h"
+
+/* gateway in front of backend server processes
+ *
+ *   usage: ./gateway [-n <backends>] [-s <server binary>] [-- <server options>]
+ *
+ *   clients connect to the gateway on PORT as they would to a server.
+ *   The gateway spawns backend servers listening on Unix sockets only
+ *   and relays every client to one of them over a connection of its
+ *   own, client messages one way and frames the other.
+ *
+ *   a user is routed by consistent hashing of the name it registers or
+ *   logs in with, so a user always lands on the same backend and adding
+ *   a backend moves only 1/n of the users. Battles live on the backend
+ *   of their launcher: an idle user invited from another backend is
+ *   moved there first, by logging in again on the launcher's backend.
+ *
+ *   a client resuming its session after its connection dropped is
+ *   routed by the name it sends along with the token, so it reaches the
+ *   backend which kept the session. A client hanging up leaves its
+ *   session kept there, only leaving a backend by a move ends it. The
+ *   gateway doesn't know the password of a resumed user, so it isn't
+ *   moved or logged in again.
+ *
+ *   a crashed backend is spawned again. Its users stay connected to the
+ *   gateway, which logs them in again once the backend is back, users
+ *   who were in a battle are told it is disbanded. While a backend is
+ *   down, commands of its users are dropped.
+ *
+ *   passwords don't go past the gateway, see password_digest(). Frames
+ *   to a client are queued while it doesn't read and it is dropped once
+ *   CLIENT_BACKLOG bytes are queued, so no client holds up the others.
+ *   Messages to a backend are queued the same way, a client isn't read
+ *   while its queue has no room for another message, so a backend that
+ *   doesn't read holds up only its own clients.
+ */
+
+#define MAX_BACKENDS 16
+#define VNODES_PER_BACKEND 64
+#define MAX_CLIENTS 256
+
+#define POLL_MS 100
+#define RESPAWN_MS 1000
+#define RECONNECT_MS 500
+#define HOLD_MS 1000     // longest wait for an invited user to move
+#define IDLE_MS 1000     // no battle snapshot for this long means idle
+#define CLIENT_BACKLOG (64 * 1024)
+#define UPSTREAM_BACKLOG (64 * sizeof(client_message_t))
+
+#define BACKEND_PATH "/tmp/shooter-%d-backend-%d.sock"
+
+struct backend_t {
+	char path[108];
+	pid_t pid;           // 0 if not running
+	int64_t respawn_at;
+} backends[MAX_BACKENDS];
+
+static int nr_backends = 2;
+static const char *server_bin = "./server";
+static char **server_args = NULL;
+static int nr_server_args = 0;
+
+struct ring_point_t {
+	uint32_t hash;
+	int backend;
+} ring[MAX_BACKENDS * VNODES_PER_BACKEND];
+
+static int ring_size = 0;
+
+struct client_t {
+	int fd;              // client, -1 if slot is unused
+	int up;              // backend, -1 if not connected
+	int backend;         // -1 before routed
+	int logged_in;
+	char user_name[USERNAME_SIZE];
+	char digest[PASSWORD_SIZE];   // to log in again, see password_digest()
+	int nr_swallow;      // replies of replayed login to drop
+	int64_t reconnect_at;
+	int64_t last_battle_ms;
+
+	// client message being received, or held until `held_for` moved
+	uint8_t in[sizeof(client_message_t)];
+	size_t in_len;
+	int held_for;
+	int64_t held_since;
+
+	// frame being received from backend
+	uint8_t out[FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD];
+	size_t out_len;
+
+	// bytes queued to the client
+	uint8_t tx[CLIENT_BACKLOG];
+	size_t tx_len;
+
+	// bytes queued to the backend
+	uint8_t up_tx[UPSTREAM_BACKLOG];
+	size_t up_tx_len;
+} clients[MAX_CLIENTS];
+
+static int listen_fd = -1;
+static uint8_t secret[16];   // key of password digests
+static volatile sig_atomic_t terminating = false;
+
+int64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint32_t fnv1a(const char *s, size_t n) {
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < n && s[i]; i++) {
+		h ^= (uint8_t)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* what backends get instead of the password of `user_name`: a digest
+ * keyed by the secret of this gateway, printable and of the same size.
+ * The gateway keeps it to log the user in again on another backend and
+ * forgets the password itself */
+void password_digest(const char *user_name, const char *password, char *digest) {
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint64_t h = 14695981039346656037ull;
+	for(int i = 0; i < sizeof(secret); i++)
+		h = (h ^ secret[i]) * 1099511628211ull;
+	for(int i = 0; i < USERNAME_SIZE - 1 && user_name[i]; i++)
+		h = (h ^ (uint8_t)user_name[i]) * 1099511628211ull;
+	h = (h ^ 0xff) * 1099511628211ull;
+	for(int i = 0; i < PASSWORD_SIZE - 1 && password[i]; i++)
+		h = (h ^ (uint8_t)password[i]) * 1099511628211ull;
+
+	// finalizer of splitmix64
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+	h ^= h >> 31;
+
+	for(int i = 0; i < PASSWORD_SIZE - 1; i++, h >>= 6)
+		digest[i] = alphabet[h & 63];
+	digest[PASSWORD_SIZE - 1] = 0;
+}
+
+int cmp_ring_point(const void *a, const void *b) {
+	uint32_t ha = ((const struct ring_point_t *)a)->hash;
+	uint32_t hb = ((const struct ring_point_t *)b)->hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+void build_ring() {
+	char key[32];
+	ring_size = 0;
+	for(int b = 0; b < nr_backends; b++) {
+		for(int v = 0; v < VNODES_PER_BACKEND; v++) {
+			snprintf(key, sizeof(key), "backend-%d-%d", b, v);
+			ring[ring_size].hash = fnv1a(key, sizeof(key));
+			ring[ring_size].backend = b;
+			ring_size ++;
+		}
+	}
+	qsort(ring, ring_size, sizeof(ring[0]), cmp_ring_point);
+}
+
+int backend_of_user(const char *user_name) {
+	uint32_t h = fnv1a(user_name, USERNAME_SIZE - 1);
+	int lo = 0, hi = ring_size;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ring[lo % ring_size].backend;
+}
+
+void spawn_backend(int b) {
+	struct backend_t *backend = &backends[b];
+	unlink(backend->path);
+
+	pid_t pid = fork();
+	if(pid < 0) {
+		loge("fail to fork backend #%d\n", b);
+		backend->respawn_at = now_ms() + RESPAWN_MS;
+		return;
+	}
+
+	if(pid == 0) {
+		char *argv[nr_server_args + 6];
+		int argc = 0;
+		argv[argc ++] = (char *)server_bin;
+		argv[argc ++] = "-p";
+		argv[argc ++] = "0";
+		argv[argc ++] = "-u";
+		argv[argc ++] = backend->path;
+		for(int i = 0; i < nr_server_args; i++)
+			argv[argc ++] = server_args[i];
+		argv[argc] = NULL;
+
+		setpgid(0, 0); // not stopped by ^C of the terminal, the gateway stops it
+		execv(server_bin, argv);
+		fprintf(stderr, "fail to exec %s\n", server_bin);
+		_exit(1);
+	}
+
+	log("spawn backend #%d pid %d on %s\n", b, pid, backend->path);
+	backend->pid = pid;
+}
+
+void reap_backends() {
+	int status;
+	pid_t pid;
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for(int b = 0; b < nr_backends; b++) {
+			if(backends[b].pid != pid)
+				continue;
+
+			loge("backend #%d pid %d exited, status %d\n", b, pid, status);
+			backends[b].pid = 0;
+			backends[b].respawn_at = now_ms() + RESPAWN_MS;
+		}
+	}
+
+	for(int b = 0; b < nr_backends; b++) {
+		if(backends[b].pid == 0 && now_ms() >= backends[b].respawn_at)
+			spawn_backend(b);
+	}
+}
+
+void close_client(struct client_t *c);
+
+/* send what the client takes now and queue the rest, return -1 and
+ * close it if it is too far behind */
+int queue_to_client(struct client_t *c, const void *buf, size_t len) {
+	if(c->tx_len == 0) {
+		ssize_t sent = send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent < 0 && errno != EAGAIN && errno != EINTR) {
+			close_client(c);
+			return -1;
+		}
+		if(sent > 0) {
+			buf = (const uint8_t *)buf + sent;
+			len -= sent;
+		}
+	}
+	if(len == 0)
+		return 0;
+
+	if(c->tx_len + len > CLIENT_BACKLOG) {
+		loge("client %d is %zu bytes behind, drop it\n", c->fd, c->tx_len + len);
+		close_client(c);
+		return -1;
+	}
+	memcpy(c->tx + c->tx_len, buf, len);
+	c->tx_len += len;
+	return 0;
+}
+
+void client_writable(struct client_t *c) {
+	ssize_t sent = send(c->fd, c->tx, c->tx_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if(sent < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if(sent < 0) {
+		close_client(c);
+		return;
+	}
+	c->tx_len -= sent;
+	memmove(c->tx, c->tx + sent, c->tx_len);
+}
+
+void send_to_client(struct client_t *c, int message) {
+	uint8_t frame[FRAME_HEADER_SIZE + sizeof(server_message_t)];
+	server_message_t *psm = (server_message_t *)(frame + FRAME_HEADER_SIZE);
+	memset(frame, 0, sizeof(frame));
+	frame[0] = sizeof(server_message_t) & 0xff;
+	frame[1] = sizeof(server_message_t) >> 8;
+	psm->message = message;
+	queue_to_client(c, frame, sizeof(frame));
+}
+
+/* send what the backend takes now and queue the rest, return -1 if
+ * the backend is gone or the queue is full */
+int queue_to_backend(struct client_t *c, const void *buf, size_t len) {
+	if(c->up_tx_len == 0) {
+		ssize_t sent = send(c->up, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if(sent > 0) {
+			buf = (const uint8_t *)buf + sent;
+			len -= sent;
+		}
+	}
+	if(len == 0)
+		return 0;
+
+	if(c->up_tx_len + len > UPSTREAM_BACKLOG) {
+		loge("backend #%d is %zu bytes behind for client %d\n", c->backend, c->up_tx_len + len, c->fd);
+		return -1;
+	}
+	memcpy(c->up_tx + c->up_tx_len, buf, len);
+	c->up_tx_len += len;
+	return 0;
+}
+
+void backend_lost(struct client_t *c);
+
+void backend_writable(struct client_t *c) {
+	ssize_t sent = send(c->up, c->up_tx, c->up_tx_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if(sent < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if(sent < 0) {
+		backend_lost(c);
+		return;
+	}
+	c->up_tx_len -= sent;
+	memmove(c->up_tx, c->up_tx + sent, c->up_tx_len);
+}
+
+int send_command(struct client_t *c, int command) {
+	client_message_t cm;
+	memset(&cm, 0, sizeof(cm));
+	cm.command = command;
+	strncpy(cm.user_name, c->user_name, USERNAME_SIZE - 1);
+	strncpy(cm.password, c->digest, PASSWORD_SIZE - 1);
+	return queue_to_backend(c, &cm, sizeof(cm));
+}
+
+int connect_backend(int b) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) return -1;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, backends[b].path);
+	// a backend with a full backlog is tried again later
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// the backend sees a dropped connection and keeps the session for resumption
+void close_backend(struct client_t *c) {
+	if(c->up < 0) return;
+
+	close(c->up);
+	c->up = -1;
+	c->out_len = 0;
+	c->up_tx_len = 0;
+	c->nr_swallow = 0;
+}
+
+// the session on the backend ends, if the backend takes the quit now
+void detach_backend(struct client_t *c) {
+	if(c->up < 0) return;
+
+	send_command(c, CLIENT_COMMAND_USER_QUIT);
+	close_backend(c);
+}
+
+/* connect `c` to backend `b`, a logged in user logs in again there */
+void attach_backend(struct client_t *c, int b) {
+	detach_backend(c);
+	c->backend = b;
+	c->up = connect_backend(b);
+	if(c->up < 0) {
+		c->reconnect_at = now_ms() + RECONNECT_MS;
+		return;
+	}
+
+	c->reconnect_at = 0;
+	if(c->logged_in && c->digest[0]) {
+		log("log in %s again on backend #%d\n", c->user_name, b);
+		c->nr_swallow = 2;
+		if(send_command(c, CLIENT_COMMAND_USER_REGISTER) < 0
+		|| send_command(c, CLIENT_COMMAND_USER_LOGIN) < 0)
+			backend_lost(c);
+	}else{
+		c->logged_in = false;
+	}
+}
+
+int is_idle(struct client_t *c) {
+	return now_ms() - c->last_battle_ms >= IDLE_MS;
+}
+
+void backend_lost(struct client_t *c) {
+	log("client %d lost backend #%d\n", c->fd, c->backend);
+	close_backend(c);
+	c->reconnect_at = now_ms() + RECONNECT_MS;
+
+	if(!is_idle(c)) {
+		send_to_client(c, SERVER_MESSAGE_BATTLE_DISBANDED);
+		c->last_battle_ms = 0;
+	}
+}
+
+void close_client(struct client_t *c) {
+	log("client %d@%s leaves\n", c->fd, c->logged_in ? c->user_name : "");
+	close_backend(c);
+	close(c->fd);
+	c->fd = -1;
+	c->tx_len = 0;
+}
+
+struct client_t *find_client(const char *user_name) {
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		if(clients[i].fd >= 0 && clients[i].logged_in
+		&& strncmp(clients[i].user_name, user_name, USERNAME_SIZE - 1) == 0)
+			return &clients[i];
+	}
+	return NULL;
+}
+
+void forward_client_message(struct client_t *c) {
+	c->in_len = 0;
+	if(c->up < 0) {
+		logi("drop command of client %d, backend #%d is down\n", c->fd, c->backend);
+		return;
+	}
+
+	if(queue_to_backend(c, c->in, sizeof(client_message_t)) < 0)
+		backend_lost(c);
+}
+
+void handle_client_message(struct client_t *c) {
+	client_message_t *pcm = (client_message_t *)c->in;
+	pcm->user_name[USERNAME_SIZE - 1] = 0;
+
+	if(pcm->command == CLIENT_COMMAND_USER_REGISTER
+	|| pcm->command == CLIENT_COMMAND_USER_LOGIN) {
+		char digest[PASSWORD_SIZE];
+		password_digest(pcm->user_name, pcm->password, digest);
+		memcpy(pcm->password, digest, PASSWORD_SIZE);
+	}
+
+	if(!c->logged_in
+	&& (pcm->command == CLIENT_COMMAND_USER_REGISTER
+	|| pcm->command == CLIENT_COMMAND_USER_LOGIN)) {
+		int b = backend_of_user(pcm->user_name);
+		if(pcm->command == CLIENT_COMMAND_USER_LOGIN) {
+			strncpy(c->user_name, pcm->user_name, USERNAME_SIZE - 1);
+			memcpy(c->digest, pcm->password, PASSWORD_SIZE);
+		}
+		if(b != c->backend) {
+			log("route %s to backend #%d\n", pcm->user_name, b);
+			attach_backend(c, b);
+		}
+	}else if(!c->logged_in && pcm->command == CLIENT_COMMAND_RESUME_SESSION) {
+		int b = backend_of_user(pcm->user_name);
+		strncpy(c->user_name, pcm->user_name, USERNAME_SIZE - 1);
+		memset(c->digest, 0, PASSWORD_SIZE);
+		if(b != c->backend) {
+			log("route resumption of %s to backend #%d\n", pcm->user_name, b);
+			attach_backend(c, b);
+		}
+	}else if(c->backend < 0) {
+		attach_backend(c, backend_of_user(""));
+	}
+
+	switch(pcm->command) {
+		case CLIENT_COMMAND_USER_LOGOUT:
+			c->logged_in = false;
+			break;
+		case CLIENT_COMMAND_LAUNCH_BATTLE:
+		case CLIENT_COMMAND_INVITE_USER: {
+			// bring the invited user to the backend of this battle
+			struct client_t *f = find_client(pcm->user_name);
+			if(f && f != c && f->backend != c->backend && is_idle(f) && f->digest[0]) {
+				log("move %s to backend #%d for battle of %s\n",
+						f->user_name, c->backend, c->user_name);
+				attach_backend(f, c->backend);
+				c->held_for = f - clients;
+				c->held_since = now_ms();
+				return;
+			}
+			break;
+		}
+	}
+
+	forward_client_message(c);
+}
+
+/* release a message held until the invited user has logged in */
+void release_held(struct client_t *c) {
+	struct client_t *f = &clients[c->held_for];
+	if(f->fd >= 0 && f->nr_swallow > 0
+	&& now_ms() - c->held_since < HOLD_MS)
+		return;
+
+	c->held_for = -1;
+	forward_client_message(c);
+}
+
+int is_login_reply(int message) {
+	return message == SERVER_RESPONSE_REGISTER_SUCCESS
+		|| message == SERVER_RESPONSE_REGISTER_FAIL
+		|| message == SERVER_RESPONSE_YOU_HAVE_REGISTERED
+		|| message == SERVER_RESPONSE_LOGIN_SUCCESS
+		|| message == SERVER_RESPONSE_YOU_HAVE_LOGINED
+		|| message == SERVER_RESPONSE_LOGIN_FAIL_UNREGISTERED_USERID
+		|| message == SERVER_RESPONSE_LOGIN_FAIL_ERROR_PASSWORD
+		|| message == SERVER_RESPONSE_LOGIN_FAIL_DUP_USERID
+		|| message == SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS;
+}
+
+void handle_backend_frame(struct client_t *c) {
+	int message = c->out_len > FRAME_HEADER_SIZE ? c->out[FRAME_HEADER_SIZE] : SERVER_SAY_NOTHING;
+	size_t len = c->out_len;
+	c->out_len = 0;
+
+	if(c->nr_swallow > 0 && is_login_reply(message)) {
+		c->nr_swallow --;
+		return;
+	}
+
+	if(message == SERVER_MESSAGE_BATTLE_INFORMATION)
+		c->last_battle_ms = now_ms();
+	else if(message == SERVER_RESPONSE_LOGIN_SUCCESS
+	|| message == SERVER_RESPONSE_SESSION_RESUMED)
+		c->logged_in = true;
+
+	queue_to_client(c, c->out, len);
+}
+
+void client_readable(struct client_t *c) {
+	ssize_t len = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+	if(len < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if(len <= 0) {
+		close_client(c);
+		return;
+	}
+
+	c->in_len += len;
+	if(c->in_len == sizeof(client_message_t))
+		handle_client_message(c);
+}
+
+void backend_readable(struct client_t *c) {
+	// read the frame header first, then exactly its payload
+	size_t want = FRAME_HEADER_SIZE;
+	if(c->out_len >= FRAME_HEADER_SIZE)
+		want += c->out[0] | (c->out[1] << 8);
+
+	if(want > sizeof(c->out)) {
+		loge("bad frame of %zu bytes from backend #%d\n", want, c->backend);
+		backend_lost(c);
+		return;
+	}
+
+	ssize_t len = recv(c->up, c->out + c->out_len, want - c->out_len, MSG_DONTWAIT);
+	if(len < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if(len <= 0) {
+		backend_lost(c);
+		return;
+	}
+
+	c->out_len += len;
+	if(c->out_len >= FRAME_HEADER_SIZE
+	&& c->out_len == FRAME_HEADER_SIZE + (c->out[0] | (c->out[1] << 8)))
+		handle_backend_frame(c);
+}
+
+void accept_client() {
+	struct sockaddr_in client_addr;
+	socklen_t length = sizeof(client_addr);
+	int fd = accept(listen_fd, (struct sockaddr *)&client_addr, &length);
+	if(fd < 0) {
+		loge("fail to accept client\n");
+		return;
+	}
+
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		if(clients[i].fd >= 0)
+			continue;
+
+		struct client_t *c = &clients[i];
+		memset(c, 0, sizeof(struct client_t));
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		c->fd = fd;
+		c->up = -1;
+		c->backend = -1;
+		c->held_for = -1;
+		log("connected by %s:%d, fd:%d\n", inet_ntoa(client_addr.sin_addr), client_addr.sin_port, fd);
+		return;
+	}
+
+	loge("too many clients, reject fd:%d\n", fd);
+	close(fd);
+}
+
+int gateway_start() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		eprintf("Create Socket Failed!\n");
+	}
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		eprintf("Can not bind to port %d!\n", PORT);
+	}
+
+	if(listen(fd, MAX_CLIENTS) == -1) {
+		eprintf("fail to listen on socket.\n");
+	}
+	return fd;
+}
+
+void run_gateway() {
+	static struct pollfd fds[1 + MAX_CLIENTS * 2];
+	static struct client_t *owners[1 + MAX_CLIENTS * 2];
+
+	while(!terminating) {
+		reap_backends();
+
+		int nr_fds = 0;
+		fds[nr_fds ++] = (struct pollfd){listen_fd, POLLIN, 0};
+		for(int i = 0; i < MAX_CLIENTS; i++) {
+			struct client_t *c = &clients[i];
+			if(c->fd < 0) continue;
+
+			if(c->held_for >= 0)
+				release_held(c);
+			if(c->up < 0 && c->reconnect_at && now_ms() >= c->reconnect_at)
+				attach_backend(c, c->backend);
+
+			/* a held message blocks the client until it is forwarded, and
+			 * so does a backend queue without room for another message */
+			int can_read = c->held_for < 0
+				&& c->up_tx_len + sizeof(client_message_t) <= UPSTREAM_BACKLOG;
+			short events = (can_read ? POLLIN : 0) | (c->tx_len ? POLLOUT : 0);
+			if(events) {
+				owners[nr_fds] = c;
+				fds[nr_fds ++] = (struct pollfd){c->fd, events, 0};
+			}
+			if(c->up >= 0) {
+				owners[nr_fds] = c;
+				fds[nr_fds ++] = (struct pollfd){c->up, POLLIN | (c->up_tx_len ? POLLOUT : 0), 0};
+			}
+		}
+
+		if(poll(fds, nr_fds, POLL_MS) < 0) {
+			if(errno != EINTR)
+				loge("fail to poll\n");
+			continue;
+		}
+
+		if(fds[0].revents & POLLIN)
+			accept_client();
+
+		for(int i = 1; i < nr_fds; i++) {
+			struct client_t *c = owners[i];
+			if((fds[i].revents & POLLOUT) && fds[i].fd == c->fd)
+				client_writable(c);
+			else if((fds[i].revents & POLLOUT) && fds[i].fd == c->up)
+				backend_writable(c);
+			if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			// either side may have been closed by a previous event
+			if(fds[i].fd == c->fd)
+				client_readable(c);
+			else if(fds[i].fd == c->up)
+				backend_readable(c);
+		}
+	}
+}
+
+void on_terminate(int signo) {
+	terminating = true;
+}
+
+void stop_backends() {
+	for(int b = 0; b < nr_backends; b++) {
+		if(backends[b].pid > 0) {
+			kill(backends[b].pid, SIGTERM);
+			waitpid(backends[b].pid, NULL, 0);
+		}
+		unlink(backends[b].path);
+	}
+}
+
+void parse_args(int argc, char *argv[]) {
+	for(int i = 1; i < argc; i++) {
+		unsigned n;
+		if(strcmp(argv[i], "-n") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &n) == 1
+		&& 0 < n && n <= MAX_BACKENDS) {
+			nr_backends = n;
+			i ++;
+		}else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			server_bin = argv[i + 1];
+			i ++;
+		}else if(strcmp(argv[i], "--") == 0) {
+			server_args = argv + i + 1;
+			nr_server_args = argc - i - 1;
+			break;
+		}else{
+			eprintf("usage: %s [-n <backends>] [-s <server binary>] [-- <server options>]\n"
+					"  -n  backend servers, at most %d\n"
+					"  -s  server binary, ./server by default\n",
+					argv[0], MAX_BACKENDS);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	log_init();
+	parse_args(argc, argv);
+
+	signal(SIGINT, on_terminate);
+	signal(SIGTERM, on_terminate);
+
+	for(int i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+	if(getrandom(secret, sizeof(secret), 0) != sizeof(secret))
+		eprintf("fail to generate secret of password digests\n");
+
+	for(int b = 0; b < nr_backends; b++) {
+		snprintf(backends[b].path, sizeof(backends[b].path), BACKEND_PATH, getpid(), b);
+		spawn_backend(b);
+	}
+	build_ring();
+
+	listen_fd = gateway_start();
+	log("gateway on port %d, %d backends\n", PORT, nr_backends);
+
+	run_gateway();
+
+	log("terminate gateway\n");
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		if(clients[i].fd >= 0)
+			close_client(&clients[i]);
+	}
+	close(listen_fd);
+	stop_backends();
+	log_shutdown();
+	return 0;
+}
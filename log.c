@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define LOG_RING_SIZE   (64 * 1024)          // must be power of 2
+#define LOG_RING_MASK   (LOG_RING_SIZE - 1)
+#define LOG_BATCH_SIZE  (64 * 1024)
+#define LOG_LINE_SIZE   512
+#define LOG_IDLE_USEC   2000
+
+#define LOG_RECORD_PAD  0xff
+
+/* binary record in ring, followed by `nargs` log_arg_t and then
+ * the copied strings, the `i` field of a string argument holds the
+ * offset of the string from the beginning of the record */
+typedef struct log_record_t {
+	uint32_t size;      // aligned to 8 bytes, including strings
+	uint8_t level;      // LOG_RECORD_PAD for padding records
+	uint8_t nargs;
+	uint16_t line;
+	struct timespec ts;
+	const char *func;
+	const char *fmt;
+} log_record_t;
+
+typedef struct log_ring_t {
+	_Atomic size_t head;                     // written by producer
+	char pad0[64 - sizeof(size_t)];
+	_Atomic size_t tail;                     // written by consumer
+	char pad1[64 - sizeof(size_t)];
+	_Atomic unsigned long dropped;
+	unsigned long reported;
+	_Atomic int orphaned;                    // owner thread exited
+	unsigned long tid;
+	struct log_ring_t *next;
+	char buf[LOG_RING_SIZE];
+} log_ring_t;
+
+int log_level = LOG_LEVEL_DEBUG;
+
+static _Atomic(log_ring_t *) rings = NULL;
+static _Thread_local log_ring_t *local_ring = NULL;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_t log_thread;
+static _Atomic int log_running = false;
+static _Atomic int log_stopping = false;
+
+static const char *level_tag[] = {
+	[LOG_LEVEL_DEBUG] = "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_BLUE "m[LOG] \033[0m",
+	[LOG_LEVEL_INFO]  = "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_BLUE "m[LOG] \033[0m",
+	[LOG_LEVEL_ERROR] = "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_RED "m[ERROR] \033[0m",
+};
+
+void log_set_level(int level) {
+	if(level < LOG_LEVEL_DEBUG) level = LOG_LEVEL_DEBUG;
+	if(level > LOG_LEVEL_NONE) level = LOG_LEVEL_NONE;
+	log_level = level;
+}
+
+static void ring_orphan(void *ring) {
+	atomic_store_explicit(&((log_ring_t *)ring)->orphaned, true, memory_order_release);
+}
+
+static void ring_key_create() {
+	pthread_key_create(&ring_key, ring_orphan);
+}
+
+static log_ring_t *get_local_ring() {
+	if(local_ring) return local_ring;
+
+	log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+	if(!ring) return NULL;
+
+	ring->tid = (unsigned long)pthread_self();
+	pthread_once(&ring_key_once, ring_key_create);
+	pthread_setspecific(ring_key, ring);
+
+	ring->next = atomic_load(&rings);
+	while(!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+
+	local_ring = ring;
+	return ring;
+}
+
+/* format one conversion of printf-style format, `spec` points to
+ * '%' and `end` to the conversion character */
+static int format_arg(char *out, size_t cap, const char *spec, const char *end, const log_arg_t *arg) {
+	char conv[32];
+	size_t len = end - spec + 1;
+	if(len >= sizeof(conv)) return 0;
+	memcpy(conv, spec, len);
+	conv[len] = 0;
+
+	// length modifiers decide how the stored integer is narrowed
+	int nh = 0, nl = 0, wide = 0;
+	for(const char *p = spec + 1; p < end; p++) {
+		switch(*p) {
+			case 'h': nh ++; break;
+			case 'l': nl ++; break;
+			case 'z': case 'j': case 't': wide = 1; break;
+		}
+	}
+
+	switch(*end) {
+		case 'd': case 'i':
+			if(wide || nl >= 2) return snprintf(out, cap, conv, (long long)arg->i);
+			if(nl == 1) return snprintf(out, cap, conv, (long)arg->i);
+			if(nh == 2) return snprintf(out, cap, conv, (signed char)arg->i);
+			if(nh == 1) return snprintf(out, cap, conv, (short)arg->i);
+			return snprintf(out, cap, conv, (int)arg->i);
+		case 'u': case 'x': case 'X': case 'o':
+			if(wide || nl >= 2) return snprintf(out, cap, conv, (unsigned long long)arg->i);
+			if(nl == 1) return snprintf(out, cap, conv, (unsigned long)arg->i);
+			if(nh == 2) return snprintf(out, cap, conv, (unsigned char)arg->i);
+			if(nh == 1) return snprintf(out, cap, conv, (unsigned short)arg->i);
+			return snprintf(out, cap, conv, (unsigned int)arg->i);
+		case 'c':
+			return snprintf(out, cap, conv, (int)arg->i);
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+			return snprintf(out, cap, conv,
+					arg->tag == LOG_ARG_DOUBLE ? arg->d : (double)arg->i);
+		case 's':
+			return snprintf(out, cap, conv,
+					arg->tag == LOG_ARG_STR && arg->s ? arg->s : "(null)");
+		case 'p':
+			return snprintf(out, cap, conv, arg->p);
+	}
+	return 0;
+}
+
+static size_t format_record(char *out, size_t cap, int level, const char *func, int line,
+		const struct timespec *ts, const char *fmt, const log_arg_t *args, int nargs) {
+	size_t len = 0;
+	int argi = 0;
+
+	if(level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_ERROR)
+		level = LOG_LEVEL_ERROR;
+
+	struct tm tm;
+	localtime_r(&ts->tv_sec, &tm);
+	len += snprintf(out + len, cap - len, "%s%02d:%02d:%02d.%03ld %s:%d: %s",
+			level_tag[level], tm.tm_hour, tm.tm_min, tm.tm_sec,
+			ts->tv_nsec / 1000000, func, line,
+			level == LOG_LEVEL_DEBUG ? "==> " : "");
+	if(len >= cap) len = cap - 1;
+
+	for(const char *p = fmt; *p && len < cap - 1; p++) {
+		if(*p != '%') {
+			out[len ++] = *p;
+			continue;
+		}
+
+		if(p[1] == '%') {
+			out[len ++] = '%';
+			p ++;
+			continue;
+		}
+
+		const char *end = p + 1;
+		while(*end && strchr("-+ #0123456789.hlzjt", *end))
+			end ++;
+		if(!*end) break;
+
+		if(argi < nargs) {
+			int n = format_arg(out + len, cap - len, p, end, &args[argi ++]);
+			if(n > 0) len += n;
+			if(len >= cap) len = cap - 1;
+		}
+		p = end;
+	}
+
+	out[len] = 0;
+	return len;
+}
+
+static void emit_sync(int level, const char *func, int line, const char *fmt, const log_arg_t *args, int nargs) {
+	char text[LOG_LINE_SIZE];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	size_t len = format_record(text, sizeof(text), level, func, line, &ts, fmt, args, nargs);
+	fwrite(text, 1, len, stderr);
+}
+
+void log_emit(int level, const char *func, int line, const char *fmt, const log_arg_t *args, int nargs) {
+	log_ring_t *ring = NULL;
+
+	if(nargs > LOG_MAX_ARGS) nargs = LOG_MAX_ARGS;
+
+	if(!atomic_load_explicit(&log_running, memory_order_acquire)
+	|| !(ring = get_local_ring())) {
+		emit_sync(level, func, line, fmt, args, nargs);
+		return;
+	}
+
+	size_t slen[LOG_MAX_ARGS];
+	size_t size = sizeof(log_record_t) + nargs * sizeof(log_arg_t);
+	for(int i = 0; i < nargs; i++) {
+		if(args[i].tag == LOG_ARG_STR && args[i].s) {
+			slen[i] = strnlen(args[i].s, LOG_MAX_STR - 1);
+			size += slen[i] + 1;
+		}
+	}
+	size = (size + 7) & ~(size_t)7;
+
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t off = head & LOG_RING_MASK;
+	size_t contig = LOG_RING_SIZE - off;
+	size_t need = size + (contig < size ? contig : 0);
+
+	if(LOG_RING_SIZE - (head - tail) < need) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	if(contig < size) {
+		log_record_t *pad = (log_record_t *)(ring->buf + off);
+		pad->size = contig;
+		pad->level = LOG_RECORD_PAD;
+		head += contig;
+		off = 0;
+	}
+
+	log_record_t *rec = (log_record_t *)(ring->buf + off);
+	rec->size = size;
+	rec->level = level;
+	rec->nargs = nargs;
+	rec->line = line;
+	rec->func = func;
+	rec->fmt = fmt;
+	clock_gettime(CLOCK_REALTIME_COARSE, &rec->ts);
+
+	log_arg_t *rargs = (log_arg_t *)(rec + 1);
+	char *str = (char *)(rargs + nargs);
+	for(int i = 0; i < nargs; i++) {
+		rargs[i] = args[i];
+		if(args[i].tag == LOG_ARG_STR && args[i].s) {
+			memcpy(str, args[i].s, slen[i]);
+			str[slen[i]] = 0;
+			rargs[i].i = str - (char *)rec;
+			str += slen[i] + 1;
+		}
+	}
+
+	atomic_store_explicit(&ring->head, head + size, memory_order_release);
+}
+
+/* format all pending records of ring into batch, return number of
+ * records consumed */
+static int drain_ring(log_ring_t *ring, char *batch, size_t *pbatch_len) {
+	int count = 0;
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	while(tail != head) {
+		log_record_t *rec = (log_record_t *)(ring->buf + (tail & LOG_RING_MASK));
+		if(rec->level != LOG_RECORD_PAD) {
+			if(*pbatch_len + LOG_LINE_SIZE > LOG_BATCH_SIZE) {
+				fwrite(batch, 1, *pbatch_len, stderr);
+				*pbatch_len = 0;
+			}
+
+			log_arg_t args[LOG_MAX_ARGS];
+			memcpy(args, rec + 1, rec->nargs * sizeof(log_arg_t));
+			for(int i = 0; i < rec->nargs; i++) {
+				if(args[i].tag == LOG_ARG_STR && args[i].p)
+					args[i].s = (char *)rec + ((log_arg_t *)(rec + 1))[i].i;
+			}
+
+			*pbatch_len += format_record(batch + *pbatch_len, LOG_LINE_SIZE,
+					rec->level, rec->func, rec->line, &rec->ts,
+					rec->fmt, args, rec->nargs);
+			count ++;
+		}
+		tail += rec->size;
+	}
+
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+	unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	if(dropped != ring->reported) {
+		if(*pbatch_len + LOG_LINE_SIZE > LOG_BATCH_SIZE) {
+			fwrite(batch, 1, *pbatch_len, stderr);
+			*pbatch_len = 0;
+		}
+		*pbatch_len += snprintf(batch + *pbatch_len, LOG_LINE_SIZE,
+				"%s%s: dropped %lu records of thread #%lu\n",
+				level_tag[LOG_LEVEL_ERROR], __func__,
+				dropped - ring->reported, ring->tid);
+		ring->reported = dropped;
+	}
+
+	return count;
+}
+
+static int drain_all_rings(char *batch) {
+	int count = 0;
+	size_t batch_len = 0;
+	log_ring_t *prev = NULL;
+	log_ring_t *ring = atomic_load(&rings);
+
+	while(ring) {
+		int orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+		count += drain_ring(ring, batch, &batch_len);
+
+		log_ring_t *next = ring->next;
+		// free rings of exited threads, new rings are only pushed at
+		// the head so that unlinking a non-head ring is safe
+		if(orphaned && prev) {
+			prev->next = next;
+			free(ring);
+		}else{
+			prev = ring;
+		}
+		ring = next;
+	}
+
+	if(batch_len > 0) {
+		fwrite(batch, 1, batch_len, stderr);
+		fflush(stderr);
+	}
+
+	return count;
+}
+
+static void *log_consumer(void *args) {
+	static char batch[LOG_BATCH_SIZE];
+	struct timespec idle = { 0, LOG_IDLE_USEC * 1000 };
+	while(!atomic_load(&log_stopping)) {
+		if(drain_all_rings(batch) == 0)
+			nanosleep(&idle, NULL);
+	}
+	drain_all_rings(batch);
+	return NULL;
+}
+
+int log_parse_level(const char *s, int def) {
+	if(!s) return def;
+	if(strcasecmp(s, "debug") == 0) return LOG_LEVEL_DEBUG;
+	if(strcasecmp(s, "info") == 0) return LOG_LEVEL_INFO;
+	if(strcasecmp(s, "error") == 0) return LOG_LEVEL_ERROR;
+	if(strcasecmp(s, "none") == 0) return LOG_LEVEL_NONE;
+	return def;
+}
+
+void log_init() {
+	log_set_level(log_parse_level(getenv("LOG_LEVEL"), log_level));
+
+	if(atomic_load(&log_running)) return;
+
+	atomic_store(&log_stopping, false);
+	if(pthread_create(&log_thread, NULL, log_consumer, NULL) != 0) {
+		fprintf(stderr, "fail to start log thread, fall back to synchronous log\n");
+		return;
+	}
+	atomic_store_explicit(&log_running, true, memory_order_release);
+}
+
+void log_shutdown() {
+	if(!atomic_exchange(&log_running, false))
+		return;
+
+	atomic_store(&log_stopping, true);
+	if(!pthread_equal(pthread_self(), log_thread))
+		pthread_join(log_thread, NULL);
+}
@@ -0,0 +1,134 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* asynchronous logging backend
+ *
+ *   log/logi/loge don't format anything on the calling thread, they
+ *   only copy the format pointer and the raw arguments into a binary
+ *   record, which is pushed into a lock-free ring buffer owned by the
+ *   calling thread. A background thread started by `log_init` drains
+ *   all rings, formats the records and writes them to stderr in
+ *   batches.
+ *
+ *   when the ring of a thread is full, the record is dropped and
+ *   counted, the background thread reports the number of dropped
+ *   records later.
+ *
+ *   when the backend isn't started (e.g. in client) or has been shut
+ *   down, records are formatted and written synchronously.
+ *
+ * level filter:
+ *   compile time: -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO strips all calls
+ *                 below the given level
+ *   runtime:      log_set_level(LOG_LEVEL_ERROR), or environment
+ *                 variable LOG_LEVEL=debug|info|error|none
+ */
+
+#define LOG_LEVEL_DEBUG 0  // logi
+#define LOG_LEVEL_INFO  1  // log
+#define LOG_LEVEL_ERROR 2  // loge
+#define LOG_LEVEL_NONE  3
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_MAX_ARGS 8
+#define LOG_MAX_STR  64
+
+enum {
+	LOG_ARG_INT,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_PTR,
+	LOG_ARG_STR,
+};
+
+typedef struct log_arg_t {
+	uint8_t tag;
+	union {
+		long long i;
+		double d;
+		const void *p;
+		const char *s;
+	};
+} log_arg_t;
+
+extern int log_level;
+
+static inline log_arg_t log_arg_int(long long v) {
+	return (log_arg_t){ .tag = LOG_ARG_INT, .i = v };
+}
+
+static inline log_arg_t log_arg_double(double v) {
+	return (log_arg_t){ .tag = LOG_ARG_DOUBLE, .d = v };
+}
+
+static inline log_arg_t log_arg_ptr(const void *v) {
+	return (log_arg_t){ .tag = LOG_ARG_PTR, .p = v };
+}
+
+static inline log_arg_t log_arg_str(const char *v) {
+	return (log_arg_t){ .tag = LOG_ARG_STR, .s = v };
+}
+
+static inline void log_check_format(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+static inline void log_check_format(const char *fmt, ...) {}
+
+#define LOG_ARG(x) _Generic((x), \
+		char *: log_arg_str, \
+		const char *: log_arg_str, \
+		float: log_arg_double, \
+		double: log_arg_double, \
+		void *: log_arg_ptr, \
+		const void *: log_arg_ptr, \
+		default: log_arg_int)(x)
+
+/* the format is counted as the first argument so that __VA_ARGS__
+ * is never empty */
+#define LOG_NARGS(...) LOG_NARGS_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_f, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+
+#define LOG_FMT(fmt, ...) fmt
+
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a ## b
+
+#define LOG_ARGS_0(f)
+#define LOG_ARGS_1(f, a) , LOG_ARG(a)
+#define LOG_ARGS_2(f, a, ...) , LOG_ARG(a) LOG_ARGS_1(f, __VA_ARGS__)
+#define LOG_ARGS_3(f, a, ...) , LOG_ARG(a) LOG_ARGS_2(f, __VA_ARGS__)
+#define LOG_ARGS_4(f, a, ...) , LOG_ARG(a) LOG_ARGS_3(f, __VA_ARGS__)
+#define LOG_ARGS_5(f, a, ...) , LOG_ARG(a) LOG_ARGS_4(f, __VA_ARGS__)
+#define LOG_ARGS_6(f, a, ...) , LOG_ARG(a) LOG_ARGS_5(f, __VA_ARGS__)
+#define LOG_ARGS_7(f, a, ...) , LOG_ARG(a) LOG_ARGS_6(f, __VA_ARGS__)
+#define LOG_ARGS_8(f, a, ...) , LOG_ARG(a) LOG_ARGS_7(f, __VA_ARGS__)
+#define LOG_ARGS(...) LOG_CAT(LOG_ARGS_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+
+/* log_at(level, fmt, args...) */
+#define log_at(level, ...) do { \
+	if(0) log_check_format(__VA_ARGS__); \
+	if((level) >= LOG_COMPILE_LEVEL && (level) >= log_level) { \
+		log_arg_t _log_args[] = { {0} LOG_ARGS(__VA_ARGS__) }; \
+		log_emit(level, __func__, __LINE__, LOG_FMT(__VA_ARGS__, 0), \
+				_log_args + 1, LOG_NARGS(__VA_ARGS__)); \
+	} \
+} while(0)
+
+void log_emit(int level, const char *func, int line, const char *fmt, const log_arg_t *args, int nargs);
+
+void log_set_level(int level);
+
+/* "debug", "info", "error" or "none", `def` if unknown */
+int log_parse_level(const char *s, int def);
+
+/* start the background thread, read LOG_LEVEL from environment */
+void log_init();
+
+/* drain all rings and stop the background thread */
+void log_shutdown();
+
+#endif
@@ -0,0 +1,50 @@
+#include "rng.h"
+
+static uint64_t splitmix64(uint64_t *x) {
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+void rng_seed(rng_t *rng, uint64_t seed) {
+	// never all zero, splitmix64 is a bijection of a counter
+	for(int i = 0; i < 4; i++)
+		rng->s[i] = splitmix64(&seed);
+}
+
+uint64_t rng_split(rng_t *parent, rng_t *child) {
+	uint64_t seed = rng_next(parent);
+	rng_seed(child, seed);
+	return seed;
+}
+
+uint64_t rng_next(rng_t *rng) {
+	uint64_t *s = rng->s;
+	uint64_t result = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+/* Lemire's multiply and shift, the few low products that would
+ * favour some results are rejected */
+uint32_t rng_below(rng_t *rng, uint32_t n) {
+	uint64_t m = (rng_next(rng) >> 32) * n;
+	if((uint32_t)m < n) {
+		uint32_t threshold = -n % n;
+		while((uint32_t)m < threshold)
+			m = (rng_next(rng) >> 32) * n;
+	}
+	return m >> 32;
+}
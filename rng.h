@@ -0,0 +1,28 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* pseudo random numbers
+ *
+ *   xoshiro256** with state of its own per battle, so battles ticked by
+ *   different threads never share a lock or a stream, and a battle
+ *   seeded the same way rolls the same numbers again. Seeds are spread
+ *   into the state by splitmix64, any 64 bits make a good seed.
+ */
+typedef struct rng_t {
+	uint64_t s[4];
+} rng_t;
+
+void rng_seed(rng_t *rng, uint64_t seed);
+
+/* seed `child` with the next number of `parent` and return that seed,
+ * the child stream can be recreated from it by rng_seed() */
+uint64_t rng_split(rng_t *parent, rng_t *child);
+
+uint64_t rng_next(rng_t *rng);
+
+/* uniform in [0, n) without modulo bias, n > 0 */
+uint32_t rng_below(rng_t *rng, uint32_t n);
+
+#endif
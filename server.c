@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -6,32 +7,166 @@
 #include <string.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/random.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <crypt.h>
 
 #include "common.h"
+#include "codec.h"
+#include "zerocopy.h"
+#include "shmring.h"
+#include "feed.h"
+#include "timerwheel.h"
+#include "rng.h"
 
 #define REGISTERED_USER_LIST_SIZE 10
+#define PASSWORD_HASH_SIZE 128
 
 pthread_mutex_t userlist_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t battles_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t items_lock[USER_CNT];
 
+/* held for reading by every thread while it changes state or sends,
+ * for writing by a hot upgrade, see hot_upgrade(). A waiting writer
+ * goes first, so no thread takes it for reading twice */
+pthread_rwlock_t state_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static atomic_int upgrading = false;
+
 int server_fd = 0;
+int unix_server_fd = -1;
+
+// listening TCP port, 0 disables TCP, see `-p` option
+static int server_port = PORT;
+// Unix socket path, see `-u` option
+static const char *unix_path = NULL;
 
-int usleep(int usec);
+// size of newly launched battles, see `-m` option
+static uint16_t map_w = BATTLE_W;
+static uint16_t map_h = BATTLE_H;
 
+
+void park_for_upgrade(size_t total_len);
+void checkpoint_battle(int bid);
+void checkpoint_clear(int bid);
 void wrap_recv(int conn, client_message_t *pcm);
 void wrap_send(int conn, server_message_t *psm);
+void send_frame(int conn, const void *payload, size_t len);
+void send_iov(int conn, struct iovec *iov, int iovcnt);
+int try_send_iov(int conn, struct iovec *iov, int iovcnt, size_t len);
+int client_command_quit(int uid);
+
+/* shared snapshot payload
+ *
+ *   the part of a battle snapshot that is the same for all users is
+ *   encoded once per tick into a reference counted buffer, every user
+ *   gets it behind a small header of its own by one sendmsg(). Headers
+ *   live in the payload too, so with zero-copy enabled nothing sent
+ *   changes until the kernel completes the send. A payload goes back
+ *   to the pool when the last reference is put.
+ */
+#define PAYLOAD_POOL_SIZE 64
+
+typedef struct payload_t {
+	atomic_int refs;
+	size_t len;
+	uint8_t headers[USER_CNT][FRAME_HEADER_SIZE + SNAPSHOT_HEADER_SIZE];
+	uint8_t data[SNAPSHOT_MAX_BYTES];
+} payload_t;
+
+static payload_t *payload_pool[PAYLOAD_POOL_SIZE];
+static int nr_pooled_payloads = 0;
+static pthread_mutex_t payload_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+payload_t *payload_alloc() {
+	payload_t *payload = NULL;
+
+	pthread_mutex_lock(&payload_pool_lock);
+	if(nr_pooled_payloads > 0)
+		payload = payload_pool[-- nr_pooled_payloads];
+	pthread_mutex_unlock(&payload_pool_lock);
+
+	if(!payload) payload = malloc(sizeof(payload_t));
+	if(!payload) eprintf("fail to alloc snapshot payload\n");
+	atomic_init(&payload->refs, 1);
+	payload->len = 0;
+	return payload;
+}
+
+void payload_get(void *buf) {
+	payload_t *payload = buf;
+	atomic_fetch_add(&payload->refs, 1);
+}
+
+void payload_put(void *buf) {
+	payload_t *payload = buf;
+	if(atomic_fetch_sub(&payload->refs, 1) != 1)
+		return;
+
+	pthread_mutex_lock(&payload_pool_lock);
+	if(nr_pooled_payloads < PAYLOAD_POOL_SIZE) {
+		payload_pool[nr_pooled_payloads ++] = payload;
+		payload = NULL;
+	}
+	pthread_mutex_unlock(&payload_pool_lock);
+	free(payload);
+}
+
+/* battle frames of at least this size are sent by zero-copy,
+ * -1 disables it, see `-z` option */
+static int zerocopy_min_bytes = -1;
+
+// frames of all battles for spectators, see `-s` option
+static feed_t *feed = NULL;
 
 void send_to_client(int uid, int message);
 void send_to_client_with_username(int uid, int message, char *user_name);
 void close_session(int conn, int message);
 
+void send_terrain(int bid, int uid);
+
+void battle_events_init(int bid);
+int battle_schedule(int bid, int kind, pos_t pos, int ticks);
+void battle_cancel(int bid, int event);
+void schedule_cell_event(int bid, int kind, pos_t pos, int ticks);
+
+// chat channels, see chat_publish()
+#define CHAT_CHANNEL_GLOBAL 0
+#define CHAT_CHANNEL_OF_BATTLE(bid) (1 + (bid))
+#define CHAT_CHANNEL_DIRECT -1
+
+void chat_replay(int channel, int uid);
+void chat_reset(int channel);
+void chat_clear_history(int channel);
+
+void user_index_add(int uid);
+void user_index_del(int uid);
+
+int session_expire(int uid, int64_t before);
+void new_resume_token(int uid);
+void send_session_token(int uid, int message);
+
+void session_watch(int uid, int64_t deadline_us);
+void session_unwatch(int uid);
+void send_failed(int conn);
+void set_sock_timeout(int conn, int optname, int ms);
+
 static int user_list_size = 0;
 
 struct {
 	char user_name[USERNAME_SIZE];
-	char password[PASSWORD_SIZE];
+	char password[PASSWORD_SIZE];   // empty if recovered, see checkpoint_recover()
+	char hash[PASSWORD_HASH_SIZE];  // salted, of `password`, see hash_password()
+	int skill;           // bullets hit other users, for matchmaking
 } registered_user_list[REGISTERED_USER_LIST_SIZE];
 
 struct session_t {
@@ -41,11 +176,122 @@ struct session_t {
 	uint32_t bid;
 	uint32_t inviter_id;
 	client_message_t cm;
+	zc_socket_t zc;      // used by battle ruler, under zc_lock
+	int64_t chat_tat;    // rate limit of chat, see CHAT_BURST
+	int rid;             // registered index, set on login
+	uint8_t resume_token[RESUME_TOKEN_SIZE];
+	int64_t detached_at; // connection dropped, 0 while connected, see resume_session()
+	int64_t connected_at;
+	int64_t heard_at;    // last message from the client, 0 if none yet
+	uint32_t presence_epoch;  // bumped on login and change of friends, see presence
+	pthread_t thread;
+	atomic_int stopped;  // SESSION_*, by its thread for an upgrade
+	uint32_t cm_len;     // bytes of `cm` read when parked
 } sessions[USER_CNT];
 
+enum {
+	SESSION_RUNNING,
+	SESSION_PARKED,      // waits with `cm_len` bytes of a message read
+	SESSION_HOLDS_MESSAGE,   // waits with a whole message in `cm`
+};
+
+pthread_mutex_t zc_lock[USER_CNT];
+
+/* shared memory channels of local clients, by fd of their Unix
+ * socket. Senders of frames hold `lock` of the channel, it is torn
+ * down by the session thread which is the only reader */
+#define MAX_CHANNEL_FD 1024
+
+struct local_channel_t {
+	shm_endpoint_t ep;
+	pthread_mutex_t lock;
+} *local_channels[MAX_CHANNEL_FD];
+
+pthread_mutex_t local_channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* frames go to a socket whole, one sender at a time, under the lock of
+ * its fd, fds past MAX_CHANNEL_FD share one. Channels have their own */
+pthread_mutex_t send_locks[MAX_CHANNEL_FD];
+#define SEND_LOCK(conn) (&send_locks[(conn) % MAX_CHANNEL_FD])
+
+// fds passed along the last message read by this session thread
+static _Thread_local int passed_fds[SHM_NR_FDS];
+static _Thread_local int nr_passed_fds = 0;
+
+// the connection of this session thread was lost, not quit
+static _Thread_local int conn_dropped = false;
+
+// session served by this thread, -1 before it has one
+static _Thread_local int my_uid = -1;
+
+/* battlefield chunks
+ *
+ *   a map is divided into CHUNK_SIZE x CHUNK_SIZE chunks and only the
+ *   chunks with items on them are allocated, they are found by a small
+ *   hash table. Each chunk links the items lying on it, so looking up
+ *   what a user steps on only scans the chunk under the user.
+ */
+#define CHUNK_SHIFT 4
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_HASH_SIZE 64
+
+#define CHUNK_CELL(pos) ((((pos).y & (CHUNK_SIZE - 1)) << CHUNK_SHIFT) | ((pos).x & (CHUNK_SIZE - 1)))
+
+struct chunk_t {
+	uint16_t cx, cy;
+	int nr_items;
+	int head;              // first item on this chunk
+	int nr_terrain;
+	uint8_t terrain[CHUNK_SIZE * CHUNK_SIZE];     // static layer
+	uint8_t magma_times[CHUNK_SIZE * CHUNK_SIZE];
+	uint8_t events[CHUNK_SIZE * CHUNK_SIZE];      // pending event of the cell + 1, 0 if none
+	struct chunk_t *next;  // next chunk in the same hash slot
+};
+
+/* battle events
+ *
+ *   anything due some ticks later in a battle, an item spawn or magma
+ *   cooling down, is an event on the timer wheel of the battle, which
+ *   is advanced once per tick. Pending events cost nothing until they
+ *   fire, however many there are. The handler of an event's kind
+ *   returns the ticks until it fires again, or 0 when it is done.
+ *
+ *   a new timed mechanic adds a kind to the enum and its handler to
+ *   battle_event_handler[], and schedules it with battle_schedule().
+ *   Free events are kept on a list, an event bound to a cell is found
+ *   through the chunk of the cell, see schedule_cell_event().
+ */
+#define MAX_BATTLE_EVENTS (MAX_TERRAIN + 16)
+#define ITEM_SPAWN_TICKS 200     // on average
+#define MAGMA_COOL_TICKS 1200
+
+enum {
+	EVENT_SPAWN_ITEM,
+	EVENT_MAGMA_COOLS,
+};
+
+struct battle_event_t {
+	tw_timer_t timer;
+	int is_used;
+	int next_free;       // on the free list of the battle, -1 at its end
+	int bid;
+	int kind;
+	pos_t pos;
+};
+
+/* terrain messages are built under items_lock into a batch and sent
+ * once the lock is dropped, see send_terrain_batch() */
+typedef struct terrain_batch_t {
+	int nr, cap;
+	server_message_t *msgs;
+} terrain_batch_t;
+
 struct battle_t {
 	int is_alloced;
+	int worker;          // simulation worker ticking this battle
+	int feed_ticks;      // ticks published to the feed
 	size_t nr_users;
+	uint16_t w, h;
 	struct {
 		int battle_state;
 		int nr_bullets;
@@ -56,18 +302,34 @@ struct battle_t {
 	} users[USER_CNT];
 
 	int num_of_other; // number of other alloced item except for bullet
+	int nr_terrain;
+
+	// terrain changed in this tick, sent after the tick
+	int nr_terrain_changes;
+	struct {
+		uint8_t kind;
+		pos_t pos;
+	} terrain_changes[MAX_TERRAIN_CELLS];
+	terrain_batch_t terrain_out;  // changes packed so far in this tick
 
 	struct {
 		int is_used;
 		int dir;
-		union {
-			int owner;
-			int times;
-		};
+		int owner;
 		int kind;
 		pos_t pos;
+		int chunk_prev, chunk_next;
 	} items[MAX_ITEM];
 
+	int nr_chunks;
+	struct chunk_t *chunks[CHUNK_HASH_SIZE];
+
+	uint64_t seed;       // of `rng`, logged to replay the battle
+	rng_t rng;           // under items_lock
+	uint64_t ticks;
+	timer_wheel_t events;
+	struct battle_event_t event_pool[MAX_BATTLE_EVENTS];
+	int free_events;     // first free in `event_pool`, -1 if none
 } battles[USER_CNT];
 
 int query_session_built(uint32_t uid) {
@@ -84,7 +346,7 @@ int query_session_built(uint32_t uid) {
 void user_quit_battle(uint32_t bid, uint32_t uid) {
 	assert(bid < USER_CNT && uid < USER_CNT);
 
-	log("user %s quit from battle %d(%d users)\n", sessions[uid].user_name, bid, battles[bid].nr_users);
+	log("user %s quit from battle %d(%zu users)\n", sessions[uid].user_name, bid, battles[bid].nr_users);
 	battles[bid].nr_users --;
 	battles[bid].users[uid].battle_state = BATTLE_STATE_UNJOINED;
 	sessions[uid].state = USER_STATE_LOGIN;
@@ -110,7 +372,7 @@ void user_quit_battle(uint32_t bid, uint32_t uid) {
 void user_join_battle_common_part(uint32_t bid, uint32_t uid, uint32_t joined_state) {
 	assert(bid < USER_CNT && uid < USER_CNT);
 
-	log("user %s join in battle %d(%d users)\n", sessions[uid].user_name, bid, battles[bid].nr_users);
+	log("user %s join in battle %d(%zu users)\n", sessions[uid].user_name, bid, battles[bid].nr_users);
 
 	if(joined_state == USER_STATE_BATTLE) {
 		battles[bid].nr_users ++;
@@ -126,14 +388,19 @@ void user_join_battle_common_part(uint32_t bid, uint32_t uid, uint32_t joined_st
 
 	sessions[uid].state = joined_state;
 	sessions[uid].bid = bid;
+
+	if(joined_state == USER_STATE_BATTLE)
+		chat_replay(CHAT_CHANNEL_OF_BATTLE(bid), uid);
 }
 
 void user_join_battle(uint32_t bid, uint32_t uid) {
-	int ux = (rand() & 0x7FFF) % BATTLE_W;
-	int uy = (rand() & 0x7FFF) % BATTLE_H;
+	pthread_mutex_lock(&items_lock[bid]);
+	int ux = rng_below(&battles[bid].rng, battles[bid].w);
+	int uy = rng_below(&battles[bid].rng, battles[bid].h);
+	pthread_mutex_unlock(&items_lock[bid]);
 	battles[bid].users[uid].pos.x = ux;
 	battles[bid].users[uid].pos.y = uy;
-	log("alloc position (%hhu, %hhu) for launcher #%d@%s\n",
+	log("alloc position (%d, %d) for launcher #%d@%s\n",
 			ux, uy, uid, sessions[uid].user_name);
 
 	sessions[uid].state = USER_STATE_BATTLE;
@@ -141,6 +408,8 @@ void user_join_battle(uint32_t bid, uint32_t uid) {
 	if(battles[bid].users[uid].battle_state == BATTLE_STATE_UNJOINED) {
 		user_join_battle_common_part(bid, uid, USER_STATE_BATTLE);
 	}
+
+	send_terrain(bid, uid);
 }
 
 void user_invited_to_join_battle(uint32_t bid, uint32_t uid) {
@@ -154,6 +423,14 @@ void user_invited_to_join_battle(uint32_t bid, uint32_t uid) {
 	user_join_battle_common_part(bid, uid, USER_STATE_WAIT_TO_BATTLE);
 }
 
+int registered_index(const char *user_name) {
+	for(int i = 0; i < user_list_size; i++) {
+		if(strncmp(user_name, registered_user_list[i].user_name, USERNAME_SIZE - 1) == 0)
+			return i;
+	}
+	return -1;
+}
+
 int find_uid_by_user_name(const char *user_name) {
 	int ret_uid = -1;
 	log("find user '%s'\n", user_name);
@@ -175,13 +452,39 @@ int find_uid_by_user_name(const char *user_name) {
 	return ret_uid;
 }
 
+void free_chunks(int bid) {
+	for(int i = 0; i < CHUNK_HASH_SIZE; i++) {
+		struct chunk_t *chunk = battles[bid].chunks[i];
+		while(chunk) {
+			struct chunk_t *next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+		battles[bid].chunks[i] = NULL;
+	}
+	battles[bid].nr_chunks = 0;
+}
+
+/* every battle rolls its own numbers, seeded from this stream under
+ * battles_lock, see `-r` option */
+static rng_t battle_seeds;
+
 int get_unalloced_battle() {
 	int ret_bid = -1;
 	pthread_mutex_lock(&battles_lock);
 	for(int i = 0; i < USER_CNT; i++) {
 		if(battles[i].is_alloced == false) {
+			pthread_mutex_lock(&items_lock[i]);
+			free_chunks(i);
+			free(battles[i].terrain_out.msgs);
 			memset(&battles[i], 0, sizeof(struct battle_t));
+			battles[i].seed = rng_split(&battle_seeds, &battles[i].rng);
+			log("battle #%d is seeded with %llu\n", i, (unsigned long long)battles[i].seed);
+			battle_events_init(i);
+			pthread_mutex_unlock(&items_lock[i]);
 			battles[i].is_alloced = true;
+			battles[i].w = map_w;
+			battles[i].h = map_h;
 			ret_bid = i;
 			break;
 		}
@@ -191,6 +494,7 @@ int get_unalloced_battle() {
 		loge("check here, returned battle id should not be -1\n");
 	}else{
 		log("alloc unalloced battle id #%d\n", ret_bid);
+		chat_reset(CHAT_CHANNEL_OF_BATTLE(ret_bid));
 	}
 	return ret_bid;
 }
@@ -216,53 +520,368 @@ int get_unused_session() {
 	return ret_uid;
 }
 
-void inform_friends(int uid, int message) {
-	server_message_t sm;
-	char *user_name = sessions[uid].user_name;
-	memset(&sm, 0, sizeof(server_message_t));
-	sm.message = message;
-	for(int i = 0; i < USER_CNT; i++) {
-		if(i == uid || !query_session_built(i))
+/* functions below must be called with items_lock[bid] held */
+struct chunk_t *find_chunk(int bid, pos_t pos, int create) {
+	uint16_t cx = pos.x >> CHUNK_SHIFT;
+	uint16_t cy = pos.y >> CHUNK_SHIFT;
+	struct chunk_t **slot = &battles[bid].chunks[(cx * 31 + cy) % CHUNK_HASH_SIZE];
+
+	for(struct chunk_t *chunk = *slot; chunk; chunk = chunk->next) {
+		if(chunk->cx == cx && chunk->cy == cy)
+			return chunk;
+	}
+
+	if(!create) return NULL;
+
+	struct chunk_t *chunk = malloc(sizeof(struct chunk_t));
+	if(!chunk) eprintf("fail to alloc chunk\n");
+	chunk->cx = cx;
+	chunk->cy = cy;
+	chunk->nr_items = 0;
+	chunk->head = -1;
+	chunk->nr_terrain = 0;
+	memset(chunk->terrain, ITEM_NONE, sizeof(chunk->terrain));
+	memset(chunk->events, 0, sizeof(chunk->events));
+	chunk->next = *slot;
+	*slot = chunk;
+	battles[bid].nr_chunks ++;
+	logi("alloc chunk (%d, %d) for battle #%d\n", cx, cy, bid);
+	return chunk;
+}
+
+void drop_chunk(int bid, struct chunk_t *chunk) {
+	struct chunk_t **slot = &battles[bid].chunks[(chunk->cx * 31 + chunk->cy) % CHUNK_HASH_SIZE];
+	while(*slot != chunk)
+		slot = &(*slot)->next;
+	*slot = chunk->next;
+	battles[bid].nr_chunks --;
+	logi("free chunk (%d, %d) of battle #%d\n", chunk->cx, chunk->cy, bid);
+	free(chunk);
+}
+
+void place_item(int bid, int item_id) {
+	struct chunk_t *chunk = find_chunk(bid, battles[bid].items[item_id].pos, true);
+	battles[bid].items[item_id].chunk_prev = -1;
+	battles[bid].items[item_id].chunk_next = chunk->head;
+	if(chunk->head >= 0)
+		battles[bid].items[chunk->head].chunk_prev = item_id;
+	chunk->head = item_id;
+	chunk->nr_items ++;
+}
+
+void unplace_item(int bid, int item_id) {
+	struct chunk_t *chunk = find_chunk(bid, battles[bid].items[item_id].pos, false);
+	int prev = battles[bid].items[item_id].chunk_prev;
+	int next = battles[bid].items[item_id].chunk_next;
+	assert(chunk);
+
+	if(prev >= 0)
+		battles[bid].items[prev].chunk_next = next;
+	else
+		chunk->head = next;
+	if(next >= 0)
+		battles[bid].items[next].chunk_prev = prev;
+
+	if(-- chunk->nr_items == 0 && chunk->nr_terrain == 0)
+		drop_chunk(bid, chunk);
+}
+
+void free_item(int bid, int item_id) {
+	unplace_item(bid, item_id);
+	battles[bid].items[item_id].is_used = false;
+}
+
+/* first item of `kind` under user, bullets of the user are skipped */
+int find_item_under_user(int bid, int uid, int kind) {
+	pos_t pos = battles[bid].users[uid].pos;
+	struct chunk_t *chunk = find_chunk(bid, pos, false);
+	if(!chunk) return -1;
+
+	for(int i = chunk->head; i >= 0; i = battles[bid].items[i].chunk_next) {
+		if(battles[bid].items[i].kind != kind
+		|| battles[bid].items[i].pos.x != pos.x
+		|| battles[bid].items[i].pos.y != pos.y)
 			continue;
-		strncpy(sm.friend_name, user_name, USERNAME_SIZE - 1);
-		wrap_send(sessions[i].conn, &sm);
+
+		if(kind == ITEM_BULLET && battles[bid].items[i].owner == uid)
+			continue;
+
+		return i;
+	}
+	return -1;
+}
+
+void publish_frame(int bid, int kind, const void *payload, size_t len) {
+	if(!feed) return;
+
+	uint8_t header[FRAME_HEADER_SIZE] = {len & 0xff, len >> 8};
+	struct iovec iov[2] = {
+		{header, FRAME_HEADER_SIZE},
+		{(void *)payload, len},
+	};
+	feed_write(&feed->rings[bid], kind, iov, 2);
+}
+
+server_message_t *terrain_batch_add(terrain_batch_t *batch) {
+	if(batch->nr == batch->cap) {
+		int cap = batch->cap ? batch->cap * 2 : 4;
+		server_message_t *msgs = realloc(batch->msgs, cap * sizeof(server_message_t));
+		if(!msgs) eprintf("fail to alloc terrain messages\n");
+		batch->msgs = msgs;
+		batch->cap = cap;
 	}
+
+	server_message_t *psm = &batch->msgs[batch->nr ++];
+	memset(psm, 0, sizeof(server_message_t));
+	psm->message = SERVER_MESSAGE_TERRAIN;
+	return psm;
 }
 
-int get_unused_item(int bid) {
-	int ret_item_id = -1;
+void terrain_batch_free(terrain_batch_t *batch) {
+	free(batch->msgs);
+	memset(batch, 0, sizeof(terrain_batch_t));
+}
+
+/* pack terrain changed so far into a message to all users in battle,
+ * which is published to the feed right away */
+void pack_terrain_changes(int bid) {
+	int nr_changes = battles[bid].nr_terrain_changes;
+	if(nr_changes == 0) return;
+
+	server_message_t *psm = terrain_batch_add(&battles[bid].terrain_out);
+	psm->nr_cells = nr_changes;
+	for(int i = 0; i < nr_changes; i++) {
+		psm->cell_kind[i] = battles[bid].terrain_changes[i].kind;
+		psm->cell_pos[i] = battles[bid].terrain_changes[i].pos;
+	}
+	publish_frame(bid, FEED_TERRAIN, psm, sizeof(server_message_t));
+	battles[bid].nr_terrain_changes = 0;
+}
+
+/* pack whole terrain, the first message resets terrain of the receiver */
+void pack_terrain(int bid, terrain_batch_t *batch) {
+	server_message_t *psm = terrain_batch_add(batch);
+	psm->terrain_reset = true;
+
+	for(int i = 0; i < CHUNK_HASH_SIZE; i++) {
+		for(struct chunk_t *chunk = battles[bid].chunks[i]; chunk; chunk = chunk->next) {
+			if(chunk->nr_terrain == 0)
+				continue;
+
+			for(int c = 0; c < CHUNK_SIZE * CHUNK_SIZE; c++) {
+				if(chunk->terrain[c] == ITEM_NONE)
+					continue;
+
+				if(psm->nr_cells == MAX_TERRAIN_CELLS)
+					psm = terrain_batch_add(batch);
+
+				psm->cell_kind[psm->nr_cells] = chunk->terrain[c];
+				psm->cell_pos[psm->nr_cells].x = (chunk->cx << CHUNK_SHIFT) | (c & (CHUNK_SIZE - 1));
+				psm->cell_pos[psm->nr_cells].y = (chunk->cy << CHUNK_SHIFT) | (c >> CHUNK_SHIFT);
+				psm->nr_cells ++;
+			}
+		}
+	}
+}
+
+/* functions below take items_lock[bid] themselves or need none */
+
+/* send and free `batch`, uid -1 sends to all users in battle */
+void send_terrain_batch(int bid, terrain_batch_t *batch, int uid) {
+	for(int n = 0; n < batch->nr; n++) {
+		for(int i = 0; i < USER_CNT; i++) {
+			if(uid >= 0 && i != uid)
+				continue;
+			if(battles[bid].users[i].battle_state != BATTLE_STATE_UNJOINED)
+				wrap_send(sessions[i].conn, &batch->msgs[n]);
+		}
+	}
+	terrain_batch_free(batch);
+}
+
+/* send whole terrain to a user who just joined */
+void send_terrain(int bid, int uid) {
+	terrain_batch_t batch = {0};
+
 	pthread_mutex_lock(&items_lock[bid]);
+	int nr_terrain = battles[bid].nr_terrain;
+	pack_terrain(bid, &batch);
+	pthread_mutex_unlock(&items_lock[bid]);
+
+	send_terrain_batch(bid, &batch, uid);
+	log("send %d terrain cells of battle #%d to user %d@%s\n",
+			nr_terrain, bid, uid, sessions[uid].user_name);
+}
+
+/* functions below must be called with items_lock[bid] held */
+int terrain_at(int bid, pos_t pos) {
+	struct chunk_t *chunk = find_chunk(bid, pos, false);
+	return chunk ? chunk->terrain[CHUNK_CELL(pos)] : ITEM_NONE;
+}
+
+/* kind ITEM_NONE clears terrain of the cell */
+void set_terrain(int bid, pos_t pos, int kind) {
+	struct chunk_t *chunk = find_chunk(bid, pos, kind != ITEM_NONE);
+	if(!chunk) return;
+
+	uint8_t *cell = &chunk->terrain[CHUNK_CELL(pos)];
+	if(*cell == kind) return;
+
+	if(*cell == ITEM_NONE) {
+		chunk->nr_terrain ++;
+		battles[bid].nr_terrain ++;
+	}else if(kind == ITEM_NONE) {
+		chunk->nr_terrain --;
+		battles[bid].nr_terrain --;
+	}
+
+	uint8_t *event = &chunk->events[CHUNK_CELL(pos)];
+	if(*event) {
+		battle_cancel(bid, *event - 1);
+		*event = 0;
+	}
+
+	*cell = kind;
+	if(kind == ITEM_MAGMA) {
+		chunk->magma_times[CHUNK_CELL(pos)] = MAGMA_INIT_TIMES;
+		schedule_cell_event(bid, EVENT_MAGMA_COOLS, pos, MAGMA_COOL_TICKS);
+	}
+
+	if(battles[bid].nr_terrain_changes == MAX_TERRAIN_CELLS)
+		pack_terrain_changes(bid);
+	int n = battles[bid].nr_terrain_changes ++;
+	battles[bid].terrain_changes[n].kind = kind;
+	battles[bid].terrain_changes[n].pos = pos;
+
+	if(chunk->nr_terrain == 0 && chunk->nr_items == 0)
+		drop_chunk(bid, chunk);
+}
+
+int get_unused_item(int bid) {
 	for(int i = 0; i < MAX_ITEM; i++) {
 		if(!(battles[bid].items[i].is_used)) {
-			ret_item_id = i;
 			battles[bid].items[i].is_used = true;
-			break;
+			return i;
 		}
 	}
-	pthread_mutex_unlock(&items_lock[bid]);
-	return ret_item_id;
+	return -1;
 }
 
 void random_generate_items(int bid) {
-	if(rand() % 200 != 9) return;
+	rng_t *rng = &battles[bid].rng;
+	int random_kind = rng_below(rng, ITEM_END - 1) + 1;
+	pos_t pos;
+	pos.x = rng_below(rng, battles[bid].w);
+	pos.y = rng_below(rng, battles[bid].h);
+
+	if(random_kind == ITEM_GRASS || random_kind == ITEM_MAGMA) {
+		if(battles[bid].nr_terrain >= MAX_TERRAIN
+		|| terrain_at(bid, pos) != ITEM_NONE)
+			return;
+
+		log("new terrain: k%d(%d,%d)\n", random_kind, pos.x, pos.y);
+		set_terrain(bid, pos, random_kind);
+		return;
+	}
 
 	if(battles[bid].num_of_other >= MAX_OTHER) return;
 
 	int item_id = get_unused_item(bid);
 	if(item_id == -1) return;
 
-	int random_kind = rand() % (ITEM_END - 1) + 1;
-
 	battles[bid].items[item_id].kind = random_kind;
-	battles[bid].items[item_id].pos.x = (rand() & 0x7FFF) % BATTLE_W;
-	battles[bid].items[item_id].pos.y = (rand() & 0x7FFF) % BATTLE_H;
-	log("new item: #%dk%d(%d,%d)\n", item_id,
-			battles[bid].items[item_id].kind,
-			battles[bid].items[item_id].pos.x,
-			battles[bid].items[item_id].pos.y);
-	if(random_kind == ITEM_MAGMA) {
-		battles[bid].items[item_id].times = MAGMA_INIT_TIMES;
+	battles[bid].items[item_id].pos = pos;
+	log("new item: #%dk%d(%d,%d)\n", item_id, random_kind, pos.x, pos.y);
+	battles[bid].num_of_other ++;
+	place_item(bid, item_id);
+}
+
+int spawn_delay(int bid) {
+	return 1 + rng_below(&battles[bid].rng, 2 * ITEM_SPAWN_TICKS - 1);
+}
+
+int event_spawn_item(int bid, struct battle_event_t *ev) {
+	random_generate_items(bid);
+	return spawn_delay(bid);
+}
+
+int event_magma_cools(int bid, struct battle_event_t *ev) {
+	log("magma (%d,%d) cools down\n", ev->pos.x, ev->pos.y);
+	set_terrain(bid, ev->pos, ITEM_NONE);
+	return 0;
+}
+
+static int (*battle_event_handler[])(int, struct battle_event_t *) = {
+	[EVENT_SPAWN_ITEM] = event_spawn_item,
+	[EVENT_MAGMA_COOLS] = event_magma_cools,
+};
+
+void battle_event_free(int bid, struct battle_event_t *ev) {
+	ev->is_used = false;
+	ev->next_free = battles[bid].free_events;
+	battles[bid].free_events = ev - battles[bid].event_pool;
+}
+
+void battle_event_fire(void *arg) {
+	struct battle_event_t *ev = arg;
+	int ticks = battle_event_handler[ev->kind](ev->bid, ev);
+	if(!ev->is_used)
+		return;      // cancelled by its handler
+	if(ticks > 0)
+		tw_add(&battles[ev->bid].events, &ev->timer, battles[ev->bid].ticks + ticks);
+	else
+		battle_event_free(ev->bid, ev);
+}
+
+// empty the wheel and pool of events, `now` is the next tick to run
+void battle_events_reset(int bid, uint64_t now) {
+	struct battle_t *battle = &battles[bid];
+	tw_init(&battle->events, now);
+	memset(battle->event_pool, 0, sizeof(battle->event_pool));
+	for(int i = 0; i < MAX_BATTLE_EVENTS; i++)
+		battle->event_pool[i].next_free = i + 1 < MAX_BATTLE_EVENTS ? i + 1 : -1;
+	battle->free_events = 0;
+}
+
+void battle_events_init(int bid) {
+	battle_events_reset(bid, battles[bid].ticks);
+	battle_schedule(bid, EVENT_SPAWN_ITEM, (pos_t){0, 0}, spawn_delay(bid));
+}
+
+/* fire event `kind` at `pos` in `ticks`, return the event or -1 if too
+ * many are pending */
+int battle_schedule(int bid, int kind, pos_t pos, int ticks) {
+	int i = battles[bid].free_events;
+	if(i < 0) {
+		loge("too many events pending in battle #%d\n", bid);
+		return -1;
 	}
+
+	struct battle_event_t *ev = &battles[bid].event_pool[i];
+	battles[bid].free_events = ev->next_free;
+	ev->is_used = true;
+	ev->bid = bid;
+	ev->kind = kind;
+	ev->pos = pos;
+	tw_timer_init(&ev->timer, battle_event_fire, ev);
+	tw_add(&battles[bid].events, &ev->timer, battles[bid].ticks + ticks);
+	return i;
+}
+
+void battle_cancel(int bid, int event) {
+	struct battle_event_t *ev = &battles[bid].event_pool[event];
+	if(!ev->is_used)
+		return;
+	tw_del(&ev->timer);
+	battle_event_free(bid, ev);
+}
+
+// the chunk of the cell keeps the event to cancel it, see set_terrain()
+void schedule_cell_event(int bid, int kind, pos_t pos, int ticks) {
+	struct chunk_t *chunk = find_chunk(bid, pos, false);
+	int event = battle_schedule(bid, kind, pos, ticks);
+	if(chunk && event >= 0)
+		chunk->events[CHUNK_CELL(pos)] = event + 1;
 }
 
 void move_bullets(int bid) {
@@ -270,143 +889,110 @@ void move_bullets(int bid) {
 		if(battles[bid].items[i].is_used == false
 		|| battles[bid].items[i].kind != ITEM_BULLET)
 			continue;
-		uint8_t *px = &(battles[bid].items[i].pos.x);
-		uint8_t *py = &(battles[bid].items[i].pos.y);
+		pos_t pos = battles[bid].items[i].pos;
 
 		// log("try to move bullet %d with dir %d\n", i, battles[bid].items[i].dir);
 
 		switch(battles[bid].items[i].dir) {
-			case DIR_UP:	(*py)--;break;
-			case DIR_DOWN:	(*py)++;break;
-			case DIR_LEFT:	(*px)--;break;
-			case DIR_RIGHT:	(*px)++;break;
+			case DIR_UP:	pos.y--;break;
+			case DIR_DOWN:	pos.y++;break;
+			case DIR_LEFT:	pos.x--;break;
+			case DIR_RIGHT:	pos.x++;break;
 		}
 
-		if(*px >= BATTLE_W || *py >= BATTLE_H) {
+		if(pos.x >= battles[bid].w || pos.y >= battles[bid].h) {
 			log("free bullet #%d\n", i);
-			battles[bid].items[i].is_used = false;
+			free_item(bid, i);
+		}else if((pos.x >> CHUNK_SHIFT) != (battles[bid].items[i].pos.x >> CHUNK_SHIFT)
+				|| (pos.y >> CHUNK_SHIFT) != (battles[bid].items[i].pos.y >> CHUNK_SHIFT)) {
+			unplace_item(bid, i);
+			battles[bid].items[i].pos = pos;
+			place_item(bid, i);
+		}else{
+			battles[bid].items[i].pos = pos;
 		}
 	}
 }
 
 void check_who_get_blood_vial(int bid) {
-	for(int i = 0; i < MAX_ITEM; i++) {
-		if(battles[bid].items[i].is_used == false
-		|| battles[bid].items[i].kind != ITEM_BLOOD_VIAL)
+	for(int j = 0; j < USER_CNT; j++) {
+		if(battles[bid].users[j].battle_state != BATTLE_STATE_LIVE)
 			continue;
 
-		int ix = battles[bid].items[i].pos.x;
-		int iy = battles[bid].items[i].pos.y;
+		int i = find_item_under_user(bid, j, ITEM_BLOOD_VIAL);
+		if(i < 0) continue;
 
-		for(int j = 0; j < USER_CNT; j++) {
-			if(battles[bid].users[j].battle_state != BATTLE_STATE_LIVE)
-				continue;
-			int ux = battles[bid].users[j].pos.x;
-			int uy = battles[bid].users[j].pos.y;
-
-			if(ix == ux && iy == uy) {
-				battles[bid].users[j].life += LIFE_PER_VIAL;
-				log("user %d@%s got blood vial\n", j, sessions[j].user_name);
-				if(battles[bid].users[j].life > MAX_LIFE) {
-					log("user %d@%s life exceeds max value\n", j, sessions[j].user_name);
-					battles[bid].users[j].life = MAX_LIFE;
-				}
-
-				battles[bid].items[i].is_used = false;
-				battles[bid].num_of_other --;
-				send_to_client(j, SERVER_MESSAGE_YOU_GOT_BLOOD_VIAL);
-				break;
-			}
+		battles[bid].users[j].life += LIFE_PER_VIAL;
+		log("user %d@%s got blood vial\n", j, sessions[j].user_name);
+		if(battles[bid].users[j].life > MAX_LIFE) {
+			log("user %d@%s life exceeds max value\n", j, sessions[j].user_name);
+			battles[bid].users[j].life = MAX_LIFE;
 		}
+
+		free_item(bid, i);
+		battles[bid].num_of_other --;
+		send_to_client(j, SERVER_MESSAGE_YOU_GOT_BLOOD_VIAL);
 	}
 }
 
 void check_who_traped_in_magma(int bid) {
-	for(int i = 0; i < MAX_ITEM; i++) {
-		if(battles[bid].items[i].is_used == false
-		|| battles[bid].items[i].kind != ITEM_MAGMA)
+	for(int j = 0; j < USER_CNT; j++) {
+		if(battles[bid].users[j].battle_state != BATTLE_STATE_LIVE)
 			continue;
 
-		int ix = battles[bid].items[i].pos.x;
-		int iy = battles[bid].items[i].pos.y;
+		pos_t pos = battles[bid].users[j].pos;
+		struct chunk_t *chunk = find_chunk(bid, pos, false);
+		if(!chunk || chunk->terrain[CHUNK_CELL(pos)] != ITEM_MAGMA)
+			continue;
 
-		for(int j = 0; j < USER_CNT; j++) {
-			if(battles[bid].users[j].battle_state != BATTLE_STATE_LIVE)
-				continue;
-			int ux = battles[bid].users[j].pos.x;
-			int uy = battles[bid].users[j].pos.y;
-
-			if(ix == ux && iy == uy) {
-				battles[bid].users[j].life --;
-				battles[bid].items[i].times --;
-				log("user %d@%s is trapped in magma\n", j, sessions[j].user_name);
-				send_to_client(j, SERVER_MESSAGE_YOU_ARE_TRAPPED_IN_MAGMA);
-				if(battles[bid].items[i].times <= 0) {
-					log("magma %d is exhausted\n", i);
-					battles[bid].items[i].is_used = false;
-					battles[bid].num_of_other --;
-				}
-				break;
-			}
+		battles[bid].users[j].life --;
+		log("user %d@%s is trapped in magma\n", j, sessions[j].user_name);
+		send_to_client(j, SERVER_MESSAGE_YOU_ARE_TRAPPED_IN_MAGMA);
+		if(-- chunk->magma_times[CHUNK_CELL(pos)] == 0) {
+			log("magma (%d,%d) is exhausted\n", pos.x, pos.y);
+			set_terrain(bid, pos, ITEM_NONE);
 		}
 	}
 }
 
 void check_who_got_charger(int bid) {
-	for(int i = 0; i < MAX_ITEM; i++) {
-		if(battles[bid].items[i].is_used == false
-		|| battles[bid].items[i].kind != ITEM_MAGAZINE)
+	for(int j = 0; j < USER_CNT; j++) {
+		if(battles[bid].users[j].battle_state != BATTLE_STATE_LIVE)
 			continue;
 
-		int ix = battles[bid].items[i].pos.x;
-		int iy = battles[bid].items[i].pos.y;
+		int i = find_item_under_user(bid, j, ITEM_MAGAZINE);
+		if(i < 0) continue;
 
-		for(int j = 0; j < USER_CNT; j++) {
-			if(battles[bid].users[j].battle_state != BATTLE_STATE_LIVE)
-				continue;
-			int ux = battles[bid].users[j].pos.x;
-			int uy = battles[bid].users[j].pos.y;
-
-			if(ix == ux && iy == uy) {
-				battles[bid].users[j].nr_bullets += BULLETS_PER_MAGAZINE;
-				log("user %d@%s is got magazine\n", j, sessions[j].user_name);
-				if(battles[bid].users[j].nr_bullets > MAX_BULLETS) {
-					log("user %d@%s's bullets exceeds max value\n", j, sessions[j].user_name);
-					battles[bid].users[j].nr_bullets = MAX_BULLETS;
-				}
-
-				send_to_client(j, SERVER_MESSAGE_YOU_GOT_MAGAZINE);
-				battles[bid].items[i].is_used = false;
-				break;
-			}
+		battles[bid].users[j].nr_bullets += BULLETS_PER_MAGAZINE;
+		log("user %d@%s is got magazine\n", j, sessions[j].user_name);
+		if(battles[bid].users[j].nr_bullets > MAX_BULLETS) {
+			log("user %d@%s's bullets exceeds max value\n", j, sessions[j].user_name);
+			battles[bid].users[j].nr_bullets = MAX_BULLETS;
 		}
+
+		send_to_client(j, SERVER_MESSAGE_YOU_GOT_MAGAZINE);
+		free_item(bid, i);
+		battles[bid].num_of_other --;
 	}
 }
 
 void check_who_is_shooted(int bid) {
-	for(int i = 0; i < MAX_ITEM; i++) {
-		if(battles[bid].items[i].is_used == false
-		|| battles[bid].items[i].kind != ITEM_BULLET)
+	for(int j = 0; j < USER_CNT; j++) {
+		if(battles[bid].users[j].battle_state != BATTLE_STATE_LIVE)
 			continue;
 
-		int ix = battles[bid].items[i].pos.x;
-		int iy = battles[bid].items[i].pos.y;
+		int i = find_item_under_user(bid, j, ITEM_BULLET);
+		if(i < 0) continue;
 
-		for(int j = 0; j < USER_CNT; j++) {
-			if(battles[bid].users[j].battle_state != BATTLE_STATE_LIVE)
-				continue;
-			int ux = battles[bid].users[j].pos.x;
-			int uy = battles[bid].users[j].pos.y;
-
-			if(ix == ux && iy == uy
-			&& battles[bid].items[i].owner != j) {
-				battles[bid].users[j].life --;
-				log("user %d@%s is shooted\n", j, sessions[j].user_name);
-				send_to_client(j, SERVER_MESSAGE_YOU_ARE_SHOOTED);
-				battles[bid].items[i].is_used = false;
-				break;
-			}
-		}
+		int owner = battles[bid].items[i].owner;
+		int rid = registered_index(sessions[owner].user_name);
+		if(owner != j && rid >= 0)
+			registered_user_list[rid].skill ++;
+
+		battles[bid].users[j].life --;
+		log("user %d@%s is shooted\n", j, sessions[j].user_name);
+		send_to_client(j, SERVER_MESSAGE_YOU_ARE_SHOOTED);
+		free_item(bid, i);
 	}
 }
 
@@ -427,13 +1013,15 @@ void check_who_is_dead(int bid) {
 void inform_all_user_battle_state(int bid) {
 	server_message_t sm;
 	sm.message = SERVER_MESSAGE_BATTLE_INFORMATION;
+	sm.map_w = battles[bid].w;
+	sm.map_h = battles[bid].h;
 	for(int i = 0; i < USER_CNT; i++) {
 		if(battles[bid].users[i].battle_state == BATTLE_STATE_LIVE) {
 			sm.user_pos[i].x = battles[bid].users[i].pos.x;
 			sm.user_pos[i].y = battles[bid].users[i].pos.y;
 		}else{
-			sm.user_pos[i].x = -1;
-			sm.user_pos[i].y = -1;
+			sm.user_pos[i].x = POS_NONE;
+			sm.user_pos[i].y = POS_NONE;
 		}
 	}
 
@@ -447,43 +1035,215 @@ void inform_all_user_battle_state(int bid) {
 		}
 	}
 
+	payload_t *payload = payload_alloc();
+	payload->len = snapshot_encode_shared(&sm, payload->data, sizeof(payload->data));
+
 	for(int i = 0; i < USER_CNT; i++) {
+		if(battles[bid].users[i].battle_state == BATTLE_STATE_UNJOINED)
+			continue;
+
 		sm.index = i;
 		sm.life = battles[bid].users[i].life;
 		sm.bullets_num = battles[bid].users[i].nr_bullets;
-		if(battles[bid].users[i].battle_state != BATTLE_STATE_UNJOINED) {
-			wrap_send(sessions[i].conn, &sm);
+
+		uint8_t *header = payload->headers[i];
+		size_t len = SNAPSHOT_HEADER_SIZE + payload->len;
+		header[0] = len & 0xff;
+		header[1] = len >> 8;
+		snapshot_encode_header(&sm, header + FRAME_HEADER_SIZE, SNAPSHOT_HEADER_SIZE);
+
+		struct iovec iov[2] = {
+			{header, FRAME_HEADER_SIZE + SNAPSHOT_HEADER_SIZE},
+			{payload->data, payload->len},
+		};
+
+		pthread_mutex_lock(&zc_lock[i]);
+		if(sessions[i].zc.enabled
+		&& FRAME_HEADER_SIZE + len >= zerocopy_min_bytes) {
+			zc_reap(&sessions[i].zc);
+			pthread_mutex_lock(SEND_LOCK(sessions[i].conn));
+			if(zc_send_iov(&sessions[i].zc, iov, 2, payload) < 0)
+				send_failed(sessions[i].conn);
+			pthread_mutex_unlock(SEND_LOCK(sessions[i].conn));
+		}else{
+			send_iov(sessions[i].conn, iov, 2);
 		}
+		pthread_mutex_unlock(&zc_lock[i]);
+	}
+
+	if(feed) {
+		// spectators see the battle as a dead user
+		sm.index = 0;
+		sm.life = 0;
+		sm.bullets_num = 0;
+
+		uint8_t header[SNAPSHOT_HEADER_SIZE];
+		snapshot_encode_header(&sm, header, SNAPSHOT_HEADER_SIZE);
+		size_t len = SNAPSHOT_HEADER_SIZE + payload->len;
+		uint8_t frame_header[FRAME_HEADER_SIZE] = {len & 0xff, len >> 8};
+		struct iovec iov[3] = {
+			{frame_header, FRAME_HEADER_SIZE},
+			{header, SNAPSHOT_HEADER_SIZE},
+			{payload->data, payload->len},
+		};
+		feed_write(&feed->rings[bid], FEED_SNAPSHOT, iov, 3);
+	}
+
+	payload_put(payload);
+}
+
+/* start the feed of a new battle and publish whole terrain every
+ * FEED_KEYFRAME_TICKS, spectators joining later resume there */
+void publish_keyframe(int bid) {
+	if(!feed) return;
+
+	feed_ring_t *ring = &feed->rings[bid];
+	if(battles[bid].feed_ticks == 0)
+		feed_begin(ring);
+
+	if(battles[bid].feed_ticks ++ % FEED_KEYFRAME_TICKS == 0) {
+		feed_mark_keyframe(ring);
+		terrain_batch_t batch = {0};
+		pack_terrain(bid, &batch);
+		for(int i = 0; i < batch.nr; i++)
+			publish_frame(bid, FEED_TERRAIN, &batch.msgs[i], sizeof(server_message_t));
+		terrain_batch_free(&batch);
 	}
 }
 
-void *battle_ruler(void *args) {
-	int bid = (int)(uintptr_t)args;
-	log("battle ruler for battle #%d\n", bid);
-	// FIXME: battle re-alloced before exiting loop 
-	while(battles[bid].is_alloced) {
-		move_bullets(bid);
-		check_who_get_blood_vial(bid);
-		check_who_traped_in_magma(bid);
-		check_who_got_charger(bid);
-		check_who_is_shooted(bid);
-		check_who_is_dead(bid);
-		
-		random_generate_items(bid);
+void battle_tick(int bid) {
+	pthread_mutex_lock(&items_lock[bid]);
+	move_bullets(bid);
+	check_who_get_blood_vial(bid);
+	check_who_traped_in_magma(bid);
+	check_who_got_charger(bid);
+	check_who_is_shooted(bid);
+	check_who_is_dead(bid);
+
+	tw_advance(&battles[bid].events, ++ battles[bid].ticks);
+	pack_terrain_changes(bid);
+	terrain_batch_t changes = battles[bid].terrain_out;
+	memset(&battles[bid].terrain_out, 0, sizeof(terrain_batch_t));
+	publish_keyframe(bid);
+	pthread_mutex_unlock(&items_lock[bid]);
+
+	send_terrain_batch(bid, &changes, -1);
+	inform_all_user_battle_state(bid);
+}
+
+int64_t now_us() {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* simulation workers
+ *
+ *   battles are ticked by a fixed pool of workers instead of a thread
+ *   per battle, a launched battle goes to the worker running fewest
+ *   battles. A worker drops a battle once it is disbanded or launched
+ *   again on another worker.
+ */
+#define MAX_SIM_WORKERS 16
+#define TICK_US 50000
+
+struct sim_worker_t {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int nr_battles;
+	int bids[USER_CNT];
+} sim_workers[MAX_SIM_WORKERS];
+
+// see `-w` option
+static int nr_sim_workers = 2;
+
+void *sim_worker(void *args) {
+	int w = (int)(uintptr_t)args;
+	struct sim_worker_t *worker = &sim_workers[w];
+	int bids[USER_CNT];
+	log("simulation worker #%d\n", w);
+
+	while(1) {
+		int64_t st = now_us();
 
-		inform_all_user_battle_state(bid);
+		pthread_mutex_lock(&worker->lock);
+		for(int i = 0; i < worker->nr_battles; ) {
+			int bid = worker->bids[i];
+			if(battles[bid].is_alloced && battles[bid].worker == w) {
+				i ++;
+				continue;
+			}
+			log("battle #%d leaves worker #%d\n", bid, w);
+			if(feed && !battles[bid].is_alloced)
+				feed_end(&feed->rings[bid]);
+			if(!battles[bid].is_alloced)
+				checkpoint_clear(bid);
+			worker->bids[i] = worker->bids[-- worker->nr_battles];
+		}
+		int nr_battles = worker->nr_battles;
+		memcpy(bids, worker->bids, nr_battles * sizeof(int));
+		pthread_mutex_unlock(&worker->lock);
+
+		pthread_rwlock_rdlock(&state_lock);
+		for(int i = 0; i < nr_battles; i++) {
+			battle_tick(bids[i]);
+			checkpoint_battle(bids[i]);
+		}
+		pthread_rwlock_unlock(&state_lock);
 
-		usleep(50000);
+		int64_t left = TICK_US - (now_us() - st);
+		if(left > 0)
+			usleep(left < TICK_US ? left : TICK_US);
 	}
 	return NULL;
 }
 
+void start_sim_workers() {
+	for(int i = 0; i < nr_sim_workers; i++) {
+		pthread_mutex_init(&sim_workers[i].lock, NULL);
+		if(pthread_create(&sim_workers[i].thread, NULL, sim_worker, (void *)(uintptr_t)i) != 0)
+			eprintf("fail to start simulation worker\n");
+	}
+}
+
+/* salted hash of `password` into `hash`, return -1 on error */
+int hash_password(const char *password, char hash[PASSWORD_HASH_SIZE]) {
+	char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+	struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+	int ret = -1;
+	if(data && crypt_gensalt_rn("$6$", 0, NULL, 0, salt, sizeof(salt))) {
+		char *out = crypt_r(password, salt, data);
+		if(out && out[0] != '*' && strlen(out) < PASSWORD_HASH_SIZE) {
+			strcpy(hash, out);
+			ret = 0;
+		}
+	}
+	free(data);
+	return ret;
+}
+
+int check_password(const char *password, const char *hash) {
+	if(hash[0] == '\0')
+		return false;
+
+	struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+	if(!data) return false;
+	char *out = crypt_r(password, hash, data);
+	int matched = out && strcmp(out, hash) == 0;
+	free(data);
+	return matched;
+}
+
 int check_user_registered(char *user_name, char *password) {
 	for(int i = 0; i < REGISTERED_USER_LIST_SIZE; i++) {
 		if(strncmp(user_name, registered_user_list[i].user_name, USERNAME_SIZE - 1) != 0)
 			continue;
 
-		if(strncmp(password, registered_user_list[i].password, PASSWORD_SIZE - 1) != 0) {
+		// recovered from a checkpoint, which keeps only hashes
+		int matched = registered_user_list[i].password[0] == '\0'
+			? check_password(password, registered_user_list[i].hash)
+			: strncmp(password, registered_user_list[i].password, PASSWORD_SIZE - 1) == 0;
+		if(!matched) {
 			logi("user name '%s' sent error password\n", user_name);
 			return SERVER_RESPONSE_LOGIN_FAIL_ERROR_PASSWORD;
 		}else{
@@ -496,51 +1256,435 @@ int check_user_registered(char *user_name, char *password) {
 }
 
 void launch_battle(int bid) {
-	pthread_t thread;
-
-	log("try to create battle_ruler thread\n");
-	if(pthread_create(&thread, NULL, battle_ruler, (void *)(uintptr_t)bid) == -1) {
-		eprintf("fail to launch battle\n");
+	int w = 0;
+	for(int i = 1; i < nr_sim_workers; i++) {
+		if(sim_workers[i].nr_battles < sim_workers[w].nr_battles)
+			w = i;
 	}
+
+	struct sim_worker_t *worker = &sim_workers[w];
+	pthread_mutex_lock(&worker->lock);
+	battles[bid].worker = w;
+
+	int i = 0;
+	while(i < worker->nr_battles && worker->bids[i] != bid)
+		i ++;
+	if(i == worker->nr_battles)
+		worker->bids[worker->nr_battles ++] = bid;
+	pthread_mutex_unlock(&worker->lock);
+
+	log("launch battle #%d on worker #%d(%d battles)\n", bid, w, worker->nr_battles);
 }
 
-int client_command_user_register(int uid) {
-	int ul_index = -1;
-	char *user_name = sessions[uid].cm.user_name;
-	char *password = sessions[uid].cm.password;
-	log("user '%s' tries to register with password '%s'\n", user_name, password);
+/* matchmaking
+ *
+ *   logged in users enter the queue and every MATCH_INTERVAL_US the
+ *   matcher packs them into battles of `match_size` users of the same
+ *   skill bucket. Every MATCH_WIDEN_TICKS a waiting user opens one more
+ *   bucket on each side, and after MATCH_MAX_WAIT_TICKS a battle starts
+ *   with whoever is in reach if there are at least MATCH_MIN_USERS.
+ *
+ *   users leave the queue by `leave match`, or implicitly by launching
+ *   or accepting a battle, the matcher drops them lazily.
+ */
+#define MATCH_INTERVAL_US 100000
+#define MATCH_WIDEN_TICKS 20
+#define MATCH_MAX_WAIT_TICKS 50
+#define MATCH_MIN_USERS 2
+#define NR_SKILL_BUCKETS 8
+#define SKILL_PER_BUCKET 10
+
+pthread_mutex_t match_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// users per matched battle, see `-n` option
+static int match_size = USER_CNT;
+
+static struct {
+	int uid;
+	int bucket;
+	int ticks;           // waited
+} match_queue[USER_CNT];
+static int match_queue_len = 0;
+
+int skill_bucket(int uid) {
+	int rid = registered_index(sessions[uid].user_name);
+	int bucket = rid < 0 ? 0 : registered_user_list[rid].skill / SKILL_PER_BUCKET;
+	return bucket < NR_SKILL_BUCKETS ? bucket : NR_SKILL_BUCKETS - 1;
+}
 
-	for(int i = 0; i < REGISTERED_USER_LIST_SIZE; i++) {
-		if(strncmp(user_name, registered_user_list[i].user_name, USERNAME_SIZE - 1) != 0)
+// caller holds match_lock
+void match_dequeue(int uid) {
+	for(int i = 0; i < match_queue_len; i++) {
+		if(match_queue[i].uid != uid)
 			continue;
 
-		log("user '%s'&'%s' has been registered\n", user_name, password);
-		send_to_client(uid, SERVER_RESPONSE_YOU_HAVE_REGISTERED);
-		return 0;
+		match_queue_len --;
+		memmove(&match_queue[i], &match_queue[i + 1],
+				(match_queue_len - i) * sizeof(match_queue[0]));
+		return;
 	}
+}
 
-	pthread_mutex_lock(&userlist_lock);
-	if(user_list_size < REGISTERED_USER_LIST_SIZE)
-		ul_index = user_list_size ++;
-	pthread_mutex_unlock(&userlist_lock);
+// caller holds match_lock
+int start_matched_battle(int *uids, int nr_uids) {
+	int bid = get_unalloced_battle();
+	if(bid == -1) return -1;
 
-	log("fetch empty user list index #%d\n", ul_index);
-	if(ul_index == -1) {
-		log("user '%s' registers fail\n", user_name);
-		send_to_client(uid, SERVER_RESPONSE_REGISTER_FAIL);
-	}else{
-		log("user '%s' registers success\n", user_name);
-		strncpy(registered_user_list[ul_index].user_name,
-				user_name, USERNAME_SIZE - 1);
-		strncpy(registered_user_list[ul_index].password,
-				password, PASSWORD_SIZE - 1);
-		send_to_client(uid, SERVER_RESPONSE_REGISTER_SUCCESS);
+	log("match %d users into battle #%d\n", nr_uids, bid);
+	for(int i = 0; i < nr_uids; i++) {
+		match_dequeue(uids[i]);
+		user_join_battle(bid, uids[i]);
+		send_to_client(uids[i], SERVER_MESSAGE_MATCH_FOUND);
 	}
-	return 0;
+	launch_battle(bid);
+	return bid;
 }
 
-int client_command_user_login(int uid) {
-	int is_dup = 0;
+void *matcher(void *args) {
+	while(1) {
+		usleep(MATCH_INTERVAL_US);
+		pthread_rwlock_rdlock(&state_lock);
+		pthread_mutex_lock(&match_lock);
+
+		for(int i = 0; i < match_queue_len; ) {
+			if(sessions[match_queue[i].uid].state != USER_STATE_MATCHING) {
+				match_dequeue(match_queue[i].uid);
+			}else{
+				match_queue[i].ticks ++;
+				i ++;
+			}
+		}
+
+		// the oldest users go first
+		for(int a = 0; a < match_queue_len; ) {
+			int group[USER_CNT], nr_group = 0;
+			int reach = match_queue[a].ticks / MATCH_WIDEN_TICKS;
+			for(int i = 0; i < match_queue_len && nr_group < match_size; i++) {
+				if(abs(match_queue[i].bucket - match_queue[a].bucket) <= reach)
+					group[nr_group ++] = match_queue[i].uid;
+			}
+
+			if(nr_group < match_size
+			&& (match_queue[a].ticks < MATCH_MAX_WAIT_TICKS || nr_group < MATCH_MIN_USERS)) {
+				a ++;
+			}else if(start_matched_battle(group, nr_group) < 0) {
+				break;
+			}
+		}
+
+		pthread_mutex_unlock(&match_lock);
+		pthread_rwlock_unlock(&state_lock);
+	}
+	return NULL;
+}
+
+int client_command_join_match(int uid) {
+	log("user %d@%s tries to join match queue\n", uid, sessions[uid].user_name);
+	if(!query_session_built(uid)) {
+		send_to_client(uid, SERVER_RESPONSE_YOU_HAVE_NOT_LOGIN);
+		return 0;
+	}
+
+	pthread_mutex_lock(&match_lock);
+	if(sessions[uid].state == USER_STATE_BATTLE) {
+		logi("already in battle\n");
+		send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
+	}else{
+		match_dequeue(uid);
+		match_queue[match_queue_len].uid = uid;
+		match_queue[match_queue_len].bucket = skill_bucket(uid);
+		match_queue[match_queue_len].ticks = 0;
+		logi("queued in skill bucket %d(%d users)\n",
+				match_queue[match_queue_len].bucket, match_queue_len + 1);
+		match_queue_len ++;
+		sessions[uid].state = USER_STATE_MATCHING;
+		// under lock, the reply must go before MATCH_FOUND
+		send_to_client(uid, SERVER_RESPONSE_MATCH_QUEUED);
+	}
+	pthread_mutex_unlock(&match_lock);
+	return 0;
+}
+
+int client_command_leave_match(int uid) {
+	log("user %d@%s tries to leave match queue\n", uid, sessions[uid].user_name);
+	pthread_mutex_lock(&match_lock);
+	if(sessions[uid].state == USER_STATE_BATTLE) {
+		logi("but the match was found\n");
+		send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
+	}else{
+		match_dequeue(uid);
+		if(sessions[uid].state == USER_STATE_MATCHING)
+			sessions[uid].state = USER_STATE_LOGIN;
+		send_to_client(uid, SERVER_RESPONSE_MATCH_LEFT);
+	}
+	pthread_mutex_unlock(&match_lock);
+	return 0;
+}
+
+/* friend graph
+ *
+ *   friendships are between registered users and outlive sessions.
+ *   Each registered user keeps its friends and the users asking to be
+ *   its friends in small arrays of registered indexes, `asked` is the
+ *   reverse index of `requests` (whom the user asked). Adding,
+ *   accepting, removing and telling friends about a user only walk the
+ *   arrays of the users involved, never the sessions or the registered
+ *   users. A registered user is found online by `session_of`, checked
+ *   against the session since sessions never clear it.
+ */
+#define MAX_FRIENDS 16
+
+pthread_mutex_t friends_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct adjacency_t {
+	uint8_t nr;
+	uint8_t rids[MAX_FRIENDS];
+};
+
+static struct {
+	struct adjacency_t friends;   // both ways
+	struct adjacency_t requests;  // asked to be our friend
+	struct adjacency_t asked;     // we asked
+} friend_graph[REGISTERED_USER_LIST_SIZE];
+
+static int session_of[REGISTERED_USER_LIST_SIZE];
+
+int adjacency_has(struct adjacency_t *adj, int rid) {
+	for(int i = 0; i < adj->nr; i++) {
+		if(adj->rids[i] == rid)
+			return true;
+	}
+	return false;
+}
+
+int adjacency_add(struct adjacency_t *adj, int rid) {
+	if(adjacency_has(adj, rid)) return 0;
+	if(adj->nr == MAX_FRIENDS) return -1;
+	adj->rids[adj->nr ++] = rid;
+	return 0;
+}
+
+void adjacency_del(struct adjacency_t *adj, int rid) {
+	for(int i = 0; i < adj->nr; i++) {
+		if(adj->rids[i] == rid) {
+			adj->rids[i] = adj->rids[-- adj->nr];
+			return;
+		}
+	}
+}
+
+// session of registered user `rid`, -1 if offline
+int online_uid(int rid) {
+	if(rid < 0) return -1;
+	int uid = session_of[rid];
+	return query_session_built(uid) && sessions[uid].rid == rid ? uid : -1;
+}
+
+// uid of the online friend of `uid` named `user_name`, -1 if offline, -2 if not a friend
+int find_friend(int uid, const char *user_name) {
+	int ret = -2;
+	pthread_mutex_lock(&friends_lock);
+	struct adjacency_t *adj = &friend_graph[sessions[uid].rid].friends;
+	for(int i = 0; i < adj->nr; i++) {
+		int rid = adj->rids[i];
+		if(strncmp(user_name, registered_user_list[rid].user_name, USERNAME_SIZE - 1) == 0) {
+			ret = online_uid(rid);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&friends_lock);
+	return ret;
+}
+
+void notify_registered(int rid, int message, int about) {
+	int uid = online_uid(rid);
+	if(uid >= 0)
+		send_to_client_with_username(uid, message, registered_user_list[about].user_name);
+}
+
+// friends changed, resend presence, caller holds friends_lock
+void friends_changed(int rid) {
+	int uid = online_uid(rid);
+	if(uid >= 0)
+		sessions[uid].presence_epoch ++;
+}
+
+// session `uid` has logged in, tell it who asked to be its friends
+void friends_login(int uid) {
+	uint8_t requests[MAX_FRIENDS];
+	int nr_requests;
+	int rid = sessions[uid].rid;
+
+	pthread_mutex_lock(&friends_lock);
+	session_of[rid] = uid;
+	sessions[uid].presence_epoch ++;
+	nr_requests = friend_graph[rid].requests.nr;
+	memcpy(requests, friend_graph[rid].requests.rids, nr_requests);
+	pthread_mutex_unlock(&friends_lock);
+
+	for(int i = 0; i < nr_requests; i++)
+		send_to_client_with_username(uid, SERVER_MESSAGE_FRIEND_REQUEST, registered_user_list[requests[i]].user_name);
+}
+
+// caller holds friends_lock
+int befriend(int rid, int other) {
+	if(friend_graph[rid].friends.nr == MAX_FRIENDS
+	|| friend_graph[other].friends.nr == MAX_FRIENDS)
+		return -1;
+
+	adjacency_del(&friend_graph[rid].requests, other);
+	adjacency_del(&friend_graph[other].asked, rid);
+	adjacency_add(&friend_graph[rid].friends, other);
+	adjacency_add(&friend_graph[other].friends, rid);
+	friends_changed(rid);
+	friends_changed(other);
+	return 0;
+}
+
+// registered index of the user named in the command, -1 if it's unknown or the sender
+int friend_command_target(int uid) {
+	char *user_name = sessions[uid].cm.user_name;
+	user_name[USERNAME_SIZE - 1] = 0;
+
+	if(!query_session_built(uid)) {
+		send_to_client(uid, SERVER_RESPONSE_YOU_HAVE_NOT_LOGIN);
+		return -1;
+	}
+
+	int other = registered_index(user_name);
+	if(other < 0 || other == sessions[uid].rid) {
+		logi("user %d@%s: no friend '%s' to have\n", uid, sessions[uid].user_name, user_name);
+		send_to_client_with_username(uid, SERVER_RESPONSE_FRIEND_REQUEST_FAIL, user_name);
+		return -1;
+	}
+	return other;
+}
+
+int client_command_add_friend(int uid) {
+	int other = friend_command_target(uid);
+	if(other < 0) return 0;
+
+	int rid = sessions[uid].rid;
+	int message;
+	log("user %d@%s asks %s to be friends\n", uid, sessions[uid].user_name, registered_user_list[other].user_name);
+
+	pthread_mutex_lock(&friends_lock);
+	if(adjacency_has(&friend_graph[rid].friends, other)) {
+		message = SERVER_MESSAGE_FRIEND_ADDED;
+	}else if(adjacency_has(&friend_graph[rid].requests, other)) {
+		// asked each other
+		message = befriend(rid, other) == 0 ? SERVER_MESSAGE_FRIEND_ADDED : SERVER_RESPONSE_FRIEND_REQUEST_FAIL;
+	}else if(friend_graph[rid].asked.nr < MAX_FRIENDS
+	&& adjacency_add(&friend_graph[other].requests, rid) == 0) {
+		adjacency_add(&friend_graph[rid].asked, other);
+		message = SERVER_MESSAGE_FRIEND_REQUEST;
+	}else{
+		message = SERVER_RESPONSE_FRIEND_REQUEST_FAIL;
+	}
+	pthread_mutex_unlock(&friends_lock);
+
+	if(message == SERVER_MESSAGE_FRIEND_REQUEST) {
+		notify_registered(other, SERVER_MESSAGE_FRIEND_REQUEST, rid);
+		message = SERVER_RESPONSE_FRIEND_REQUEST_SENT;
+	}else if(message == SERVER_MESSAGE_FRIEND_ADDED) {
+		notify_registered(other, SERVER_MESSAGE_FRIEND_ADDED, rid);
+	}
+	send_to_client_with_username(uid, message, registered_user_list[other].user_name);
+	return 0;
+}
+
+int client_command_accept_friend(int uid) {
+	int other = friend_command_target(uid);
+	if(other < 0) return 0;
+
+	int rid = sessions[uid].rid;
+	int message = SERVER_RESPONSE_FRIEND_REQUEST_FAIL;
+	log("user %d@%s accepts %s as friend\n", uid, sessions[uid].user_name, registered_user_list[other].user_name);
+
+	pthread_mutex_lock(&friends_lock);
+	if(adjacency_has(&friend_graph[rid].requests, other)
+	&& befriend(rid, other) == 0)
+		message = SERVER_MESSAGE_FRIEND_ADDED;
+	pthread_mutex_unlock(&friends_lock);
+
+	if(message == SERVER_MESSAGE_FRIEND_ADDED)
+		notify_registered(other, SERVER_MESSAGE_FRIEND_ADDED, rid);
+	send_to_client_with_username(uid, message, registered_user_list[other].user_name);
+	return 0;
+}
+
+int client_command_remove_friend(int uid) {
+	int other = friend_command_target(uid);
+	if(other < 0) return 0;
+
+	int rid = sessions[uid].rid;
+	log("user %d@%s removes friend %s\n", uid, sessions[uid].user_name, registered_user_list[other].user_name);
+
+	pthread_mutex_lock(&friends_lock);
+	int were_friends = adjacency_has(&friend_graph[rid].friends, other);
+	adjacency_del(&friend_graph[rid].friends, other);
+	adjacency_del(&friend_graph[other].friends, rid);
+	adjacency_del(&friend_graph[rid].requests, other);
+	adjacency_del(&friend_graph[other].asked, rid);
+	adjacency_del(&friend_graph[rid].asked, other);
+	adjacency_del(&friend_graph[other].requests, rid);
+	if(were_friends) {
+		friends_changed(rid);
+		friends_changed(other);
+	}
+	pthread_mutex_unlock(&friends_lock);
+
+	if(were_friends)
+		notify_registered(other, SERVER_MESSAGE_FRIEND_REMOVED, rid);
+	send_to_client_with_username(uid, SERVER_MESSAGE_FRIEND_REMOVED, registered_user_list[other].user_name);
+	return 0;
+}
+
+int client_command_user_register(int uid) {
+	int ul_index = -1;
+	char *user_name = sessions[uid].cm.user_name;
+	char *password = sessions[uid].cm.password;
+	log("user '%s' tries to register with password '%s'\n", user_name, password);
+
+	for(int i = 0; i < REGISTERED_USER_LIST_SIZE; i++) {
+		if(strncmp(user_name, registered_user_list[i].user_name, USERNAME_SIZE - 1) != 0)
+			continue;
+
+		log("user '%s'&'%s' has been registered\n", user_name, password);
+		send_to_client(uid, SERVER_RESPONSE_YOU_HAVE_REGISTERED);
+		return 0;
+	}
+
+	char hash[PASSWORD_HASH_SIZE];
+	if(hash_password(password, hash) < 0) {
+		loge("fail to hash password of user '%s'\n", user_name);
+		send_to_client(uid, SERVER_RESPONSE_REGISTER_FAIL);
+		return 0;
+	}
+
+	pthread_mutex_lock(&userlist_lock);
+	if(user_list_size < REGISTERED_USER_LIST_SIZE)
+		ul_index = user_list_size ++;
+	pthread_mutex_unlock(&userlist_lock);
+
+	log("fetch empty user list index #%d\n", ul_index);
+	if(ul_index == -1) {
+		log("user '%s' registers fail\n", user_name);
+		send_to_client(uid, SERVER_RESPONSE_REGISTER_FAIL);
+	}else{
+		log("user '%s' registers success\n", user_name);
+		strncpy(registered_user_list[ul_index].user_name,
+				user_name, USERNAME_SIZE - 1);
+		strncpy(registered_user_list[ul_index].password,
+				password, PASSWORD_SIZE - 1);
+		strcpy(registered_user_list[ul_index].hash, hash);
+		send_to_client(uid, SERVER_RESPONSE_REGISTER_SUCCESS);
+	}
+	return 0;
+}
+
+int client_command_user_login(int uid) {
+	int is_dup = 0;
 	client_message_t *pcm = &sessions[uid].cm;
 	char *user_name = pcm->user_name;
 	char *password = pcm->password;
@@ -558,6 +1702,8 @@ int client_command_user_login(int uid) {
 		if(query_session_built(i)) {
 			logi("check dup user id: '%s' vs. '%s'\n", user_name, sessions[i].user_name);
 			if(strncmp(user_name, sessions[i].user_name, USERNAME_SIZE - 1) == 0) {
+				if(message == SERVER_RESPONSE_LOGIN_SUCCESS && session_expire(i, INT64_MAX))
+					continue;
 				log("user %d@%s duplicate with %dth user '%s'\n", uid, user_name, i, sessions[i].user_name);
 				is_dup = 1;
 				break;
@@ -572,10 +1718,15 @@ int client_command_user_login(int uid) {
 		sessions[uid].state = USER_STATE_NOT_LOGIN;
 	}else if(message == SERVER_RESPONSE_LOGIN_SUCCESS){
 		log("user '%s' login success\n", user_name);
-		sessions[uid].state = USER_STATE_LOGIN;
-		send_to_client(uid, SERVER_RESPONSE_LOGIN_SUCCESS);
 		strncpy(sessions[uid].user_name, user_name, USERNAME_SIZE - 1);
-		inform_friends(uid, SERVER_MESSAGE_FRIEND_LOGIN);
+		sessions[uid].rid = registered_index(user_name);
+		sessions[uid].state = USER_STATE_LOGIN;
+		sessions[uid].chat_tat = 0;
+		user_index_add(uid);
+		new_resume_token(uid);
+		send_session_token(uid, SERVER_RESPONSE_LOGIN_SUCCESS);
+		friends_login(uid);
+		chat_replay(CHAT_CHANNEL_GLOBAL, uid);
 	}else{
 		send_to_client(uid, message);
 	}
@@ -584,6 +1735,10 @@ int client_command_user_login(int uid) {
 }
 
 int client_command_user_logout(int uid) {
+	pthread_mutex_lock(&match_lock);
+	match_dequeue(uid);
+	pthread_mutex_unlock(&match_lock);
+
 	if(sessions[uid].state == USER_STATE_BATTLE
 	|| sessions[uid].state == USER_STATE_WAIT_TO_BATTLE) {
 		log("user %d@%s tries to logout was in battle\n", uid, sessions[uid].user_name);
@@ -591,8 +1746,9 @@ int client_command_user_logout(int uid) {
 	}
 
 	log("user %d@%s logout\n", uid, sessions[uid].user_name);
+	if(query_session_built(uid))
+		user_index_del(uid);
 	sessions[uid].state = USER_STATE_NOT_LOGIN;
-	inform_friends(uid, SERVER_MESSAGE_FRIEND_LOGOUT);
 	return 0;
 }
 
@@ -627,6 +1783,107 @@ int client_command_fetch_all_users(int uid) {
 	return 0;
 }
 
+/* user listing
+ *
+ *   logged in users are kept sorted by name in `user_index`. A listing
+ *   is streamed in pages of USER_PAGE_SIZE, each found by binary
+ *   search after the cursor, the last name of the page before, so a
+ *   page costs the same wherever it starts and users coming and going
+ *   between pages don't shift the rest. The index is not held while a
+ *   page is sent.
+ */
+pthread_mutex_t user_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	char user_name[USERNAME_SIZE];
+	int uid;
+} user_index[USER_CNT];
+static int user_index_size = 0;
+
+// first position whose name isn't less than `user_name`, or greater with `after`
+int user_index_search(const char *user_name, int after) {
+	int lo = 0, hi = user_index_size;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		int cmp = strncmp(user_index[mid].user_name, user_name, USERNAME_SIZE - 1);
+		if(cmp < 0 || (after && cmp == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void user_index_add(int uid) {
+	pthread_mutex_lock(&user_index_lock);
+	int i = user_index_search(sessions[uid].user_name, false);
+	memmove(&user_index[i + 1], &user_index[i], (user_index_size - i) * sizeof(user_index[0]));
+	strncpy(user_index[i].user_name, sessions[uid].user_name, USERNAME_SIZE - 1);
+	user_index[i].user_name[USERNAME_SIZE - 1] = 0;
+	user_index[i].uid = uid;
+	user_index_size ++;
+	pthread_mutex_unlock(&user_index_lock);
+}
+
+void user_index_del(int uid) {
+	pthread_mutex_lock(&user_index_lock);
+	int i = user_index_search(sessions[uid].user_name, false);
+	if(i < user_index_size && user_index[i].uid == uid) {
+		user_index_size --;
+		memmove(&user_index[i], &user_index[i + 1], (user_index_size - i) * sizeof(user_index[0]));
+	}
+	pthread_mutex_unlock(&user_index_lock);
+}
+
+int client_command_list_users(int uid) {
+	client_message_t *pcm = &sessions[uid].cm;
+	char prefix[USERNAME_SIZE], cursor[USERNAME_SIZE];
+	int nr_left = pcm->nr_wanted ? pcm->nr_wanted : INT32_MAX;
+
+	if(!query_session_built(uid)) {
+		send_to_client(uid, SERVER_RESPONSE_YOU_HAVE_NOT_LOGIN);
+		return 0;
+	}
+
+	strncpy(prefix, pcm->user_name, USERNAME_SIZE - 1);
+	strncpy(cursor, pcm->cursor, USERNAME_SIZE - 1);
+	prefix[USERNAME_SIZE - 1] = cursor[USERNAME_SIZE - 1] = 0;
+	size_t prefix_len = strlen(prefix);
+	log("user %d@%s lists users from '%s' after '%s'\n", uid, sessions[uid].user_name, prefix, cursor);
+
+	server_message_t sm;
+	do {
+		memset(&sm, 0, sizeof(server_message_t));
+		sm.response = SERVER_RESPONSE_USER_PAGE;
+
+		pthread_mutex_lock(&user_index_lock);
+		int i = user_index_search(prefix, false);
+		if(cursor[0]) {
+			int j = user_index_search(cursor, true);
+			if(j > i) i = j;
+		}
+
+		for(; i < user_index_size && sm.nr_listed < USER_PAGE_SIZE && nr_left > 0; i++, nr_left--) {
+			if(strncmp(user_index[i].user_name, prefix, prefix_len) != 0)
+				break;
+
+			int n = sm.nr_listed ++;
+			strncpy(sm.listed[n].user_name, user_index[i].user_name, USERNAME_SIZE - 1);
+			sm.listed[n].user_state = sessions[user_index[i].uid].state;
+		}
+		sm.more = i < user_index_size
+			&& strncmp(user_index[i].user_name, prefix, prefix_len) == 0;
+		pthread_mutex_unlock(&user_index_lock);
+
+		if(sm.nr_listed > 0)
+			strncpy(cursor, sm.listed[sm.nr_listed - 1].user_name, USERNAME_SIZE - 1);
+		strncpy(sm.page_cursor, cursor, USERNAME_SIZE - 1);
+		wrap_send(sessions[uid].conn, &sm);
+	} while(sm.more && nr_left > 0);
+
+	return 0;
+}
+
 int client_command_fetch_all_friends(int uid) {
 	char *user_name = sessions[uid].user_name;
 	log("user %d@'%s' tries to fetch all friends' info\n", uid, user_name);
@@ -639,10 +1896,18 @@ int client_command_fetch_all_friends(int uid) {
 
 	server_message_t sm;
 	memset(&sm, 0, sizeof(server_message_t));
-	list_all_users(&sm);
-	sm.all_users[uid].user_state = USER_STATE_UNUSED;
 	sm.response = SERVER_RESPONSE_ALL_FRIENDS_INFO;
 
+	pthread_mutex_lock(&friends_lock);
+	struct adjacency_t *adj = &friend_graph[sessions[uid].rid].friends;
+	for(int i = 0; i < adj->nr && i < USER_CNT; i++) {
+		int rid = adj->rids[i];
+		int friend_id = online_uid(rid);
+		sm.all_users[i].user_state = friend_id < 0 ? USER_STATE_NOT_LOGIN : sessions[friend_id].state;
+		strncpy(sm.all_users[i].user_name, registered_user_list[rid].user_name, USERNAME_SIZE - 1);
+	}
+	pthread_mutex_unlock(&friends_lock);
+
 	wrap_send(sessions[uid].conn, &sm);
 
 	return 0;
@@ -650,15 +1915,21 @@ int client_command_fetch_all_friends(int uid) {
 
 
 int invite_friend_to_battle(int bid, int uid, char *friend_name) {
-	int friend_id = find_uid_by_user_name(friend_name);
-	if(friend_id == -1) {
-		// fail to find friend
-		logi("friend '%s' hasn't login\n", friend_name);
-		send_to_client(uid, SERVER_MESSAGE_FRIEND_NOT_LOGIN);
-	}else if(friend_id == uid){
+	if(strncmp(friend_name, sessions[uid].user_name, USERNAME_SIZE - 1) == 0) {
 		logi("launch battle %d for %s\n", bid, sessions[uid].user_name);
 		sessions[uid].inviter_id = uid;
 		send_to_client(uid, SERVER_RESPONSE_INVITATION_SENT);
+		return 0;
+	}
+
+	int friend_id = find_friend(uid, friend_name);
+	if(friend_id == -2) {
+		logi("'%s' isn't a friend of %s\n", friend_name, sessions[uid].user_name);
+		send_to_client_with_username(uid, SERVER_RESPONSE_NOT_YOUR_FRIEND, friend_name);
+	}else if(friend_id == -1) {
+		// fail to find friend
+		logi("friend '%s' hasn't login\n", friend_name);
+		send_to_client_with_username(uid, SERVER_MESSAGE_FRIEND_NOT_LOGIN, friend_name);
 	}else if(sessions[friend_id].state == USER_STATE_BATTLE) {
 		// friend already in battle
 		logi("friend '%s' already in battle\n", friend_name);
@@ -721,113 +1992,855 @@ int client_command_quit_battle(int uid) {
 int client_command_invite_user(int uid) {
 	client_message_t *pcm = &sessions[uid].cm;
 	int bid = sessions[uid].bid;
-	int friend_id = find_uid_by_user_name(pcm->user_name);
 	log("user %d@%s tries to invite friend\n", uid, sessions[uid].user_name);
 
 	if(sessions[uid].state != USER_STATE_BATTLE) {
 		log("user %s who invites friend %s wasn't in battle\n", sessions[uid].user_name, pcm->user_name);
 		send_to_client(uid, SERVER_RESPONSE_YOURE_NOT_IN_BATTLE);
 	}else{
-		logi("invite user %s to battle #%d\n", sessions[friend_id].user_name, bid);
+		logi("invite user %s to battle #%d\n", pcm->user_name, bid);
 		invite_friend_to_battle(bid, uid, pcm->user_name);
 	}
 	return 0;
 }
 
-int client_command_send_message(int uid) 
-{
-	client_message_t *pcm = &sessions[uid].cm;
-	server_message_t sm;
-	memset(&sm,0,sizeof(server_message_t));
-	sm.message=SERVER_MESSAGE_FRIEND_MESSAGE;
-	strncpy(sm.from_user,sessions[uid].user_name,USERNAME_SIZE);
-	strncpy(sm.msg,pcm->message,MSG_SIZE);
-	if(pcm->user_name[0]=='\0')
-	{
-		logi("user %d:%s yells at all users: %s\n", uid, sessions[uid].user_name, pcm->message);
-		int i;
-		for(i=0;i<USER_CNT;i++)
-		{
-			if(uid==i)continue;
-			wrap_send(sessions[i].conn,&sm);
-		}
+/* presence
+ *
+ *   instead of telling friends about every login and logout, the
+ *   presence thread compares user states with those it published last
+ *   every PRESENCE_INTERVAL_US and sends every user one message with
+ *   the changed slots of its friends. Changes undone within an
+ *   interval are never sent, and a change only costs the friends of
+ *   the user. A user who has just logged in, or whose friends have
+ *   changed, gets the slots of all its online friends first.
+ */
+#define PRESENCE_INTERVAL_US 200000
+
+// by presence thread only
+static struct {
+	int state;
+	int rid;             // registered index, -1 if nobody logged in
+	char user_name[USERNAME_SIZE];
+} presence[USER_CNT];
+static uint32_t presence_synced[USER_CNT];  // `presence_epoch` of session sent all slots
+
+int presence_state(int uid) {
+	return query_session_built(uid) ? sessions[uid].state : USER_STATE_NOT_LOGIN;
+}
+
+void presence_add(server_message_t *psm, int uid) {
+	int n = 0;
+	// a slot changing hands within an interval is sent once
+	while(n < psm->nr_presence && psm->presence[n].slot != uid)
+		n ++;
+	if(n == psm->nr_presence)
+		psm->nr_presence ++;
+
+	psm->presence[n].slot = uid;
+	psm->presence[n].user_state = presence[uid].state;
+	strncpy(psm->presence[n].user_name, presence[uid].user_name, USERNAME_SIZE - 1);
+}
+
+// add slot `uid` to the diffs of online friends of `rid`, caller holds friends_lock
+void presence_to_friends(server_message_t *diffs, int uid, int rid) {
+	struct adjacency_t *adj = &friend_graph[rid].friends;
+	for(int i = 0; i < adj->nr; i++) {
+		int friend_id = online_uid(adj->rids[i]);
+		if(friend_id >= 0)
+			presence_add(&diffs[friend_id], uid);
 	}
-	else
-	{
-		int friend_id=find_uid_by_user_name(pcm->user_name);
-		if(friend_id==-1||friend_id==uid)
-		{
-			logi("user %d:%s fails to speak to '%s':\"%s\"\n",uid,sessions[uid].user_name,pcm->user_name,pcm->message);
-		}
-		else
-		{
-			logi("uiser %d:%s speaks to %d:%s : \"%s\"\n",uid,sessions[uid].user_name,friend_id,pcm->user_name,pcm->message);
-			wrap_send(sessions[friend_id].conn,&sm);
-		}
+}
+
+// all slots of online friends of `uid`, caller holds friends_lock
+void presence_all(server_message_t *psm, int uid) {
+	struct adjacency_t *adj = &friend_graph[sessions[uid].rid].friends;
+	for(int i = 0; i < adj->nr; i++) {
+		int friend_id = online_uid(adj->rids[i]);
+		if(friend_id >= 0 && presence[friend_id].rid == adj->rids[i])
+			presence_add(psm, friend_id);
 	}
-	return 0;
 }
 
-int client_command_accept_battle(int uid) {
-	log("user %s accept battle #%d\n", sessions[uid].user_name, sessions[uid].bid);
+void *presence_publisher(void *args) {
+	static server_message_t diffs[USER_CNT];
+	int nr_changed;
+	log("presence publisher\n");
 
-	if(sessions[uid].state == USER_STATE_BATTLE) {
-		logi("already in battle\n");
-		send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
-	}else if(sessions[uid].state == USER_STATE_WAIT_TO_BATTLE) {
-		int inviter_id = sessions[uid].inviter_id;
-		int bid = sessions[uid].bid;
+	for(int i = 0; i < USER_CNT; i++)
+		presence[i].rid = -1;
 
-		if(battles[bid].is_alloced) {
-			send_to_client_with_username(inviter_id, SERVER_MESSAGE_FRIEND_ACCEPT_BATTLE, sessions[inviter_id].user_name);
-			user_join_battle(bid, uid);
-			logi("accept success\n");
-		}else{
-			logi("user %s accept battle which didn't exist\n", sessions[uid].user_name);
-			send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
+	while(1) {
+		usleep(PRESENCE_INTERVAL_US);
+		pthread_rwlock_rdlock(&state_lock);
+
+		memset(diffs, 0, sizeof(diffs));
+		nr_changed = 0;
+
+		pthread_mutex_lock(&friends_lock);
+		for(int i = 0; i < USER_CNT; i++) {
+			int state = presence_state(i);
+			int rid = state == USER_STATE_NOT_LOGIN ? -1 : sessions[i].rid;
+			if(state == presence[i].state && rid == presence[i].rid)
+				continue;
+
+			// friends of whom left the slot see it logout
+			if(presence[i].rid >= 0 && presence[i].rid != rid) {
+				presence[i].state = USER_STATE_NOT_LOGIN;
+				presence_to_friends(diffs, i, presence[i].rid);
+			}
+
+			presence[i].state = state;
+			presence[i].rid = rid;
+			if(rid >= 0) {
+				strncpy(presence[i].user_name, sessions[i].user_name, USERNAME_SIZE - 1);
+				presence_to_friends(diffs, i, rid);
+			}
+			nr_changed ++;
 		}
 
-	}else{
-		logi("hasn't been invited\n");
-		send_to_client(uid, SERVER_RESPONSE_NOBODY_INVITE_YOU);
-	}
+		for(int i = 0; i < USER_CNT; i++) {
+			if(!query_session_built(i) || presence_synced[i] == sessions[i].presence_epoch)
+				continue;
 
-	return 0;
-}
+			presence_synced[i] = sessions[i].presence_epoch;
+			memset(&diffs[i], 0, sizeof(server_message_t));
+			diffs[i].presence_reset = true;
+			presence_all(&diffs[i], i);
+		}
+		pthread_mutex_unlock(&friends_lock);
 
-int client_command_reject_battle(int uid) {
-	log("user %s reject battle #%d\n", sessions[uid].user_name, sessions[uid].bid);
-	if(sessions[uid].state == USER_STATE_BATTLE) {
-		logi("user already in battle\n");
-		send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
-	}else if(sessions[uid].state == USER_STATE_WAIT_TO_BATTLE) {
-		logi("reject success\n");
-		int bid = sessions[uid].bid;
-		send_to_client(sessions[uid].inviter_id, SERVER_MESSAGE_FRIEND_REJECT_BATTLE);
-		sessions[uid].state = USER_STATE_LOGIN;
-		battles[bid].users[uid].battle_state = BATTLE_STATE_UNJOINED;
-	}else{
-		logi("hasn't been invited\n");
-		send_to_client(uid, SERVER_RESPONSE_NOBODY_INVITE_YOU);
+		for(int i = 0; i < USER_CNT; i++) {
+			if(!query_session_built(i) || sessions[i].conn < 0)
+				continue;
+
+			if(diffs[i].presence_reset || diffs[i].nr_presence > 0) {
+				diffs[i].message = SERVER_MESSAGE_PRESENCE;
+				wrap_send(sessions[i].conn, &diffs[i]);
+			}
+		}
+
+		pthread_rwlock_unlock(&state_lock);
+		if(nr_changed > 0)
+			logi("presence of %d users changed\n", nr_changed);
 	}
-	return 0;
+	return NULL;
 }
 
-int client_command_quit(int uid) {
-	int conn = sessions[uid].conn;
-	if(sessions[uid].state == USER_STATE_BATTLE
-	|| sessions[uid].state == USER_STATE_WAIT_TO_BATTLE) {
-		log("user %d@%s tries to quit client was in battle\n", uid, sessions[uid].user_name);
-		user_quit_battle(sessions[uid].bid, uid);
-	}
+/* chat
+ *
+ *   a message is published to a channel: global to all logged in
+ *   users, one per battle to its users, or direct to one user. It is
+ *   built once into a reference counted message and queued, the chat
+ *   thread fans it out so the sender never waits on subscribers.
+ *   Subscribers of a channel are derived from user state when the
+ *   message goes out. The chat thread owns the history of the last
+ *   CHAT_HISTORY_SIZE messages of global and battle channels, replayed
+ *   to users logging in or joining the battle later.
+ *
+ *   a subscriber gets its messages through an outbox of its own, which
+ *   the chat thread sends from only while the connection takes them
+ *   without waiting, see try_send_iov(). A subscriber that doesn't read
+ *   holds up nobody else, its outbox fills up and overflows.
+ *
+ *   a sender may publish CHAT_BURST messages at once and then one per
+ *   CHAT_INTERVAL_US. A message over the limit, or finding the queue
+ *   full, is dropped and the sender gets SERVER_RESPONSE_CHAT_THROTTLED.
+ *   The last CHAT_RESERVED slots of the queue are kept for replays.
+ *   Nothing waits on the chat thread: a replay finding the queue full
+ *   is dropped too, and a reset only bumps the epoch of the channel,
+ *   messages published before are neither sent nor kept.
+ */
+#define CHAT_QUEUE_SIZE 256
+#define CHAT_RESERVED 32
+#define CHAT_HISTORY_SIZE 16
+#define CHAT_INTERVAL_US 200000
+#define CHAT_BURST 5
+#define CHAT_OUTBOX_SIZE 64
+#define CHAT_FLUSH_US 10000  // retry of outboxes waiting on their connections
+#define NR_CHAT_CHANNELS (1 + USER_CNT)
+
+enum {
+	CHAT_JOB_PUBLISH,
+	CHAT_JOB_REPLAY,
+};
 
-	sessions[uid].conn = -1;
-	log("user %d@%s quit\n", uid, sessions[uid].user_name);
+typedef struct chat_msg_t {
+	atomic_int refs;
+	int from;            // uid of sender
+	int to;              // uid of direct message
+	uint32_t epoch;      // of the channel when published
+	server_message_t sm;
+} chat_msg_t;
+
+struct chat_job_t {
+	int kind;
+	int channel;
+	int uid;             // to replay to
+	chat_msg_t *msg;
+};
+
+static struct chat_job_t chat_queue[CHAT_QUEUE_SIZE];
+static int chat_queue_head = 0;
+static int chat_queue_len = 0;
+static pthread_mutex_t chat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chat_nonempty = PTHREAD_COND_INITIALIZER;
+
+// bumped by chat_reset()
+static atomic_uint chat_epochs[NR_CHAT_CHANNELS];
+
+// by chat thread only
+static struct {
+	chat_msg_t *history[CHAT_HISTORY_SIZE];
+	int nr_history;
+	int next;            // slot of the next message
+	uint32_t epoch;      // of the history
+} chat_channels[NR_CHAT_CHANNELS];
+
+static struct {
+	struct {
+		chat_msg_t *msg;
+		int replayed;
+	} queue[CHAT_OUTBOX_SIZE];
+	int head, len;
+} chat_outboxes[USER_CNT];
+
+void chat_msg_put(chat_msg_t *msg) {
+	if(atomic_fetch_sub(&msg->refs, 1) == 1)
+		free(msg);
+}
+
+/* return -1 if the queue is full */
+int chat_enqueue(struct chat_job_t *job) {
+	int limit = CHAT_QUEUE_SIZE;
+	if(job->kind == CHAT_JOB_PUBLISH)
+		limit -= CHAT_RESERVED;
+
+	pthread_mutex_lock(&chat_lock);
+	if(chat_queue_len >= limit) {
+		pthread_mutex_unlock(&chat_lock);
+		return -1;
+	}
+
+	chat_queue[(chat_queue_head + chat_queue_len) % CHAT_QUEUE_SIZE] = *job;
+	chat_queue_len ++;
+	pthread_cond_signal(&chat_nonempty);
+	pthread_mutex_unlock(&chat_lock);
+	return 0;
+}
+
+void chat_replay(int channel, int uid) {
+	struct chat_job_t job = {CHAT_JOB_REPLAY, channel, uid, NULL};
+	if(chat_enqueue(&job) < 0)
+		loge("chat queue is full, drop replay to user %d\n", uid);
+}
+
+void chat_reset(int channel) {
+	atomic_fetch_add(&chat_epochs[channel], 1);
+}
+
+int chat_subscribed(int channel, int uid) {
+	if(channel == CHAT_CHANNEL_GLOBAL)
+		return query_session_built(uid);
+
+	int bid = channel - CHAT_CHANNEL_OF_BATTLE(0);
+	return sessions[uid].state == USER_STATE_BATTLE
+		&& sessions[uid].bid == bid
+		&& battles[bid].users[uid].battle_state != BATTLE_STATE_UNJOINED;
+}
+
+// whether `msg` is older than the latest reset of its channel
+int chat_stale(int channel, chat_msg_t *msg) {
+	return channel != CHAT_CHANNEL_DIRECT
+		&& msg->epoch != atomic_load(&chat_epochs[channel]);
+}
+
+// drop history from before the latest reset of `channel`
+void chat_sync_epoch(int channel) {
+	uint32_t epoch = atomic_load(&chat_epochs[channel]);
+	if(chat_channels[channel].epoch != epoch) {
+		chat_clear_history(channel);
+		chat_channels[channel].epoch = epoch;
+	}
+}
+
+void chat_post(int uid, chat_msg_t *msg, int replayed) {
+	if(sessions[uid].conn < 0)
+		return;
+
+	if(chat_outboxes[uid].len == CHAT_OUTBOX_SIZE) {
+		logi("outbox of user %d is full, drop chat\n", uid);
+		return;
+	}
+	int n = (chat_outboxes[uid].head + chat_outboxes[uid].len ++) % CHAT_OUTBOX_SIZE;
+	chat_outboxes[uid].queue[n].msg = msg;
+	chat_outboxes[uid].queue[n].replayed = replayed;
+	atomic_fetch_add(&msg->refs, 1);
+}
+
+// send what the connection of `uid` takes now, return what is left
+int chat_flush(int uid) {
+	int conn = sessions[uid].conn;
+	while(chat_outboxes[uid].len > 0) {
+		int n = chat_outboxes[uid].head;
+		chat_msg_t *msg = chat_outboxes[uid].queue[n].msg;
+
+		if(conn < 0) {
+			chat_msg_put(msg);
+			chat_outboxes[uid].head = (n + 1) % CHAT_OUTBOX_SIZE;
+			chat_outboxes[uid].len --;
+			continue;
+		}
+
+		server_message_t sm = msg->sm;
+		sm.replayed = chat_outboxes[uid].queue[n].replayed;
+		uint8_t header[FRAME_HEADER_SIZE] = {sizeof(sm) & 0xff, sizeof(sm) >> 8};
+		struct iovec iov[2] = {
+			{header, sizeof(header)},
+			{&sm, sizeof(sm)},
+		};
+		if(!try_send_iov(conn, iov, 2, sizeof(header) + sizeof(sm)))
+			break;
+
+		chat_msg_put(msg);
+		chat_outboxes[uid].head = (n + 1) % CHAT_OUTBOX_SIZE;
+		chat_outboxes[uid].len --;
+	}
+	return chat_outboxes[uid].len;
+}
+
+void chat_fan_out(int channel, chat_msg_t *msg) {
+	if(channel == CHAT_CHANNEL_DIRECT) {
+		chat_post(msg->to, msg, false);
+		return;
+	}
+
+	for(int i = 0; i < USER_CNT; i++) {
+		if(i != msg->from && chat_subscribed(channel, i))
+			chat_post(i, msg, false);
+	}
+}
+
+void chat_keep(int channel, chat_msg_t *msg) {
+	if(channel == CHAT_CHANNEL_DIRECT) {
+		chat_msg_put(msg);
+		return;
+	}
+
+	chat_sync_epoch(channel);
+	chat_msg_t **slot = &chat_channels[channel].history[chat_channels[channel].next];
+	if(*slot)
+		chat_msg_put(*slot);
+	*slot = msg;
+	chat_channels[channel].next = (chat_channels[channel].next + 1) % CHAT_HISTORY_SIZE;
+	if(chat_channels[channel].nr_history < CHAT_HISTORY_SIZE)
+		chat_channels[channel].nr_history ++;
+}
+
+void chat_send_history(int channel, int uid) {
+	chat_sync_epoch(channel);
+	int n = chat_channels[channel].nr_history;
+	for(int i = 0; i < n; i++) {
+		int slot = (chat_channels[channel].next - n + i + CHAT_HISTORY_SIZE) % CHAT_HISTORY_SIZE;
+		chat_post(uid, chat_channels[channel].history[slot], true);
+	}
+	if(n > 0)
+		logi("replay %d messages of chat channel %d to user %d@%s\n",
+				n, channel, uid, sessions[uid].user_name);
+}
+
+void chat_clear_history(int channel) {
+	for(int i = 0; i < CHAT_HISTORY_SIZE; i++) {
+		if(chat_channels[channel].history[i]) {
+			chat_msg_put(chat_channels[channel].history[i]);
+			chat_channels[channel].history[i] = NULL;
+		}
+	}
+	chat_channels[channel].nr_history = 0;
+	chat_channels[channel].next = 0;
+}
+
+void *chat_dispatcher(void *args) {
+	log("chat dispatcher\n");
+
+	int nr_waiting = 0;   // outboxes waiting on their connections
+	while(1) {
+		struct chat_job_t job;
+		int has_job = false;
+
+		pthread_mutex_lock(&chat_lock);
+		if(chat_queue_len == 0 && nr_waiting == 0)
+			pthread_cond_wait(&chat_nonempty, &chat_lock);
+		if(chat_queue_len == 0 && nr_waiting > 0) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += CHAT_FLUSH_US * 1000;
+			if(ts.tv_nsec >= 1000000000) {
+				ts.tv_sec ++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&chat_nonempty, &chat_lock, &ts);
+		}
+		if(chat_queue_len > 0) {
+			job = chat_queue[chat_queue_head];
+			chat_queue_head = (chat_queue_head + 1) % CHAT_QUEUE_SIZE;
+			chat_queue_len --;
+			has_job = true;
+		}
+		pthread_mutex_unlock(&chat_lock);
+
+		pthread_rwlock_rdlock(&state_lock);
+		if(has_job && job.kind == CHAT_JOB_PUBLISH) {
+			if(chat_stale(job.channel, job.msg)) {
+				chat_msg_put(job.msg);
+			}else{
+				chat_fan_out(job.channel, job.msg);
+				chat_keep(job.channel, job.msg);
+			}
+		}else if(has_job && job.kind == CHAT_JOB_REPLAY) {
+			chat_send_history(job.channel, job.uid);
+		}
+
+		nr_waiting = 0;
+		for(int i = 0; i < USER_CNT; i++) {
+			if(chat_outboxes[i].len > 0 && chat_flush(i) > 0)
+				nr_waiting ++;
+		}
+		pthread_rwlock_unlock(&state_lock);
+	}
+	return NULL;
+}
+
+/* return -1 if the sender is throttled */
+int chat_publish(int uid, int channel, int to, const char *text) {
+	int64_t now = now_us();
+	int64_t tat = sessions[uid].chat_tat > now ? sessions[uid].chat_tat : now;
+	if(tat - now > (CHAT_BURST - 1) * CHAT_INTERVAL_US)
+		return -1;
+
+	chat_msg_t *msg = calloc(1, sizeof(chat_msg_t));
+	if(!msg) return -1;
+	atomic_init(&msg->refs, 1);
+	msg->from = uid;
+	msg->to = to;
+	if(channel != CHAT_CHANNEL_DIRECT)
+		msg->epoch = atomic_load(&chat_epochs[channel]);
+	msg->sm.message = SERVER_MESSAGE_FRIEND_MESSAGE;
+	strncpy(msg->sm.from_user, sessions[uid].user_name, USERNAME_SIZE - 1);
+	strncpy(msg->sm.msg, text, MSG_SIZE - 1);
+	if(channel == CHAT_CHANNEL_GLOBAL)
+		msg->sm.channel = CHAT_GLOBAL;
+	else if(channel == CHAT_CHANNEL_DIRECT)
+		msg->sm.channel = CHAT_DIRECT;
+	else
+		msg->sm.channel = CHAT_BATTLE;
+
+	struct chat_job_t job = {CHAT_JOB_PUBLISH, channel, -1, msg};
+	if(chat_enqueue(&job) < 0) {
+		free(msg);
+		return -1;
+	}
+
+	sessions[uid].chat_tat = tat + CHAT_INTERVAL_US;
+	return 0;
+}
+
+void publish_or_throttle(int uid, int channel, int to) {
+	client_message_t *pcm = &sessions[uid].cm;
+	pcm->message[MSG_SIZE - 1] = 0;
+	if(chat_publish(uid, channel, to, pcm->message) < 0) {
+		logi("user %d@%s is throttled\n", uid, sessions[uid].user_name);
+		send_to_client(uid, SERVER_RESPONSE_CHAT_THROTTLED);
+	}
+}
+
+int client_command_send_message(int uid) {
+	client_message_t *pcm = &sessions[uid].cm;
+	if(!query_session_built(uid)) {
+		send_to_client(uid, SERVER_RESPONSE_YOU_HAVE_NOT_LOGIN);
+		return 0;
+	}
+
+	if(pcm->user_name[0] == '\0') {
+		logi("user %d@%s yells: %s\n", uid, sessions[uid].user_name, pcm->message);
+		publish_or_throttle(uid, CHAT_CHANNEL_GLOBAL, -1);
+		return 0;
+	}
+
+	int friend_id = find_uid_by_user_name(pcm->user_name);
+	if(friend_id == -1 || friend_id == uid) {
+		logi("user %d@%s fails to speak to '%s'\n", uid, sessions[uid].user_name, pcm->user_name);
+		send_to_client_with_username(uid, SERVER_MESSAGE_FRIEND_NOT_LOGIN, pcm->user_name);
+	}else{
+		logi("user %d@%s speaks to %d@%s: %s\n", uid, sessions[uid].user_name,
+				friend_id, sessions[friend_id].user_name, pcm->message);
+		publish_or_throttle(uid, CHAT_CHANNEL_DIRECT, friend_id);
+	}
+	return 0;
+}
+
+int client_command_battle_message(int uid) {
+	client_message_t *pcm = &sessions[uid].cm;
+	if(sessions[uid].state != USER_STATE_BATTLE) {
+		send_to_client(uid, SERVER_RESPONSE_YOURE_NOT_IN_BATTLE);
+		return 0;
+	}
+
+	logi("user %d@%s says in battle #%d: %s\n", uid, sessions[uid].user_name,
+			sessions[uid].bid, pcm->message);
+	publish_or_throttle(uid, CHAT_CHANNEL_OF_BATTLE(sessions[uid].bid), -1);
+	return 0;
+}
+
+int client_command_accept_battle(int uid) {
+	log("user %s accept battle #%d\n", sessions[uid].user_name, sessions[uid].bid);
+
+	if(sessions[uid].state == USER_STATE_BATTLE) {
+		logi("already in battle\n");
+		send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
+	}else if(sessions[uid].state == USER_STATE_WAIT_TO_BATTLE) {
+		int inviter_id = sessions[uid].inviter_id;
+		int bid = sessions[uid].bid;
+
+		if(battles[bid].is_alloced) {
+			send_to_client_with_username(inviter_id, SERVER_MESSAGE_FRIEND_ACCEPT_BATTLE, sessions[inviter_id].user_name);
+			user_join_battle(bid, uid);
+			logi("accept success\n");
+		}else{
+			logi("user %s accept battle which didn't exist\n", sessions[uid].user_name);
+			send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
+		}
+
+	}else{
+		logi("hasn't been invited\n");
+		send_to_client(uid, SERVER_RESPONSE_NOBODY_INVITE_YOU);
+	}
+
+	return 0;
+}
+
+int client_command_reject_battle(int uid) {
+	log("user %s reject battle #%d\n", sessions[uid].user_name, sessions[uid].bid);
+	if(sessions[uid].state == USER_STATE_BATTLE) {
+		logi("user already in battle\n");
+		send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
+	}else if(sessions[uid].state == USER_STATE_WAIT_TO_BATTLE) {
+		logi("reject success\n");
+		int bid = sessions[uid].bid;
+		send_to_client(sessions[uid].inviter_id, SERVER_MESSAGE_FRIEND_REJECT_BATTLE);
+		sessions[uid].state = USER_STATE_LOGIN;
+		battles[bid].users[uid].battle_state = BATTLE_STATE_UNJOINED;
+	}else{
+		logi("hasn't been invited\n");
+		send_to_client(uid, SERVER_RESPONSE_NOBODY_INVITE_YOU);
+	}
+	return 0;
+}
+
+void close_local_channel(int conn) {
+	if(conn < 0 || conn >= MAX_CHANNEL_FD) return;
+
+	pthread_mutex_lock(&local_channels_lock);
+	struct local_channel_t *lc = local_channels[conn];
+	if(lc) {
+		local_channels[conn] = NULL;
+		// wait for the sender in progress
+		pthread_mutex_lock(&lc->lock);
+		pthread_mutex_unlock(&lc->lock);
+	}
+	pthread_mutex_unlock(&local_channels_lock);
+
+	if(lc) {
+		log("close shared memory channel of conn %d\n", conn);
+		shm_channel_close(&lc->ep);
+		pthread_mutex_destroy(&lc->lock);
+		free(lc);
+	}
+}
+
+int client_command_shm_channel(int uid) {
+	int conn = sessions[uid].conn;
+	log("user %d tries to open shared memory channel\n", uid);
+
+	struct local_channel_t *lc = calloc(1, sizeof(struct local_channel_t));
+	if(!lc || nr_passed_fds != SHM_NR_FDS || conn >= MAX_CHANNEL_FD
+	|| shm_channel_attach(&lc->ep, passed_fds) < 0) {
+		// the client waits for the reply on the channel, hang up
+		loge("fail to open shared memory channel of conn %d\n", conn);
+		free(lc);
+		return client_command_quit(uid);
+	}
+	nr_passed_fds = 0;
+	pthread_mutex_init(&lc->lock, NULL);
+
+	// frames are copied into the ring, zero-copy doesn't apply
+	pthread_mutex_lock(&zc_lock[uid]);
+	zc_release_all(&sessions[uid].zc);
+	sessions[uid].zc.enabled = false;
+	pthread_mutex_unlock(&zc_lock[uid]);
+
+	pthread_mutex_lock(&local_channels_lock);
+	local_channels[conn] = lc;
+	pthread_mutex_unlock(&local_channels_lock);
+
+	logi("shared memory channel of conn %d is open\n", conn);
+	send_to_client(uid, SERVER_RESPONSE_SHM_CHANNEL_READY);
+	return 0;
+}
+
+/* the user leaves for good, by quitting or when the session of its
+ * dropped connection expires */
+void session_leave(int uid) {
+	pthread_mutex_lock(&match_lock);
+	match_dequeue(uid);
+	pthread_mutex_unlock(&match_lock);
+
+	if(sessions[uid].state == USER_STATE_BATTLE
+	|| sessions[uid].state == USER_STATE_WAIT_TO_BATTLE) {
+		log("user %d@%s leaves while in battle\n", uid, sessions[uid].user_name);
+		user_quit_battle(sessions[uid].bid, uid);
+	}
+
+	if(query_session_built(uid))
+		user_index_del(uid);
+	session_unwatch(uid);
 	sessions[uid].state = USER_STATE_UNUSED;
+}
+
+// close the connection of session `uid`, with its zero-copy and channel
+void session_disconnect(int uid) {
+	int conn = sessions[uid].conn;
+
+	pthread_mutex_lock(&zc_lock[uid]);
+	if(sessions[uid].zc.enabled) {
+		log("user %d@%s: %llu zero-copy sends, %llu copied by kernel\n",
+				uid, sessions[uid].user_name,
+				(unsigned long long)sessions[uid].zc.nr_sent,
+				(unsigned long long)sessions[uid].zc.nr_copied);
+		zc_release_all(&sessions[uid].zc);
+		sessions[uid].zc.enabled = false;
+	}
+	sessions[uid].conn = -1;
+	pthread_mutex_unlock(&zc_lock[uid]);
+
+	close_local_channel(conn);
 	close(conn);
+}
+
+int client_command_quit(int uid) {
+	session_disconnect(uid);
+
+	if(conn_dropped && query_session_built(uid)) {
+		log("connection of user %d@%s dropped, keep its session for %d ms\n",
+				uid, sessions[uid].user_name, RESUME_GRACE_MS);
+		pthread_mutex_lock(&sessions_lock);
+		sessions[uid].detached_at = now_us();
+		pthread_mutex_unlock(&sessions_lock);
+		session_watch(uid, sessions[uid].detached_at + (int64_t)RESUME_GRACE_MS * 1000);
+		return -1;
+	}
+
+	log("user %d@%s quit\n", uid, sessions[uid].user_name);
+	session_leave(uid);
 	return -1;
 }
 
+/* session resumption
+ *
+ *   a logged in user gets a random token, and when its connection
+ *   drops the session stays as it was, in battle or not, for
+ *   RESUME_GRACE_MS. The client connects again and sends the token
+ *   with CLIENT_COMMAND_RESUME_SESSION instead of logging in, the
+ *   connection is moved into the kept session and gets a new token,
+ *   the whole terrain of its battle and then snapshots as before. A
+ *   resuming client needs no free session of its own. Logging in
+ *   again by password ends a kept session at once.
+ */
+// under sessions_lock, which resume_session() and checkpoints read it with
+void new_resume_token(int uid) {
+	uint8_t token[RESUME_TOKEN_SIZE];
+	if(getrandom(token, RESUME_TOKEN_SIZE, 0) != RESUME_TOKEN_SIZE)
+		eprintf("fail to generate session token\n");
+
+	pthread_mutex_lock(&sessions_lock);
+	memcpy(sessions[uid].resume_token, token, RESUME_TOKEN_SIZE);
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+void send_session_token(int uid, int message) {
+	server_message_t sm;
+	memset(&sm, 0, sizeof(server_message_t));
+	sm.response = message;
+	memcpy(sm.session_token, sessions[uid].resume_token, RESUME_TOKEN_SIZE);
+	sm.session_state = sessions[uid].state;
+	wrap_send(sessions[uid].conn, &sm);
+}
+
+// end kept session `uid` if its connection dropped before `before`
+int session_expire(int uid, int64_t before) {
+	pthread_mutex_lock(&sessions_lock);
+	int expired = sessions[uid].detached_at && sessions[uid].detached_at <= before;
+	if(expired)
+		sessions[uid].detached_at = 0;
+	pthread_mutex_unlock(&sessions_lock);
+
+	if(expired) {
+		log("session of user %d@%s ends\n", uid, sessions[uid].user_name);
+		session_leave(uid);
+	}
+	return expired;
+}
+
+// move connection `conn` into the session kept for `token`, return its uid or -1
+int resume_session(int conn, const uint8_t *token) {
+	int uid = -1;
+	pthread_mutex_lock(&sessions_lock);
+	for(int i = 0; i < USER_CNT; i++) {
+		if(sessions[i].detached_at
+		&& memcmp(sessions[i].resume_token, token, RESUME_TOKEN_SIZE) == 0) {
+			sessions[i].detached_at = 0;
+			uid = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sessions_lock);
+	if(uid < 0) return -1;
+
+	pthread_mutex_lock(&zc_lock[uid]);
+	sessions[uid].conn = conn;
+	sessions[uid].thread = pthread_self();
+	if(zerocopy_min_bytes >= 0)
+		zc_init(&sessions[uid].zc, conn, payload_get, payload_put);
+	pthread_mutex_unlock(&zc_lock[uid]);
+
+	log("user %d@%s resumes its session\n", uid, sessions[uid].user_name);
+	sessions[uid].heard_at = now_us();
+	session_watch(uid, sessions[uid].heard_at + (int64_t)IDLE_TIMEOUT_MS * 1000);
+	new_resume_token(uid);
+	send_session_token(uid, SERVER_RESPONSE_SESSION_RESUMED);
+
+	pthread_mutex_lock(&friends_lock);
+	sessions[uid].presence_epoch ++;
+	pthread_mutex_unlock(&friends_lock);
+
+	if(sessions[uid].state == USER_STATE_BATTLE) {
+		send_terrain(sessions[uid].bid, uid);
+	}
+	return uid;
+}
+
+/* connection watchdog
+ *
+ *   a connection must send its first message within
+ *   HANDSHAKE_TIMEOUT_MS and then be heard from at least every
+ *   IDLE_TIMEOUT_MS, clients with nothing to say send heartbeats. Each
+ *   session has one timer on a timing wheel advanced by the watchdog
+ *   thread every WATCHDOG_TICK_US, so a tick costs the same however
+ *   many connections wait. Session threads only stamp `heard_at`, a
+ *   timer finding the deadline moved on is pushed back to it.
+ *
+ *   a dead connection is shut down and its session thread reads it as
+ *   closed, quitting as by a dropped connection. The timer of a kept
+ *   session ends it after RESUME_GRACE_MS. Sends block for at most
+ *   SEND_TIMEOUT_MS before the connection is shut down the same way.
+ */
+#define WATCHDOG_TICK_US 100000
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define SEND_TIMEOUT_MS 5000
+
+pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static timer_wheel_t watchdog;
+static tw_timer_t session_timers[USER_CNT];
+
+// expired on the current tick, under watchdog_lock
+static int expired_sessions[USER_CNT];
+static int nr_expired_sessions = 0;
+
+void session_timer_expired(void *arg) {
+	expired_sessions[nr_expired_sessions ++] = (int)(uintptr_t)arg;
+}
+
+void session_watch(int uid, int64_t deadline_us) {
+	pthread_mutex_lock(&watchdog_lock);
+	tw_add(&watchdog, &session_timers[uid], (deadline_us + WATCHDOG_TICK_US - 1) / WATCHDOG_TICK_US);
+	pthread_mutex_unlock(&watchdog_lock);
+}
+
+void session_unwatch(int uid) {
+	pthread_mutex_lock(&watchdog_lock);
+	tw_del(&session_timers[uid]);
+	pthread_mutex_unlock(&watchdog_lock);
+}
+
+// when session `uid` is due, 0 if never
+int64_t session_deadline(int uid) {
+	if(sessions[uid].detached_at)
+		return sessions[uid].detached_at + (int64_t)RESUME_GRACE_MS * 1000;
+	if(sessions[uid].state == USER_STATE_UNUSED)
+		return 0;
+	if(sessions[uid].heard_at == 0)
+		return sessions[uid].connected_at + (int64_t)HANDSHAKE_TIMEOUT_MS * 1000;
+	return sessions[uid].heard_at + (int64_t)IDLE_TIMEOUT_MS * 1000;
+}
+
+void session_check(int uid) {
+	int64_t now = now_us();
+	int64_t deadline = session_deadline(uid);
+	if(deadline == 0)
+		return;
+	if(deadline > now) {
+		session_watch(uid, deadline);
+		return;
+	}
+
+	if(sessions[uid].detached_at) {
+		session_expire(uid, now - (int64_t)RESUME_GRACE_MS * 1000);
+		return;
+	}
+
+	// zc_lock keeps the fd from being closed and reused meanwhile
+	pthread_mutex_lock(&zc_lock[uid]);
+	if(sessions[uid].conn >= 0) {
+		log("conn %d of session #%d timed out\n", sessions[uid].conn, uid);
+		shutdown(sessions[uid].conn, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&zc_lock[uid]);
+}
+
+void *session_watchdog(void *args) {
+	log("session watchdog\n");
+	while(1) {
+		usleep(WATCHDOG_TICK_US);
+		pthread_mutex_lock(&watchdog_lock);
+		nr_expired_sessions = 0;
+		tw_advance(&watchdog, now_us() / WATCHDOG_TICK_US);
+		int nr_expired = nr_expired_sessions;
+		pthread_mutex_unlock(&watchdog_lock);
+
+		// only this thread writes expired_sessions
+		pthread_rwlock_rdlock(&state_lock);
+		for(int i = 0; i < nr_expired; i++)
+			session_check(expired_sessions[i]);
+		pthread_rwlock_unlock(&state_lock);
+	}
+	return NULL;
+}
+
+void start_session_watchdog() {
+	pthread_t thread;
+	tw_init(&watchdog, now_us() / WATCHDOG_TICK_US);
+	for(int i = 0; i < USER_CNT; i++)
+		tw_timer_init(&session_timers[i], session_timer_expired, (void *)(uintptr_t)i);
+
+	if(pthread_create(&thread, NULL, session_watchdog, NULL) != 0) {
+		eprintf("fail to start session watchdog\n");
+	}
+}
+
+int client_command_heartbeat(int uid) {
+	send_to_client(uid, SERVER_RESPONSE_HEARTBEAT);
+	return 0;
+}
+
 int client_command_move_up(int uid) {
 	log("user %s move up\n", sessions[uid].user_name);
 	int bid = sessions[uid].bid;
@@ -842,7 +2855,7 @@ int client_command_move_down(int uid) {
 	log("user %s move down\n", sessions[uid].user_name);
 	int bid = sessions[uid].bid;
 	battles[bid].users[uid].dir = DIR_DOWN;
-	if(battles[bid].users[uid].pos.y < BATTLE_H - 1) {
+	if(battles[bid].users[uid].pos.y < battles[bid].h - 1) {
 		battles[bid].users[uid].pos.y ++;
 	}
 	return 0;
@@ -862,7 +2875,7 @@ int client_command_move_right(int uid) {
 	log("user %s move right\n", sessions[uid].user_name);
 	int bid = sessions[uid].bid;
 	battles[bid].users[uid].dir = DIR_RIGHT;
-	if(battles[bid].users[uid].pos.x < BATTLE_W - 1) {
+	if(battles[bid].users[uid].pos.x < battles[bid].w - 1) {
 		battles[bid].users[uid].pos.x ++;
 	}
 	return 0;
@@ -871,15 +2884,19 @@ int client_command_move_right(int uid) {
 int client_command_fire(int uid) {
 	log("user %s fire\n", sessions[uid].user_name);
 	int bid = sessions[uid].bid;
-	int item_id = get_unused_item(bid);
-	log("alloc item %d for bullet\n", item_id);
-	if(item_id == -1) return 0;
-
 	if(battles[bid].users[uid].nr_bullets <= 0) {
 		send_to_client(uid, SERVER_MESSAGE_YOUR_MAGAZINE_IS_EMPTY);
 		return 0;
 	}
 
+	pthread_mutex_lock(&items_lock[bid]);
+	int item_id = get_unused_item(bid);
+	log("alloc item %d for bullet\n", item_id);
+	if(item_id == -1) {
+		pthread_mutex_unlock(&items_lock[bid]);
+		return 0;
+	}
+
 	int dir = battles[bid].users[uid].dir;
 	int x = battles[bid].users[uid].pos.x;
 	int y = battles[bid].users[uid].pos.y;
@@ -890,6 +2907,8 @@ int client_command_fire(int uid) {
 	battles[bid].items[item_id].owner = uid;
 	battles[bid].items[item_id].pos.x = x;
 	battles[bid].items[item_id].pos.y = y;
+	place_item(bid, item_id);
+	pthread_mutex_unlock(&items_lock[bid]);
 
 	battles[bid].users[uid].nr_bullets --;
 
@@ -914,30 +2933,238 @@ static int(*handler[])(int) = {
 	[CLIENT_COMMAND_MOVE_LEFT] = client_command_move_left,
 	[CLIENT_COMMAND_MOVE_RIGHT] = client_command_move_right,
 	[CLIENT_COMMAND_FIRE] = client_command_fire,
+	[CLIENT_COMMAND_JOIN_MATCH] = client_command_join_match,
+	[CLIENT_COMMAND_LEAVE_MATCH] = client_command_leave_match,
+	[CLIENT_COMMAND_SHM_CHANNEL] = client_command_shm_channel,
+	[CLIENT_COMMAND_BATTLE_MESSAGE] = client_command_battle_message,
+	[CLIENT_COMMAND_ADD_FRIEND] = client_command_add_friend,
+	[CLIENT_COMMAND_ACCEPT_FRIEND] = client_command_accept_friend,
+	[CLIENT_COMMAND_REMOVE_FRIEND] = client_command_remove_friend,
+	[CLIENT_COMMAND_LIST_USERS] = client_command_list_users,
+	[CLIENT_COMMAND_HEARTBEAT] = client_command_heartbeat,
 };
 
-void wrap_recv(int conn, client_message_t *pcm) {
+void read_as_quit(client_message_t *pcm) {
+	memset(pcm, 0, sizeof(client_message_t));
+	pcm->command = CLIENT_COMMAND_USER_QUIT;
+	conn_dropped = true;
+}
+
+void close_passed_fds() {
+	for(int i = 0; i < nr_passed_fds; i++)
+		close(passed_fds[i]);
+	nr_passed_fds = 0;
+}
+
+/* sleep on the kick of the channel, the socket only tells hangup */
+void shm_wrap_recv(int conn, struct local_channel_t *lc, client_message_t *pcm) {
 	size_t total_len = 0;
 	while(total_len < sizeof(client_message_t)) {
-		size_t len = recv(conn, pcm + total_len, sizeof(client_message_t) - total_len, 0);
-		if(len < 0) {
-			loge("broken pipe\n");
+		if(total_len == 0)
+			park_for_upgrade(0);
+		size_t len = shm_recv(&lc->ep, (char *)pcm + total_len, sizeof(client_message_t) - total_len);
+		total_len += len;
+		if(len > 0) continue;
+
+		struct pollfd fds[2] = {
+			{lc->ep.rx_efd, POLLIN, 0},
+			{conn, POLLRDHUP, 0},
+		};
+		if(poll(fds, 2, -1) < 0)
+			continue;
+
+		if(fds[1].revents) {
+			read_as_quit(pcm);
+			return;
+		}
+		shm_clear_kick(&lc->ep);
+	}
+}
+
+/* an upgrade in progress stops session threads between messages,
+ * they go on if it fails */
+void park_for_upgrade(size_t total_len) {
+	if(!atomic_load(&upgrading) || my_uid < 0)
+		return;
+
+	sessions[my_uid].cm_len = total_len;
+	sessions[my_uid].stopped = SESSION_PARKED;
+	pthread_rwlock_rdlock(&state_lock);
+	sessions[my_uid].stopped = SESSION_RUNNING;
+	pthread_rwlock_unlock(&state_lock);
+}
+
+/* a closed or broken connection reads as CLIENT_COMMAND_USER_QUIT */
+/* read the rest of a message of which `total_len` bytes are read, a
+ * session thread parks before every read for an upgrade */
+void wrap_recv_rest(int conn, client_message_t *pcm, size_t total_len) {
+	while(total_len < sizeof(client_message_t)) {
+		park_for_upgrade(total_len);
+		ssize_t len = recv_with_fds(conn, (char *)pcm + total_len, sizeof(client_message_t) - total_len, passed_fds, &nr_passed_fds);
+		if(len < 0 && errno == EINTR)
+			continue;
+
+		if(len <= 0) {
+			if(len < 0) loge("broken pipe\n");
+			read_as_quit(pcm);
+			return;
 		}
 
 		total_len += len;
 	}
 }
 
-void wrap_send(int conn, server_message_t *psm) {
-	size_t total_len = 0;
-	while(total_len < sizeof(server_message_t)) {
-		size_t len = send(conn, psm + total_len, sizeof(server_message_t) - total_len, 0);
-		if(len < 0) {
+void wrap_recv(int conn, client_message_t *pcm) {
+	// only this thread closes the channel of `conn`
+	if(conn >= 0 && conn < MAX_CHANNEL_FD && local_channels[conn]) {
+		shm_wrap_recv(conn, local_channels[conn], pcm);
+		return;
+	}
+	wrap_recv_rest(conn, pcm, 0);
+}
+
+/* wait for the client while the ring is full */
+void shm_send_iov(int conn, struct local_channel_t *lc, struct iovec *iov, int iovcnt) {
+	int64_t deadline = now_us() + (int64_t)SEND_TIMEOUT_MS * 1000;
+	while(iovcnt > 0) {
+		size_t len = shm_send(&lc->ep, iov, iovcnt);
+		while(iovcnt > 0 && iov->iov_len == 0) {
+			iov ++;
+			iovcnt --;
+		}
+		if(len > 0 || iovcnt == 0)
+			continue;
+
+		// the ring is full, sleep until the client drains it
+		int64_t left_ms = (deadline - now_us()) / 1000;
+		int ret = left_ms > 0 ? shm_wait_room(&lc->ep, conn, left_ms) : 0;
+		if(ret < 0) {
 			loge("broken pipe\n");
+			return;
 		}
+		if(ret == 0) {
+			errno = EAGAIN;
+			send_failed(conn);
+			return;
+		}
+	}
+}
 
-		total_len += len;
+/* a connection that fails or stalls a send is shut down, the session
+ * thread reading it then quits as by a dropped connection */
+void send_failed(int conn) {
+	if(errno == EAGAIN || errno == EWOULDBLOCK)
+		loge("send to conn %d timed out\n", conn);
+	else
+		loge("broken pipe\n");
+	shutdown(conn, SHUT_RDWR);
+}
+
+/* send all of `iov`, which is advanced over partial writes */
+// under SEND_LOCK of `conn`
+void sendmsg_all(int conn, struct iovec *iov, int iovcnt) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while(msg.msg_iovlen > 0) {
+		ssize_t sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+		if(sent < 0) {
+			if(errno == EINTR)
+				continue;
+			send_failed(conn);
+			return;
+		}
+
+		while(msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov ++;
+			msg.msg_iovlen --;
+		}
+
+		if(msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+}
+
+#define CHANNEL_BUSY ((struct local_channel_t *)-1)
+
+/* channel of `conn` locked for sending, NULL if it has none, or
+ * CHANNEL_BUSY if another sender has it and `wait` is false */
+struct local_channel_t *lock_local_channel(int conn, int wait) {
+	if(conn >= MAX_CHANNEL_FD)
+		return NULL;
+
+	pthread_mutex_lock(&local_channels_lock);
+	struct local_channel_t *lc = local_channels[conn];
+	if(lc) {
+		if(wait)
+			pthread_mutex_lock(&lc->lock);
+		else if(pthread_mutex_trylock(&lc->lock) != 0)
+			lc = CHANNEL_BUSY;
 	}
+	pthread_mutex_unlock(&local_channels_lock);
+	return lc;
+}
+
+void send_iov(int conn, struct iovec *iov, int iovcnt) {
+	// session kept for resumption
+	if(conn < 0) return;
+
+	struct local_channel_t *lc = lock_local_channel(conn, true);
+	if(lc) {
+		shm_send_iov(conn, lc, iov, iovcnt);
+		pthread_mutex_unlock(&lc->lock);
+		return;
+	}
+
+	pthread_mutex_lock(SEND_LOCK(conn));
+	sendmsg_all(conn, iov, iovcnt);
+	pthread_mutex_unlock(SEND_LOCK(conn));
+}
+
+/* send `len` bytes of `iov` only if `conn` takes them without making
+ * us wait on it or on another sender, return false otherwise */
+int try_send_iov(int conn, struct iovec *iov, int iovcnt, size_t len) {
+	if(conn < 0) return true;
+
+	struct local_channel_t *lc = lock_local_channel(conn, false);
+	if(lc == CHANNEL_BUSY)
+		return false;
+	if(lc) {
+		int ok = shm_space(&lc->ep) >= len;
+		if(ok)
+			shm_send_iov(conn, lc, iov, iovcnt);
+		pthread_mutex_unlock(&lc->lock);
+		return ok;
+	}
+
+	if(pthread_mutex_trylock(SEND_LOCK(conn)) != 0)
+		return false;
+	struct pollfd pfd = {conn, POLLOUT, 0};
+	int ok = poll(&pfd, 1, 0) == 1;
+	if(ok)
+		sendmsg_all(conn, iov, iovcnt);
+	pthread_mutex_unlock(SEND_LOCK(conn));
+	return ok;
+}
+
+void send_frame(int conn, const void *payload, size_t len) {
+	assert(len <= MAX_FRAME_PAYLOAD);
+
+	uint8_t header[FRAME_HEADER_SIZE] = {len & 0xff, len >> 8};
+	struct iovec iov[2] = {
+		{header, sizeof(header)},
+		{(void *)payload, len},
+	};
+	send_iov(conn, iov, 2);
+}
+
+void wrap_send(int conn, server_message_t *psm) {
+	send_frame(conn, psm, sizeof(server_message_t));
 }
 
 void send_to_client(int uid, int message) {
@@ -958,36 +3185,133 @@ void send_to_client_with_username(int uid, int message, char *user_name) {
 }
 
 void close_session(int conn, int message) {
-	send_to_client(conn, message);
+	server_message_t sm;
+	memset(&sm, 0, sizeof(server_message_t));
+	sm.response = message;
+	wrap_send(conn, &sm);
 	close(conn);
 }
 
-void *session_start(void *args) {
-	int uid = -1;
-	int conn = (int)(uintptr_t)args;
-	client_message_t *pcm = NULL;
-	if((uid = get_unused_session()) < 0) {
-		close_session(conn, SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS);
-		return NULL;
-	}else{
-		sessions[uid].conn = conn;
-		pcm = &sessions[uid].cm;
-		memset(pcm, 0, sizeof(client_message_t));
-		log("build session #%d\n", uid);
+/* connection `conn` of session `uid`, which hasn't logged in, resumes
+ * a kept session, return the uid to serve from now on */
+int session_resume_command(int uid, int conn, client_message_t *pcm) {
+	int resumed = resume_session(conn, pcm->resume_token);
+	if(resumed < 0) {
+		log("conn %d presents an unknown session token\n", conn);
+		if(uid >= 0) {
+			send_to_client(uid, SERVER_RESPONSE_RESUME_FAIL);
+		}else{
+			server_message_t sm;
+			memset(&sm, 0, sizeof(server_message_t));
+			sm.response = SERVER_RESPONSE_RESUME_FAIL;
+			wrap_send(conn, &sm);
+		}
+		return uid;
+	}
+
+	if(uid >= 0) {
+		pthread_mutex_lock(&zc_lock[uid]);
+		if(sessions[uid].zc.enabled) {
+			zc_release_all(&sessions[uid].zc);
+			sessions[uid].zc.enabled = false;
+		}
+		sessions[uid].conn = -1;
+		pthread_mutex_unlock(&zc_lock[uid]);
+		session_unwatch(uid);
+		sessions[uid].state = USER_STATE_UNUSED;
 	}
+	return resumed;
+}
+
+/* serve session `uid` on `conn` until it closes, starting with the
+ * message already in its `cm` if `held` */
+/* `nr_held` bytes of the first message are in `cm` already, handed
+ * over by an upgrade */
+void session_serve(int uid, int conn, size_t nr_held) {
+	client_message_t *pcm = &sessions[uid].cm;
+	my_uid = uid;
+	sessions[uid].thread = pthread_self();
 
 	while(1) {
-		wrap_recv(conn, pcm);
-		if(pcm->command >= CLIENT_COMMAND_END)
+		if(nr_held < sizeof(client_message_t)) {
+			if(nr_held == 0)
+				wrap_recv(conn, pcm);
+			else
+				wrap_recv_rest(conn, pcm, nr_held);
+			sessions[uid].heard_at = now_us();
+			if(pcm->command >= CLIENT_COMMAND_END)
+				continue;
+		}
+		nr_held = 0;
+
+		// an upgrade meanwhile hands the message over
+		sessions[uid].stopped = SESSION_HOLDS_MESSAGE;
+		pthread_rwlock_rdlock(&state_lock);
+		sessions[uid].stopped = SESSION_RUNNING;
+
+		if(pcm->command == CLIENT_COMMAND_RESUME_SESSION) {
+			if(query_session_built(uid)) {
+				send_to_client(uid, SERVER_RESPONSE_YOU_HAVE_LOGINED);
+			}else{
+				uid = session_resume_command(uid, conn, pcm);
+				pcm = &sessions[uid].cm;
+				my_uid = uid;
+				sessions[uid].thread = pthread_self();
+			}
+			pthread_rwlock_unlock(&state_lock);
 			continue;
+		}
 
 		int ret_code = handler[pcm->command](uid);
+		close_passed_fds();
+		pthread_rwlock_unlock(&state_lock);
 		log("state of user '%s': %d\n", sessions[uid].user_name, sessions[uid].state);
 		if(ret_code < 0) {
 			log("close session #%d\n", uid);
 			break;
 		}
 	}
+	my_uid = -1;
+}
+
+void *session_start(void *args) {
+	int uid = -1;
+	int conn = (int)(uintptr_t)args;
+	client_message_t cm;
+
+	pthread_rwlock_rdlock(&state_lock);
+	if((uid = get_unused_session()) >= 0) {
+		sessions[uid].conn = conn;
+		sessions[uid].thread = pthread_self();
+		memset(&sessions[uid].cm, 0, sizeof(client_message_t));
+		if(zerocopy_min_bytes >= 0) {
+			pthread_mutex_lock(&zc_lock[uid]);
+			zc_init(&sessions[uid].zc, conn, payload_get, payload_put);
+			pthread_mutex_unlock(&zc_lock[uid]);
+		}
+		sessions[uid].connected_at = now_us();
+		session_watch(uid, sessions[uid].connected_at + (int64_t)HANDSHAKE_TIMEOUT_MS * 1000);
+		log("build session #%d\n", uid);
+	}
+	pthread_rwlock_unlock(&state_lock);
+
+	if(uid < 0) {
+		// a resuming client brings its session, in time
+		set_sock_timeout(conn, SO_RCVTIMEO, HANDSHAKE_TIMEOUT_MS);
+		wrap_recv(conn, &cm);
+		set_sock_timeout(conn, SO_RCVTIMEO, 0);
+
+		pthread_rwlock_rdlock(&state_lock);
+		if(cm.command == CLIENT_COMMAND_RESUME_SESSION)
+			uid = session_resume_command(-1, conn, &cm);
+		pthread_rwlock_unlock(&state_lock);
+		if(uid < 0) {
+			close_session(conn, SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS);
+			return NULL;
+		}
+	}
+
+	session_serve(uid, conn, 0);
 	return NULL;
 }
 
@@ -1003,14 +3327,19 @@ int server_start() {
 		eprintf("Create Socket Failed!\n");
 	}
 
+	// connections of a server just gone may linger in TIME_WAIT
+	int one = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+
 	struct sockaddr_in servaddr;
 	memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(PORT);
+    servaddr.sin_port = htons(server_port);
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
 	if(bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
-		eprintf("Can not bind to port %d!\n", PORT);
+		eprintf("Can not bind to port %d!\n", server_port);
 	}
 
 	if(listen(sockfd, USER_CNT) == -1) {
@@ -1020,6 +3349,70 @@ int server_start() {
 	return sockfd;
 }
 
+/* local clients and the gateway connect here */
+int unix_server_start(const char *path) {
+	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sockfd < 0) {
+		eprintf("Create Unix Socket Failed!\n");
+	}
+	fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		eprintf("Unix socket path '%s' is too long\n", path);
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		eprintf("Can not bind to '%s'!\n", path);
+	}
+
+	if(listen(sockfd, USER_CNT) == -1) {
+		eprintf("fail to listen on Unix socket.\n");
+	}
+
+	log("listen on Unix socket %s\n", path);
+	return sockfd;
+}
+
+void set_sock_timeout(int conn, int optname, int ms) {
+	struct timeval tv = {ms / 1000, ms % 1000 * 1000};
+	if(setsockopt(conn, SOL_SOCKET, optname, &tv, sizeof(tv)) == -1)
+		loge("fail to set timeout of conn %d\n", conn);
+}
+
+void accept_session(int listen_fd) {
+	pthread_t thread;
+	int conn = accept(listen_fd, NULL, NULL);
+	if(conn < 0) {
+		loge("fail to accept client.\n");
+		return;
+	}
+
+	struct sockaddr_in client_addr;
+	socklen_t length = sizeof(client_addr);
+	if(getpeername(conn, (struct sockaddr *)&client_addr, &length) == 0
+	&& client_addr.sin_family == AF_INET) {
+		log("connected by %s:%d, conn:%d\n", inet_ntoa(client_addr.sin_addr), client_addr.sin_port, conn);
+	}else{
+		log("connected by local client, conn:%d\n", conn);
+	}
+	set_sock_timeout(conn, SO_SNDTIMEO, SEND_TIMEOUT_MS);
+	// passed on by a hot upgrade, never inherited
+	fcntl(conn, F_SETFD, FD_CLOEXEC);
+
+	if(pthread_create(&thread, NULL, session_start, (void *)(uintptr_t)conn) != 0) {
+		loge("fail to create thread.\n");
+		close(conn);
+		return;
+	}
+	pthread_detach(thread);
+	logi("bind thread #%lu\n", thread);
+}
+
 void terminate_process(int recved_signal) {
 	for(int i = 0; i < USER_CNT; i++) {
 		if(sessions[i].conn >= 0) {
@@ -1033,6 +3426,12 @@ void terminate_process(int recved_signal) {
 		log("close server fd:%d\n", server_fd);
 	}
 
+	if(unix_server_fd >= 0) {
+		close(unix_server_fd);
+		unlink(unix_path);
+		log("close Unix server fd:%d\n", unix_server_fd);
+	}
+
 	pthread_mutex_destroy(&sessions_lock);
 	pthread_mutex_destroy(&battles_lock);
 	for(int i = 0; i < USER_CNT; i++) {
@@ -1040,38 +3439,865 @@ void terminate_process(int recved_signal) {
 	}
 
 	log("receive terminate signal and exit(0)\n");
+	log_shutdown();
 	exit(0);
 }
 
-int main() {
-	srand(time(NULL));
+/* battle images
+ *
+ *   a battle copied out of the process, for a hot upgrade or a
+ *   checkpoint. Chunks and events hold pointers, so terrain goes as a
+ *   list of cells and events by ticks left, both are rebuilt on load.
+ */
+struct battle_image_t {
+	struct battle_t battle;
+	int nr_cells;
+	struct {
+		pos_t pos;
+		uint8_t kind;
+		uint8_t magma_times;
+	} cells[MAX_TERRAIN];
+	int nr_events;
+	struct {
+		int kind;
+		pos_t pos;
+		int64_t ticks_left;
+	} events[MAX_BATTLE_EVENTS];
+};
+
+// under items_lock of `bid` unless the battle can't change
+void battle_save(int bid, struct battle_image_t *image) {
+	memcpy(&image->battle, &battles[bid], sizeof(struct battle_t));
+
+	image->nr_cells = 0;
+	for(int i = 0; i < CHUNK_HASH_SIZE; i++) {
+		for(struct chunk_t *chunk = battles[bid].chunks[i]; chunk; chunk = chunk->next) {
+			for(int c = 0; c < CHUNK_SIZE * CHUNK_SIZE; c++) {
+				if(chunk->terrain[c] == ITEM_NONE || image->nr_cells == MAX_TERRAIN)
+					continue;
+
+				int n = image->nr_cells ++;
+				image->cells[n].pos.x = (chunk->cx << CHUNK_SHIFT) | (c & (CHUNK_SIZE - 1));
+				image->cells[n].pos.y = (chunk->cy << CHUNK_SHIFT) | (c >> CHUNK_SHIFT);
+				image->cells[n].kind = chunk->terrain[c];
+				image->cells[n].magma_times = chunk->magma_times[c];
+			}
+		}
+	}
+
+	image->nr_events = 0;
+	for(int i = 0; i < MAX_BATTLE_EVENTS; i++) {
+		struct battle_event_t *ev = &battles[bid].event_pool[i];
+		if(!ev->is_used)
+			continue;
+
+		int n = image->nr_events ++;
+		image->events[n].kind = ev->kind;
+		image->events[n].pos = ev->pos;
+		image->events[n].ticks_left = (int64_t)(ev->timer.expires - battles[bid].ticks);
+	}
+}
+
+// into a free slot before the battle is launched
+void battle_load(int bid, const struct battle_image_t *image) {
+	struct battle_t *battle = &battles[bid];
+	memcpy(battle, &image->battle, sizeof(struct battle_t));
+	memset(battle->chunks, 0, sizeof(battle->chunks));
+	memset(&battle->terrain_out, 0, sizeof(terrain_batch_t));
+	battle->nr_chunks = 0;
+	battle->feed_ticks = 0;
+
+	for(int i = 0; i < image->nr_cells; i++) {
+		pos_t pos = image->cells[i].pos;
+		struct chunk_t *chunk = find_chunk(bid, pos, true);
+		chunk->terrain[CHUNK_CELL(pos)] = image->cells[i].kind;
+		chunk->magma_times[CHUNK_CELL(pos)] = image->cells[i].magma_times;
+		chunk->nr_terrain ++;
+	}
 
-	pthread_t thread;
+	for(int i = 0; i < MAX_ITEM; i++) {
+		if(battle->items[i].is_used)
+			place_item(bid, i);
+	}
+
+	battle_events_reset(bid, battle->ticks + 1);
+	for(int i = 0; i < image->nr_events; i++) {
+		int64_t left = image->events[i].ticks_left;
+		if(image->events[i].kind == EVENT_MAGMA_COOLS)
+			schedule_cell_event(bid, image->events[i].kind, image->events[i].pos, left > 0 ? left : 0);
+		else
+			battle_schedule(bid, image->events[i].kind, image->events[i].pos, left > 0 ? left : 0);
+	}
+}
+
+/* bring back a session saved with its connection `conn`, or as
+ * dropped if it is -1 */
+void session_load(int uid, const struct session_t *saved, int conn) {
+	struct session_t *session = &sessions[uid];
+	memcpy(session, saved, sizeof(struct session_t));
+	memset(&session->zc, 0, sizeof(zc_socket_t));
+	session->conn = conn;
+	if(conn >= 0 && zerocopy_min_bytes >= 0)
+		zc_init(&session->zc, conn, payload_get, payload_put);
+
+	if(conn < 0 && !session->detached_at) {
+		if(query_session_built(uid))
+			session->detached_at = now_us();
+		else
+			session->state = USER_STATE_UNUSED;
+	}
+	session->presence_epoch ++;
+}
+
+/* launch loaded battles and index and watch loaded sessions, return
+ * the number of sessions */
+int start_loaded(int *nr_battles) {
+	int nr_sessions = 0;
+	*nr_battles = 0;
+	for(int i = 0; i < USER_CNT; i++) {
+		if(battles[i].is_alloced) {
+			launch_battle(i);
+			(*nr_battles) ++;
+		}
+	}
+
+	for(int i = 0; i < USER_CNT; i++) {
+		if(sessions[i].state == USER_STATE_UNUSED)
+			continue;
+
+		if(query_session_built(i)) {
+			user_index_add(i);
+			if(sessions[i].rid >= 0)
+				session_of[sessions[i].rid] = i;
+		}
+		int64_t deadline = session_deadline(i);
+		if(deadline)
+			session_watch(i, deadline);
+		nr_sessions ++;
+	}
+	return nr_sessions;
+}
+
+/* hot upgrade
+ *
+ *   on SIGUSR2 the server executes its binary again, replaced by then,
+ *   with `-U <fd>` and hands itself over through that socket: listening
+ *   sockets and connections go by SCM_RIGHTS along with registered
+ *   users, sessions, the match queue and battles, which go on from the
+ *   tick they were at. Chat history is not carried over.
+ *
+ *   the old server is frozen meanwhile: it holds `state_lock` for
+ *   writing, which threads changing state or sending hold for reading,
+ *   and wakes session threads by SIGUSR1 to stop before their next
+ *   message, a message read but not handled yet is handed over too.
+ *   Shared memory channels can't be passed, their sessions are handed
+ *   over as dropped and their clients resume them. The old server exits
+ *   once the new one says it runs, and goes on as before if it doesn't.
+ *
+ *   records are raw structures, a new server built with other ones
+ *   refuses the handover by UPGRADE_VERSION and the size of records.
+ */
+#define UPGRADE_VERSION 1
+#define UPGRADE_MAGIC 0x55504752    // "UPGR"
+#define UPGRADE_STOP_TRIES 1000     // 1 ms apart
+
+enum {
+	UPGRADE_HELLO,       // listening sockets passed along
+	UPGRADE_REGISTRY,
+	UPGRADE_MATCHING,
+	UPGRADE_SESSION,     // its connection passed along, if any
+	UPGRADE_BATTLE,
+	UPGRADE_END,
+};
+
+struct upgrade_record_t {
+	uint32_t kind;
+	uint32_t index;      // uid or bid
+	union {
+		struct {
+			uint32_t magic;
+			uint32_t version;
+			uint32_t size;
+			int has_tcp, has_unix;
+		} hello;
+		struct {
+			int user_list_size;
+			uint8_t users[sizeof(registered_user_list)];
+			uint8_t friends[sizeof(friend_graph)];
+			rng_t battle_seeds;
+		} registry;
+		struct {
+			int len;
+			uint8_t queue[sizeof(match_queue)];
+		} matching;
+		struct session_t session;
+		struct battle_image_t battle;
+	};
+};
+
+static struct upgrade_record_t upgrade_record;
+
+// connected to the server being upgraded, see `-U` option
+static int upgrade_fd = -1;
+static char **saved_argv;
+static int upgrade_pipe[2] = {-1, -1};
+
+void on_upgrade_signal(int sig) {
+	char c = sig;
+	if(write(upgrade_pipe[1], &c, 1) < 0)
+		return;
+}
+
+// only interrupts a session thread blocked in recv()
+void on_wake_signal(int sig) {
+}
+
+int upgrade_send(int sock, int *fds, int nr_fds) {
+	if(nr_fds > 0)
+		return send_with_fds(sock, &upgrade_record, sizeof(upgrade_record), fds, nr_fds);
+	return send(sock, &upgrade_record, sizeof(upgrade_record), MSG_NOSIGNAL) == sizeof(upgrade_record) ? 0 : -1;
+}
+
+// return kind of the record read, -1 on error
+int upgrade_recv(int sock, int *fds, int *nr_fds) {
+	*nr_fds = 0;
+	ssize_t len = recv_with_fds(sock, &upgrade_record, sizeof(upgrade_record), fds, nr_fds);
+	if(len != sizeof(upgrade_record)) {
+		loge("bad record of upgrade: %zd bytes\n", len);
+		return -1;
+	}
+	if(upgrade_record.index >= USER_CNT)
+		return -1;
+	return upgrade_record.kind;
+}
+
+// wait for session threads to stop between messages, see session_serve()
+void stop_session_threads() {
+	for(int tries = 0; tries < UPGRADE_STOP_TRIES; tries++) {
+		int nr_running = 0;
+		for(int i = 0; i < USER_CNT; i++) {
+			if(sessions[i].state == USER_STATE_UNUSED || sessions[i].conn < 0
+			|| sessions[i].stopped != SESSION_RUNNING)
+				continue;
+			pthread_kill(sessions[i].thread, SIGUSR1);
+			nr_running ++;
+		}
+		if(nr_running == 0)
+			return;
+		usleep(1000);
+	}
+	loge("session threads don't stop, their next messages may be lost\n");
+}
+
+// hand the frozen state over to `sock`, return -1 on error
+int send_state(int sock) {
+	struct upgrade_record_t *r = &upgrade_record;
+	int fds[2], nr_fds = 0;
+
+	memset(r, 0, sizeof(struct upgrade_record_t));
+	r->kind = UPGRADE_HELLO;
+	r->hello.magic = UPGRADE_MAGIC;
+	r->hello.version = UPGRADE_VERSION;
+	r->hello.size = sizeof(struct upgrade_record_t);
+	if(server_fd) {
+		r->hello.has_tcp = true;
+		fds[nr_fds ++] = server_fd;
+	}
+	if(unix_server_fd >= 0) {
+		r->hello.has_unix = true;
+		fds[nr_fds ++] = unix_server_fd;
+	}
+	if(upgrade_send(sock, fds, nr_fds) < 0)
+		return -1;
+
+	memset(r, 0, sizeof(struct upgrade_record_t));
+	r->kind = UPGRADE_REGISTRY;
+	r->registry.user_list_size = user_list_size;
+	memcpy(r->registry.users, registered_user_list, sizeof(registered_user_list));
+	memcpy(r->registry.friends, friend_graph, sizeof(friend_graph));
+	r->registry.battle_seeds = battle_seeds;
+	if(upgrade_send(sock, NULL, 0) < 0)
+		return -1;
+
+	memset(r, 0, sizeof(struct upgrade_record_t));
+	r->kind = UPGRADE_MATCHING;
+	r->matching.len = match_queue_len;
+	memcpy(r->matching.queue, match_queue, sizeof(match_queue));
+	if(upgrade_send(sock, NULL, 0) < 0)
+		return -1;
 
-	if(signal(SIGINT, terminate_process) == SIG_ERR) {
+	for(int i = 0; i < USER_CNT; i++) {
+		if(sessions[i].state == USER_STATE_UNUSED)
+			continue;
+
+		memset(r, 0, sizeof(struct upgrade_record_t));
+		r->kind = UPGRADE_SESSION;
+		r->index = i;
+		memcpy(&r->session, &sessions[i], sizeof(struct session_t));
+
+		int conn = sessions[i].conn;
+		if(conn >= 0 && conn < MAX_CHANNEL_FD && local_channels[conn]) {
+			if(!query_session_built(i))
+				continue;
+			r->session.conn = conn = -1;
+			r->session.detached_at = now_us();
+		}
+		if(upgrade_send(sock, &conn, conn >= 0) < 0)
+			return -1;
+	}
+
+	for(int i = 0; i < USER_CNT; i++) {
+		if(!battles[i].is_alloced)
+			continue;
+
+		memset(r, 0, sizeof(struct upgrade_record_t));
+		r->kind = UPGRADE_BATTLE;
+		r->index = i;
+		battle_save(i, &r->battle);
+		if(upgrade_send(sock, NULL, 0) < 0)
+			return -1;
+	}
+
+	memset(r, 0, sizeof(struct upgrade_record_t));
+	r->kind = UPGRADE_END;
+	return upgrade_send(sock, NULL, 0);
+}
+
+// run the binary again as the server taking over on `sock`
+pid_t spawn_successor(int sock) {
+	char fd_arg[16];
+	char *argv[64];
+	int argc = 0;
+	for(int i = 0; saved_argv[i] && argc < 60; i++) {
+		if(strcmp(saved_argv[i], "-U") == 0 && saved_argv[i + 1]) {
+			i ++;
+			continue;
+		}
+		argv[argc ++] = saved_argv[i];
+	}
+	snprintf(fd_arg, sizeof(fd_arg), "%d", sock);
+	argv[argc ++] = "-U";
+	argv[argc ++] = fd_arg;
+	argv[argc] = NULL;
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		fcntl(sock, F_SETFD, 0);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+void hot_upgrade() {
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		loge("fail to create socket of upgrade\n");
+		return;
+	}
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+
+	log("upgrade to %s\n", saved_argv[0]);
+	pid_t pid = spawn_successor(sv[1]);
+	close(sv[1]);
+	if(pid < 0) {
+		loge("fail to run %s\n", saved_argv[0]);
+		close(sv[0]);
+		return;
+	}
+
+	int64_t st = now_us();
+	atomic_store(&upgrading, true);
+	pthread_rwlock_wrlock(&state_lock);
+	stop_session_threads();
+
+	char ok = 0;
+	if(send_state(sv[0]) == 0 && recv(sv[0], &ok, 1, 0) == 1 && ok) {
+		log("server %d took over in %lld us, bye\n", (int)pid, (long long)(now_us() - st));
+		log_shutdown();
+		exit(0);
+	}
+
+	loge("upgrade fails, go on serving\n");
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	close(sv[0]);
+	atomic_store(&upgrading, false);
+	pthread_rwlock_unlock(&state_lock);
+}
+
+/* take the state over from the server being upgraded on `sock`, no
+ * other thread runs yet, return -1 if it can't be */
+int take_over(int sock) {
+	struct upgrade_record_t *r = &upgrade_record;
+	int fds[SHM_NR_FDS], nr_fds;
+
+	if(upgrade_recv(sock, fds, &nr_fds) != UPGRADE_HELLO
+	|| r->hello.magic != UPGRADE_MAGIC
+	|| r->hello.version != UPGRADE_VERSION
+	|| r->hello.size != sizeof(struct upgrade_record_t)
+	|| nr_fds != r->hello.has_tcp + r->hello.has_unix) {
+		loge("refuse to take over a server of another version\n");
+		return -1;
+	}
+	server_fd = r->hello.has_tcp ? fds[0] : 0;
+	unix_server_fd = r->hello.has_unix ? fds[nr_fds - 1] : -1;
+
+	while(1) {
+		switch(upgrade_recv(sock, fds, &nr_fds)) {
+			case UPGRADE_REGISTRY:
+				user_list_size = r->registry.user_list_size;
+				memcpy(registered_user_list, r->registry.users, sizeof(registered_user_list));
+				memcpy(friend_graph, r->registry.friends, sizeof(friend_graph));
+				battle_seeds = r->registry.battle_seeds;
+				break;
+			case UPGRADE_MATCHING:
+				match_queue_len = r->matching.len;
+				memcpy(match_queue, r->matching.queue, sizeof(match_queue));
+				break;
+			case UPGRADE_SESSION:
+				session_load(r->index, &r->session, nr_fds > 0 ? fds[0] : -1);
+				break;
+			case UPGRADE_BATTLE:
+				battle_load(r->index, &r->battle);
+				break;
+			case UPGRADE_END:
+				return 0;
+			default:
+				return -1;
+		}
+	}
+}
+
+void *session_continue(void *args) {
+	int uid = (int)(uintptr_t)args;
+	struct session_t *session = &sessions[uid];
+
+	// a quit is read again from the connection itself
+	size_t nr_held = 0;
+	if(session->stopped == SESSION_HOLDS_MESSAGE
+	&& session->cm.command != CLIENT_COMMAND_USER_QUIT
+	&& session->cm.command < CLIENT_COMMAND_END)
+		nr_held = sizeof(client_message_t);
+	else if(session->stopped == SESSION_PARKED && session->cm_len < sizeof(client_message_t))
+		nr_held = session->cm_len;
+	session->stopped = SESSION_RUNNING;
+	session_serve(uid, session->conn, nr_held);
+	return NULL;
+}
+
+/* let the old server go, before anything here reads from what it
+ * handed over, it is killed if it gets no answer */
+void confirm_take_over(int sock) {
+	char ok = 1;
+	if(send(sock, &ok, 1, MSG_NOSIGNAL) != 1)
+		eprintf("server being upgraded is gone\n");
+	close(sock);
+}
+
+// start serving what was taken over
+void finish_take_over() {
+	int nr_battles;
+	int nr_sessions = start_loaded(&nr_battles);
+	for(int i = 0; i < USER_CNT; i++) {
+		pthread_t thread;
+		if(sessions[i].state != USER_STATE_UNUSED && sessions[i].conn >= 0) {
+			if(pthread_create(&thread, NULL, session_continue, (void *)(uintptr_t)i) != 0)
+				eprintf("fail to create thread.\n");
+			pthread_detach(thread);
+		}
+	}
+
+	log("took over %d sessions and %d battles\n", nr_sessions, nr_battles);
+}
+
+/* battle checkpoints
+ *
+ *   with `-c <file>` the simulation worker of a battle copies it into
+ *   the mapped file right after every `-k`th tick of it, along with the
+ *   sessions of its users, nothing else waits for that. A slot holds
+ *   two images and a sequence number telling the latest, which is
+ *   bumped only once the other image is written, so a crash meanwhile
+ *   leaves the former intact. Writes go to the page cache, they outlive
+ *   the process but not the machine.
+ *
+ *   a checkpoint is a full snapshot of its battle rather than what
+ *   changed since the last one: users and bullets move every tick, and
+ *   the rest, terrain and events, is bounded by MAX_TERRAIN, so an
+ *   image is about 20 KB copied once every `-k` ticks of the battle.
+ *   Raising `-k` trades that against ticks lost in a crash.
+ *
+ *   on startup battles found in the file go on from where they were
+ *   checkpointed and their users come back as dropped sessions, which
+ *   clients resume by their tokens, see resume_session(). Only names,
+ *   states, tokens, skills and salted password hashes of users are
+ *   kept, the file is readable by its owner only. Users gone from the
+ *   registry are registered again with their hashes and log in as
+ *   before. Friends are not kept.
+ */
+#define CHECKPOINT_MAGIC 0x54504b43    // "CKPT"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_TICKS 20            // a second
+
+struct checkpoint_image_t {
+	struct battle_image_t battle;
+	int nr_sessions;
+	struct {
+		int uid;
+		int state;
+		int registered;
+		int skill;
+		char user_name[USERNAME_SIZE];
+		uint8_t resume_token[RESUME_TOKEN_SIZE];
+		char hash[PASSWORD_HASH_SIZE];
+	} sessions[USER_CNT];
+};
+
+struct checkpoint_slot_t {
+	_Atomic uint64_t seq;      // images[seq & 1] is the latest, none if 0
+	char pad[56];
+	struct checkpoint_image_t images[2];
+};
+
+struct checkpoint_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t image_size;
+	uint32_t nr_slots;
+	char pad[48];
+	struct checkpoint_slot_t slots[USER_CNT];
+};
+
+static struct checkpoint_t *checkpoint = NULL;
+
+// see `-k` option
+static int checkpoint_ticks = CHECKPOINT_TICKS;
+
+/* map the checkpoint file at `path`, created if missing, slots are
+ * emptied if it was written by another version */
+struct checkpoint_t *checkpoint_open(const char *path) {
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	struct stat st;
+	if(fd == -1 || fchmod(fd, 0600) == -1 || fstat(fd, &st) == -1) {
+		loge("fail to open checkpoint file %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if(st.st_size != sizeof(struct checkpoint_t)
+	&& (ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(struct checkpoint_t)) == -1)) {
+		loge("fail to resize checkpoint file %s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	struct checkpoint_t *cp = mmap(NULL, sizeof(struct checkpoint_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(cp == MAP_FAILED) {
+		loge("fail to map checkpoint file %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if(cp->magic != CHECKPOINT_MAGIC
+	|| cp->version != CHECKPOINT_VERSION
+	|| cp->image_size != sizeof(struct checkpoint_image_t)
+	|| cp->nr_slots != USER_CNT) {
+		log("checkpoint file %s is new or of another version\n", path);
+		for(int i = 0; i < USER_CNT; i++)
+			atomic_store(&cp->slots[i].seq, 0);
+		cp->magic = CHECKPOINT_MAGIC;
+		cp->version = CHECKPOINT_VERSION;
+		cp->image_size = sizeof(struct checkpoint_image_t);
+		cp->nr_slots = USER_CNT;
+	}
+	return cp;
+}
+
+// by the worker of `bid` after its tick
+void checkpoint_battle(int bid) {
+	if(!checkpoint || battles[bid].ticks % checkpoint_ticks != 0)
+		return;
+
+	struct checkpoint_slot_t *slot = &checkpoint->slots[bid];
+	uint64_t seq = atomic_load(&slot->seq) + 1;
+	struct checkpoint_image_t *image = &slot->images[seq & 1];
+
+	pthread_mutex_lock(&items_lock[bid]);
+	battle_save(bid, &image->battle);
+	image->nr_sessions = 0;
+	for(int i = 0; i < USER_CNT; i++) {
+		if(battles[bid].users[i].battle_state == BATTLE_STATE_UNJOINED)
+			continue;
+
+		/* name and rid are set before joining, the hash when registered,
+		 * the skill is bumped by this worker, the token is changed under
+		 * sessions_lock */
+		int n = image->nr_sessions ++, rid = sessions[i].rid;
+		image->sessions[n].uid = i;
+		image->sessions[n].state = sessions[i].state;
+		image->sessions[n].registered = rid >= 0;
+		image->sessions[n].skill = rid >= 0 ? registered_user_list[rid].skill : 0;
+		if(rid >= 0)
+			memcpy(image->sessions[n].hash, registered_user_list[rid].hash, PASSWORD_HASH_SIZE);
+		memcpy(image->sessions[n].user_name, sessions[i].user_name, USERNAME_SIZE);
+		pthread_mutex_lock(&sessions_lock);
+		memcpy(image->sessions[n].resume_token, sessions[i].resume_token, RESUME_TOKEN_SIZE);
+		pthread_mutex_unlock(&sessions_lock);
+	}
+	pthread_mutex_unlock(&items_lock[bid]);
+	atomic_store(&slot->seq, seq);
+}
+
+// by the worker dropping disbanded `bid`
+void checkpoint_clear(int bid) {
+	if(!checkpoint)
+		return;
+
+	struct checkpoint_slot_t *slot = &checkpoint->slots[bid];
+	pthread_mutex_lock(&items_lock[bid]);
+	if(!battles[bid].is_alloced) {
+		uint64_t seq = atomic_load(&slot->seq) + 1;
+		slot->images[seq & 1].battle.battle.is_alloced = false;
+		atomic_store(&slot->seq, seq);
+	}
+	pthread_mutex_unlock(&items_lock[bid]);
+}
+
+// index of a recovered user, registered again by its hash if gone
+int register_recovered(const char *user_name, const char *hash, int skill) {
+	int rid = registered_index(user_name);
+	if(rid >= 0 || user_list_size == REGISTERED_USER_LIST_SIZE)
+		return rid;
+
+	rid = user_list_size ++;
+	strncpy(registered_user_list[rid].user_name, user_name, USERNAME_SIZE - 1);
+	strncpy(registered_user_list[rid].hash, hash, PASSWORD_HASH_SIZE - 1);
+	registered_user_list[rid].skill = skill;
+	return rid;
+}
+
+/* load battles of the checkpoint and sessions of their users, no other
+ * thread runs yet, return the number of battles */
+int checkpoint_recover() {
+	int nr_battles = 0;
+	for(int bid = 0; bid < USER_CNT; bid++) {
+		uint64_t seq = atomic_load(&checkpoint->slots[bid].seq);
+		const struct checkpoint_image_t *image = &checkpoint->slots[bid].images[seq & 1];
+		if(seq == 0 || !image->battle.battle.is_alloced)
+			continue;
+
+		battle_load(bid, &image->battle);
+		for(int i = 0; i < image->nr_sessions; i++) {
+			int uid = image->sessions[i].uid, state = image->sessions[i].state;
+			if(uid < 0 || uid >= USER_CNT || sessions[uid].state != USER_STATE_UNUSED
+			|| state == USER_STATE_UNUSED || state == USER_STATE_NOT_LOGIN)
+				continue;
+
+			struct session_t saved;
+			memset(&saved, 0, sizeof(struct session_t));
+			saved.state = state;
+			saved.bid = bid;
+			saved.rid = -1;
+			saved.detached_at = now_us();   // grace from now on
+			memcpy(saved.user_name, image->sessions[i].user_name, USERNAME_SIZE);
+			saved.user_name[USERNAME_SIZE - 1] = '\0';
+			memcpy(saved.resume_token, image->sessions[i].resume_token, RESUME_TOKEN_SIZE);
+			if(image->sessions[i].registered)
+				saved.rid = register_recovered(saved.user_name,
+						image->sessions[i].hash, image->sessions[i].skill);
+			session_load(uid, &saved, -1);
+		}
+
+		// users whose sessions couldn't come back
+		for(int i = 0; i < USER_CNT; i++) {
+			if(battles[bid].users[i].battle_state == BATTLE_STATE_UNJOINED
+			|| (query_session_built(i) && sessions[i].bid == bid))
+				continue;
+			battles[bid].users[i].battle_state = BATTLE_STATE_UNJOINED;
+			battles[bid].nr_users --;
+		}
+		if(battles[bid].nr_users == 0) {
+			free_chunks(bid);
+			memset(&battles[bid], 0, sizeof(struct battle_t));
+			continue;
+		}
+
+		log("recover battle #%d at tick %llu with %zu users\n", bid,
+				(unsigned long long)battles[bid].ticks, battles[bid].nr_users);
+		nr_battles ++;
+	}
+	return nr_battles;
+}
+
+void parse_args(int argc, char *argv[]) {
+	unsigned long long seed;
+	int has_seed = false;
+	for(int i = 1; i < argc; i++) {
+		unsigned w, h;
+		if(strcmp(argv[i], "-m") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%ux%u", &w, &h) == 2
+		&& 0 < w && w <= MAX_MAP_W && 0 < h && h <= MAX_MAP_H) {
+			map_w = w;
+			map_h = h;
+			i ++;
+		}else if(strcmp(argv[i], "-z") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &w) == 1) {
+			zerocopy_min_bytes = w;
+			i ++;
+		}else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &w) == 1
+		&& 0 < w && w <= MAX_SIM_WORKERS) {
+			nr_sim_workers = w;
+			i ++;
+		}else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &w) == 1
+		&& MATCH_MIN_USERS <= w && w <= USER_CNT) {
+			match_size = w;
+			i ++;
+		}else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &w) == 1 && w <= 65535) {
+			server_port = w;
+			i ++;
+		}else if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+			unix_path = argv[i + 1];
+			i ++;
+		}else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			feed = feed_create(argv[i + 1]);
+			if(!feed) exit(1);
+			i ++;
+		}else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%llu", &seed) == 1) {
+			has_seed = true;
+			i ++;
+		}else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			checkpoint = checkpoint_open(argv[i + 1]);
+			if(!checkpoint) exit(1);
+			i ++;
+		}else if(strcmp(argv[i], "-k") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &w) == 1 && w > 0) {
+			checkpoint_ticks = w;
+			i ++;
+		}else if(strcmp(argv[i], "-U") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &w) == 1) {
+			upgrade_fd = w;
+			i ++;
+		}else{
+			eprintf("usage: %s [-m <width>x<height>] [-z <min frame bytes>] [-w <workers>] [-n <users>] [-p <port>] [-u <path>] [-s <feed>] [-r <seed>] [-c <file>] [-k <ticks>]\n"
+					"  -m  map size, at most %dx%d\n"
+					"  -z  send battle frames of at least this size by zero-copy\n"
+					"  -w  simulation workers, at most %d\n"
+					"  -n  users per matched battle, %d to %d\n"
+					"  -p  TCP port, 0 to disable, %d by default\n"
+					"  -u  also listen on this Unix socket\n"
+					"  -s  publish battles to this file for ./spectator\n"
+					"  -r  seed of battles, random by default\n"
+					"  -c  checkpoint battles to this file, recovered on startup\n"
+					"  -k  ticks between checkpoints of a battle, %d by default\n"
+					"  -U  internal, take over from a server being upgraded\n",
+					argv[0], MAX_MAP_W, MAX_MAP_H, MAX_SIM_WORKERS,
+					MATCH_MIN_USERS, USER_CNT, PORT, CHECKPOINT_TICKS);
+		}
+	}
+	if(server_port == 0 && !unix_path)
+		eprintf("no TCP port nor Unix socket to listen on\n");
+	log("map size of battles: %dx%d\n", map_w, map_h);
+	log("%d simulation workers, %d users per matched battle\n", nr_sim_workers, match_size);
+	if(zerocopy_min_bytes >= 0)
+		log("zero-copy battle frames of at least %d bytes\n", zerocopy_min_bytes);
+	if(checkpoint)
+		log("checkpoint battles every %d ticks, %zu bytes mapped\n", checkpoint_ticks, sizeof(struct checkpoint_t));
+
+	if(!has_seed && getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+		eprintf("fail to generate seed of battles\n");
+	rng_seed(&battle_seeds, seed);
+	log("seed of battles: %llu\n", seed);
+	saved_argv = argv;
+}
+
+int main(int argc, char *argv[]) {
+	log_init();
+	parse_args(argc, argv);
+
+	pthread_t thread;
+	int nr_recovered = 0;
+
+	struct sigaction wake;
+	memset(&wake, 0, sizeof(wake));
+	wake.sa_handler = on_wake_signal;
+	if(signal(SIGINT, terminate_process) == SIG_ERR
+	|| signal(SIGTERM, terminate_process) == SIG_ERR
+	|| signal(SIGUSR2, on_upgrade_signal) == SIG_ERR
+	|| sigaction(SIGUSR1, &wake, NULL) == -1) {
 		eprintf("An error occurred while setting a signal handler.\n");
 	}
+	if(pipe(upgrade_pipe) == -1)
+		eprintf("fail to create pipe of upgrade\n");
+	fcntl(upgrade_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(upgrade_pipe[1], F_SETFD, FD_CLOEXEC);
 
 	for(int i = 0; i < USER_CNT; i++) {
 		pthread_mutex_init(&items_lock[i], NULL);
+		pthread_mutex_init(&zc_lock[i], NULL);
+		sessions[i].conn = -1;
+	}
+	for(int i = 0; i < MAX_CHANNEL_FD; i++)
+		pthread_mutex_init(&send_locks[i], NULL);
+
+	if(upgrade_fd >= 0) {
+		fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+		if(take_over(upgrade_fd) < 0)
+			eprintf("fail to take over, the old server goes on\n");
+		confirm_take_over(upgrade_fd);
+	}else{
+		if(checkpoint)
+			nr_recovered = checkpoint_recover();
+		if(server_port)
+			server_fd = server_start();
+		if(unix_path)
+			unix_server_fd = unix_server_start(unix_path);
 	}
 
-	server_fd = server_start();
+	start_sim_workers();
+	if(pthread_create(&thread, NULL, matcher, NULL) != 0) {
+		eprintf("fail to start matcher\n");
+	}
+	if(pthread_create(&thread, NULL, chat_dispatcher, NULL) != 0) {
+		eprintf("fail to start chat dispatcher\n");
+	}
+	if(pthread_create(&thread, NULL, presence_publisher, NULL) != 0) {
+		eprintf("fail to start presence publisher\n");
+	}
+	start_session_watchdog();
+	if(upgrade_fd >= 0) {
+		finish_take_over();
+	}else if(nr_recovered > 0) {
+		int nr_sessions = start_loaded(&nr_recovered);
+		log("recovered %d battles with %d sessions\n", nr_recovered, nr_sessions);
+	}
 
-	for(int i = 0; i < USER_CNT; i++)
-		sessions[i].conn = -1;
+	struct pollfd fds[3];
+	int nr_fds = 0;
+	fds[nr_fds ++] = (struct pollfd){upgrade_pipe[0], POLLIN, 0};
+	if(server_fd)
+		fds[nr_fds ++] = (struct pollfd){server_fd, POLLIN, 0};
+	if(unix_server_fd >= 0)
+		fds[nr_fds ++] = (struct pollfd){unix_server_fd, POLLIN, 0};
 
-	struct sockaddr_in client_addr;
-	socklen_t length = sizeof(client_addr);
 	while(1) {
-		int conn = accept(server_fd, (struct sockaddr*)&client_addr, &length);
-		log("connected by %s:%d, conn:%d\n", inet_ntoa(client_addr.sin_addr), client_addr.sin_port, conn);
-		if(conn < 0) {
-			loge("fail to accept client.\n");
-		}else if(pthread_create(&thread, NULL, session_start, (void *)(uintptr_t)conn) != 0) {
-			loge("fail to create thread.\n");
+		if(poll(fds, nr_fds, -1) < 0) {
+			if(errno != EINTR)
+				loge("fail to poll listening sockets\n");
+			continue;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			char sig;
+			if(read(upgrade_pipe[0], &sig, 1) == 1)
+				hot_upgrade();
+		}
+		for(int i = 1; i < nr_fds; i++) {
+			if(fds[i].revents & POLLIN)
+				accept_session(fds[i].fd);
 		}
-		logi("bind thread #%lu\n", thread);
 	}
 
 	return 0;
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+#include "shmring.h"
+
+// the size of the channel is fixed for good, a client can't shrink it under the server
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+int shm_channel_create(shm_endpoint_t *ep, int fds[SHM_NR_FDS]) {
+	fds[0] = memfd_create("shooter-channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[3] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(fds[0] < 0 || fds[1] < 0 || fds[2] < 0 || fds[3] < 0
+	|| ftruncate(fds[0], sizeof(shm_channel_t)) == -1
+	|| fcntl(fds[0], F_ADD_SEALS, SHM_SEALS) == -1) {
+		loge("fail to create shared memory channel: %s\n", strerror(errno));
+		return -1;
+	}
+
+	shm_channel_t *ch = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if(ch == MAP_FAILED) {
+		loge("fail to map shared memory channel: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for(int i = 0; i < 2; i++) {
+		atomic_init(&ch->rings[i].head, 0);
+		atomic_init(&ch->rings[i].tail, 0);
+		atomic_init(&ch->rings[i].waiting, 0);
+	}
+	ch->magic = SHM_CHANNEL_MAGIC;
+
+	ep->ch = ch;
+	ep->rx = &ch->rings[SHM_TO_CLIENT];
+	ep->tx = &ch->rings[SHM_TO_SERVER];
+	ep->rx_efd = fds[2];
+	ep->tx_efd = fds[1];
+	ep->room_efd = fds[3];
+	return 0;
+}
+
+int shm_channel_attach(shm_endpoint_t *ep, int fds[SHM_NR_FDS]) {
+	struct stat st;
+	if(fstat(fds[0], &st) == -1 || st.st_size < sizeof(shm_channel_t)) {
+		loge("shared memory channel is too small\n");
+		return -1;
+	}
+
+	int seals = fcntl(fds[0], F_GET_SEALS);
+	if(seals == -1 || (seals & SHM_SEALS) != SHM_SEALS) {
+		loge("shared memory channel is not sealed\n");
+		return -1;
+	}
+
+	shm_channel_t *ch = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if(ch == MAP_FAILED) {
+		loge("fail to map shared memory channel: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if(ch->magic != SHM_CHANNEL_MAGIC) {
+		loge("bad magic of shared memory channel\n");
+		munmap(ch, sizeof(shm_channel_t));
+		return -1;
+	}
+
+	// the mapping holds the memory, eventfds are kept
+	close(fds[0]);
+	ep->ch = ch;
+	ep->rx = &ch->rings[SHM_TO_SERVER];
+	ep->tx = &ch->rings[SHM_TO_CLIENT];
+	ep->rx_efd = fds[1];
+	ep->tx_efd = fds[2];
+	ep->room_efd = fds[3];
+	return 0;
+}
+
+void shm_channel_close(shm_endpoint_t *ep) {
+	if(!ep->ch) return;
+	munmap(ep->ch, sizeof(shm_channel_t));
+	close(ep->rx_efd);
+	close(ep->tx_efd);
+	close(ep->room_efd);
+	ep->ch = NULL;
+}
+
+static void copy_in(shm_ring_t *r, uint32_t pos, const void *buf, size_t len) {
+	size_t idx = pos & (SHM_RING_SIZE - 1);
+	size_t first = len < SHM_RING_SIZE - idx ? len : SHM_RING_SIZE - idx;
+	memcpy(r->data + idx, buf, first);
+	memcpy(r->data, (const uint8_t *)buf + first, len - first);
+}
+
+static void copy_out(shm_ring_t *r, uint32_t pos, void *buf, size_t len) {
+	size_t idx = pos & (SHM_RING_SIZE - 1);
+	size_t first = len < SHM_RING_SIZE - idx ? len : SHM_RING_SIZE - idx;
+	memcpy(buf, r->data + idx, first);
+	memcpy((uint8_t *)buf + first, r->data, len - first);
+}
+
+size_t shm_send(shm_endpoint_t *ep, struct iovec *iov, int iovcnt) {
+	shm_ring_t *r = ep->tx;
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	size_t space = SHM_RING_SIZE - (head - tail);
+
+	size_t total = 0;
+	for(int i = 0; i < iovcnt && space > 0; i++) {
+		size_t len = iov[i].iov_len < space ? iov[i].iov_len : space;
+		copy_in(r, head + total, iov[i].iov_base, len);
+		iov[i].iov_base = (uint8_t *)iov[i].iov_base + len;
+		iov[i].iov_len -= len;
+		total += len;
+		space -= len;
+	}
+	if(total == 0) return 0;
+
+	/* publish, then kick if the consumer had drained the ring: it
+	 * stores tail before checking head, so one of us sees the other */
+	atomic_store(&r->head, head + total);
+	if(atomic_load(&r->tail) == head) {
+		uint64_t one = 1;
+		if(write(ep->tx_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			loge("fail to kick shared memory channel\n");
+	}
+	return total;
+}
+
+size_t shm_space(shm_endpoint_t *ep) {
+	shm_ring_t *r = ep->tx;
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	return SHM_RING_SIZE - (head - atomic_load(&r->tail));
+}
+
+int shm_wait_room(shm_endpoint_t *ep, int hup_fd, int timeout_ms) {
+	shm_ring_t *r = ep->tx;
+
+	/* raise `waiting`, then look again: the consumer stores tail
+	 * before checking `waiting`, so one of us sees the other */
+	atomic_store(&r->waiting, 1);
+	if(shm_space(ep) > 0) {
+		atomic_store(&r->waiting, 0);
+		return 1;
+	}
+
+	struct pollfd fds[2] = {
+		{ep->room_efd, POLLIN, 0},
+		{hup_fd, POLLRDHUP, 0},
+	};
+	int ret = poll(fds, 2, timeout_ms);
+	atomic_store(&r->waiting, 0);
+	if(ret <= 0)
+		return ret < 0 && errno == EINTR ? 1 : 0;
+	if(fds[1].revents)
+		return -1;
+
+	uint64_t count;
+	if(read(ep->room_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		loge("fail to read room of shared memory channel\n");
+	return 1;
+}
+
+size_t shm_recv(shm_endpoint_t *ep, void *buf, size_t len) {
+	shm_ring_t *r = ep->rx;
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load(&r->head);
+	size_t avail = head - tail;
+	if(avail > len) avail = len;
+
+	copy_out(r, tail, buf, avail);
+	atomic_store(&r->tail, tail + avail);
+	if(avail > 0 && atomic_load(&r->waiting)) {
+		uint64_t one = 1;
+		if(write(ep->room_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			loge("fail to kick room of shared memory channel\n");
+	}
+	return avail;
+}
+
+void shm_clear_kick(shm_endpoint_t *ep) {
+	uint64_t count;
+	if(read(ep->rx_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		loge("fail to read kick of shared memory channel\n");
+}
+
+int send_with_fds(int sock, const void *buf, size_t len, const int *fds, int nr_fds) {
+	char control[CMSG_SPACE(sizeof(int) * SHM_NR_FDS)];
+	struct iovec iov = {(void *)buf, len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+	memcpy(CMSG_DATA(cm), fds, sizeof(int) * nr_fds);
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+ssize_t recv_with_fds(int sock, void *buf, size_t len, int *fds, int *nr_fds) {
+	char control[CMSG_SPACE(sizeof(int) * SHM_NR_FDS)];
+	struct iovec iov = {buf, len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if(ret <= 0) return ret;
+
+	for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(int i = 0; i < n; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+			if(*nr_fds < SHM_NR_FDS)
+				fds[(*nr_fds) ++] = fd;
+			else
+				close(fd);
+		}
+	}
+	return ret;
+}
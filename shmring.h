@@ -0,0 +1,93 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/* shared memory channel of local clients
+ *
+ *   two single producer single consumer byte rings in a memfd, one to
+ *   the server and one to the client, carrying the same bytes as the
+ *   socket would: client messages one way, frames the other. The
+ *   client creates the memfd and two eventfds and passes them to the
+ *   server over its Unix socket with CLIENT_COMMAND_SHM_CHANNEL, the
+ *   socket is then only watched for hangup. The memfd is sealed against
+ *   resizing, the server takes no channel that isn't.
+ *
+ *   a producer kicks the eventfd of the ring only when the consumer
+ *   may have found the ring empty and gone to sleep on it, so a busy
+ *   consumer takes no syscalls at all.
+ *
+ *   the server finding the ring to the client full raises `waiting` of
+ *   the ring and sleeps on a third eventfd, which the client kicks when
+ *   it takes bytes off a ring with `waiting` raised. Client messages
+ *   are small and always drained, the client never waits for room.
+ */
+#define SHM_RING_SIZE (256 * 1024)    // power of 2
+#define SHM_CHANNEL_MAGIC 0x53484d32  // "SHM2"
+#define SHM_NR_FDS 4                  // memfd, eventfd to server, to client, of room to client
+
+enum {
+	SHM_TO_SERVER,
+	SHM_TO_CLIENT,
+};
+
+typedef struct shm_ring_t {
+	_Atomic uint32_t head;   // bytes written, by producer
+	char pad0[60];
+	_Atomic uint32_t tail;   // bytes read, by consumer
+	_Atomic uint32_t waiting;  // producer sleeps for room, by producer
+	char pad1[56];
+	uint8_t data[SHM_RING_SIZE];
+} shm_ring_t;
+
+typedef struct shm_channel_t {
+	uint32_t magic;
+	char pad[60];
+	shm_ring_t rings[2];
+} shm_channel_t;
+
+/* one side of a channel */
+typedef struct shm_endpoint_t {
+	shm_channel_t *ch;
+	shm_ring_t *rx, *tx;
+	int rx_efd;              // kicked when rx gets data
+	int tx_efd;              // kicked by us when tx gets data
+	int room_efd;            // kicked by the client when it drains its rx
+} shm_endpoint_t;
+
+/* client side: create the channel, `fds` gets memfd, eventfd to
+ * server, eventfd to client and eventfd of room, return -1 on error */
+int shm_channel_create(shm_endpoint_t *ep, int fds[SHM_NR_FDS]);
+
+/* server side: map the channel passed by the client, return -1 if
+ * it is too small or not sealed */
+int shm_channel_attach(shm_endpoint_t *ep, int fds[SHM_NR_FDS]);
+
+void shm_channel_close(shm_endpoint_t *ep);
+
+/* write as much of `iov` as fits and advance it, return bytes written */
+size_t shm_send(shm_endpoint_t *ep, struct iovec *iov, int iovcnt);
+
+/* bytes tx takes now */
+size_t shm_space(shm_endpoint_t *ep);
+
+/* server side: sleep until tx has room, `hup_fd` hangs up or
+ * `timeout_ms` passes, return 1, -1 and 0 for them */
+int shm_wait_room(shm_endpoint_t *ep, int hup_fd, int timeout_ms);
+
+/* read at most `len` bytes without blocking, return bytes read */
+size_t shm_recv(shm_endpoint_t *ep, void *buf, size_t len);
+
+/* reset rx_efd after it polled readable */
+void shm_clear_kick(shm_endpoint_t *ep);
+
+/* send `buf` over Unix socket `sock` with `nr_fds` fds */
+int send_with_fds(int sock, const void *buf, size_t len, const int *fds, int nr_fds);
+
+/* like recv(), at most SHM_NR_FDS fds passed along are appended to
+ * `fds`, `*nr_fds` counts them */
+ssize_t recv_with_fds(int sock, void *buf, size_t len, int *fds, int *nr_fds);
+
+#endif
@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "common.h"
+#include "feed.h"
+
+/* spectator server
+ *
+ *   usage: ./spectator [-s <feed>] [-p <port>] [-r <rounds per second>]
+ *
+ *   maps the feed a server publishes with `./server -s <feed>` and
+ *   fans battles out to read-only viewers, `./client -S <battle>`. A
+ *   viewer connects to SPECTATOR_PORT and sends one byte, the id of the
+ *   battle it watches.
+ *
+ *   a round runs a few times per second: the ring of every watched
+ *   battle is read once into buffers shared by all its viewers, then
+ *   each viewer gets the terrain diffs of the round and the latest
+ *   snapshot, snapshots in between are dropped. A new viewer, or one
+ *   whose socket couldn't take the last round, gets the terrain since
+ *   the latest keyframe instead.
+ *
+ *   viewers are never waited on, an unsent tail is kept and written
+ *   before anything else goes to the viewer.
+ */
+
+#define MAX_VIEWERS 4096
+#define DEFAULT_ROUNDS 5
+#define MAX_ROUNDS 20
+
+#define MAX_FRAME (FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD)
+
+typedef struct buffer_t {
+	uint8_t *data;
+	size_t len, cap;
+} buffer_t;
+
+struct battle_feed_t {
+	uint32_t epoch;
+	uint64_t pos;            // next record in ring
+	int nr_viewers;
+	int have_keyframe;       // records before a keyframe are skipped
+	int in_keyframe;         // terrain of a keyframe, until the snapshot
+	int generation;          // bumped when the terrain is reset
+	int ended;               // in this round
+
+	buffer_t keyframe;       // terrain frames since the latest keyframe
+	buffer_t round;          // terrain frames of this round
+	uint8_t snapshot[MAX_FRAME];
+	size_t snapshot_len;
+	int fresh;               // snapshot read in this round
+} battles[USER_CNT];
+
+struct viewer_t {
+	int fd;                  // -1 if slot is unused
+	int bid;                 // -1 before the request
+	int synced;              // has terrain of `generation`
+	int generation;
+	uint8_t *tail;           // unsent bytes of the last round
+	size_t tail_len, tail_off;
+} viewers[MAX_VIEWERS];
+
+static const feed_t *feed = NULL;
+static const char *feed_path = FEED_PATH;
+static int port = SPECTATOR_PORT;
+static int nr_rounds = DEFAULT_ROUNDS;
+
+static int listen_fd = -1;
+static volatile sig_atomic_t terminating = false;
+
+void buffer_append(buffer_t *buf, const void *data, size_t len) {
+	if(buf->len + len > buf->cap) {
+		size_t cap = buf->cap ? buf->cap : MAX_FRAME * 4;
+		while(cap < buf->len + len)
+			cap *= 2;
+		buf->data = realloc(buf->data, cap);
+		if(!buf->data) eprintf("fail to alloc frame buffer\n");
+		buf->cap = cap;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+/* resume at the latest keyframe, the next one if that is gone too */
+void resync(struct battle_feed_t *b, const feed_ring_t *ring, int lapped) {
+	if(lapped)
+		b->pos = atomic_load(&ring->head);
+	else
+		b->pos = atomic_load(&ring->keyframe);
+	b->have_keyframe = false;
+	b->generation ++;
+	b->round.len = 0;
+}
+
+void read_battle(int bid) {
+	static uint8_t frame[MAX_FRAME];
+	struct battle_feed_t *b = &battles[bid];
+	const feed_ring_t *ring = &feed->rings[bid];
+
+	b->round.len = 0;
+	b->fresh = false;
+	b->ended = false;
+
+	uint32_t epoch = atomic_load(&ring->epoch);
+	if(epoch != b->epoch) {
+		b->ended = (b->epoch & 1) && !(epoch & 1);
+		b->epoch = epoch;
+		b->snapshot_len = 0;
+		resync(b, ring, false);
+		log("battle #%d %s\n", bid, epoch & 1 ? "starts" : "ends");
+	}
+	if(!(epoch & 1)) return;
+
+	int nr_lapped = 0;
+	while(1) {
+		int kind;
+		size_t len;
+		int ret = feed_read(ring, &b->pos, &kind, frame, &len);
+		if(ret == 0) break;
+		if(ret < 0) {
+			logi("lapped by battle #%d\n", bid);
+			resync(b, ring, nr_lapped ++ > 0);
+			continue;
+		}
+
+		if(kind == FEED_KEYFRAME) {
+			b->have_keyframe = true;
+			b->in_keyframe = true;
+			b->keyframe.len = 0;
+			continue;
+		}
+		if(!b->have_keyframe)
+			continue;
+
+		if(kind == FEED_TERRAIN) {
+			// viewers in sync already have the terrain of a keyframe
+			buffer_append(&b->keyframe, frame, len);
+			if(!b->in_keyframe)
+				buffer_append(&b->round, frame, len);
+		}else if(kind == FEED_SNAPSHOT) {
+			b->in_keyframe = false;
+			memcpy(b->snapshot, frame, len);
+			b->snapshot_len = len;
+			b->fresh = true;
+		}
+	}
+}
+
+void close_viewer(struct viewer_t *v) {
+	if(v->bid >= 0)
+		battles[v->bid].nr_viewers --;
+	close(v->fd);
+	free(v->tail);
+	memset(v, 0, sizeof(struct viewer_t));
+	v->fd = -1;
+	v->bid = -1;
+}
+
+/* write without blocking, keep what the socket doesn't take */
+int send_round(struct viewer_t *v, struct iovec *iov, int iovcnt) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	ssize_t sent = sendmsg(v->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(sent < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return -1;
+		sent = 0;
+	}
+
+	for(int i = 0; i < iovcnt; i++) {
+		if(sent >= iov[i].iov_len) {
+			sent -= iov[i].iov_len;
+			continue;
+		}
+
+		size_t left = iov[i].iov_len - sent;
+		v->tail = realloc(v->tail, v->tail_len + left);
+		if(!v->tail) eprintf("fail to alloc viewer buffer\n");
+		memcpy(v->tail + v->tail_len, (uint8_t *)iov[i].iov_base + sent, left);
+		v->tail_len += left;
+		sent = 0;
+	}
+	return 0;
+}
+
+int flush_tail(struct viewer_t *v) {
+	if(v->tail_len == 0) return 0;
+
+	ssize_t sent = send(v->fd, v->tail + v->tail_off, v->tail_len - v->tail_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(sent < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+	v->tail_off += sent;
+	if(v->tail_off == v->tail_len) {
+		free(v->tail);
+		v->tail = NULL;
+		v->tail_len = v->tail_off = 0;
+	}
+	return 0;
+}
+
+void serve_viewer(struct viewer_t *v) {
+	static uint8_t disbanded[FRAME_HEADER_SIZE + sizeof(server_message_t)];
+	if(v->bid < 0) return;
+
+	struct battle_feed_t *b = &battles[v->bid];
+	if(flush_tail(v) < 0) {
+		close_viewer(v);
+		return;
+	}
+	if(v->tail_len > 0) {
+		// too slow for this round, catch up later
+		v->synced = false;
+		return;
+	}
+
+	struct iovec iov[2];
+	int iovcnt = 0;
+	if(b->ended && v->synced) {
+		server_message_t *psm = (server_message_t *)(disbanded + FRAME_HEADER_SIZE);
+		disbanded[0] = sizeof(server_message_t) & 0xff;
+		disbanded[1] = sizeof(server_message_t) >> 8;
+		psm->message = SERVER_MESSAGE_BATTLE_DISBANDED;
+		iov[iovcnt ++] = (struct iovec){disbanded, sizeof(disbanded)};
+		v->synced = false;
+	}else if(!b->have_keyframe) {
+		return;
+	}else if(!v->synced || v->generation != b->generation) {
+		iov[iovcnt ++] = (struct iovec){b->keyframe.data, b->keyframe.len};
+		if(b->snapshot_len > 0)
+			iov[iovcnt ++] = (struct iovec){b->snapshot, b->snapshot_len};
+		v->synced = true;
+		v->generation = b->generation;
+	}else{
+		if(b->round.len > 0)
+			iov[iovcnt ++] = (struct iovec){b->round.data, b->round.len};
+		if(b->fresh)
+			iov[iovcnt ++] = (struct iovec){b->snapshot, b->snapshot_len};
+	}
+
+	if(iovcnt > 0 && send_round(v, iov, iovcnt) < 0)
+		close_viewer(v);
+}
+
+void run_round() {
+	for(int bid = 0; bid < USER_CNT; bid++) {
+		if(battles[bid].nr_viewers > 0)
+			read_battle(bid);
+	}
+
+	for(int i = 0; i < MAX_VIEWERS; i++) {
+		if(viewers[i].fd >= 0)
+			serve_viewer(&viewers[i]);
+	}
+}
+
+void viewer_readable(struct viewer_t *v) {
+	uint8_t buf[16];
+	ssize_t len = recv(v->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if(len <= 0) {
+		log("viewer fd:%d leaves\n", v->fd);
+		close_viewer(v);
+		return;
+	}
+
+	// nothing more is expected after the battle id
+	if(v->bid >= 0) return;
+
+	if(buf[0] >= USER_CNT) {
+		loge("viewer fd:%d asks for battle #%d\n", v->fd, buf[0]);
+		close_viewer(v);
+		return;
+	}
+
+	struct battle_feed_t *b = &battles[buf[0]];
+	v->bid = buf[0];
+	if(b->nr_viewers ++ == 0) {
+		// nobody has read the ring for a while
+		b->epoch = atomic_load(&feed->rings[v->bid].epoch);
+		resync(b, &feed->rings[v->bid], false);
+	}
+	log("viewer fd:%d watches battle #%d(%d viewers)\n", v->fd, v->bid, b->nr_viewers);
+}
+
+void accept_viewer() {
+	struct sockaddr_in addr;
+	socklen_t length = sizeof(addr);
+	int fd = accept(listen_fd, (struct sockaddr *)&addr, &length);
+	if(fd < 0) {
+		loge("fail to accept viewer\n");
+		return;
+	}
+
+	for(int i = 0; i < MAX_VIEWERS; i++) {
+		if(viewers[i].fd >= 0)
+			continue;
+
+		viewers[i].fd = fd;
+		viewers[i].bid = -1;
+		log("connected by %s:%d, fd:%d\n", inet_ntoa(addr.sin_addr), addr.sin_port, fd);
+		return;
+	}
+
+	loge("too many viewers, reject fd:%d\n", fd);
+	close(fd);
+}
+
+int spectator_start() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		eprintf("Create Socket Failed!\n");
+	}
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		eprintf("Can not bind to port %d!\n", port);
+	}
+
+	if(listen(fd, SOMAXCONN) == -1) {
+		eprintf("fail to listen on socket.\n");
+	}
+	return fd;
+}
+
+// thousands of viewers need more than the default 1024 fds
+void raise_fd_limit() {
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+	if(rl.rlim_cur < MAX_VIEWERS + 16) {
+		rl.rlim_cur = rl.rlim_max < MAX_VIEWERS + 16 ? rl.rlim_max : MAX_VIEWERS + 16;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+void run_spectator() {
+	static struct pollfd fds[2 + MAX_VIEWERS];
+	static struct viewer_t *owners[2 + MAX_VIEWERS];
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if(timer_fd < 0) {
+		eprintf("fail to create round timer\n");
+	}
+	long ns = 1000000000L / nr_rounds;
+	struct itimerspec round = {
+		{ns / 1000000000L, ns % 1000000000L},
+		{ns / 1000000000L, ns % 1000000000L},
+	};
+	timerfd_settime(timer_fd, 0, &round, NULL);
+
+	while(!terminating) {
+		int nr_fds = 0;
+		fds[nr_fds ++] = (struct pollfd){listen_fd, POLLIN, 0};
+		fds[nr_fds ++] = (struct pollfd){timer_fd, POLLIN, 0};
+		for(int i = 0; i < MAX_VIEWERS; i++) {
+			if(viewers[i].fd < 0) continue;
+			owners[nr_fds] = &viewers[i];
+			fds[nr_fds ++] = (struct pollfd){viewers[i].fd, POLLIN, 0};
+		}
+
+		if(poll(fds, nr_fds, -1) < 0) {
+			if(errno != EINTR)
+				loge("fail to poll\n");
+			continue;
+		}
+
+		if(fds[0].revents & POLLIN)
+			accept_viewer();
+
+		for(int i = 2; i < nr_fds; i++) {
+			if(fds[i].revents && owners[i]->fd == fds[i].fd)
+				viewer_readable(owners[i]);
+		}
+
+		if(fds[1].revents & POLLIN) {
+			uint64_t ticks;
+			if(read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+				run_round();
+		}
+	}
+	close(timer_fd);
+}
+
+void on_terminate(int signo) {
+	terminating = true;
+}
+
+void parse_args(int argc, char *argv[]) {
+	for(int i = 1; i < argc; i++) {
+		unsigned n;
+		if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			feed_path = argv[i + 1];
+			i ++;
+		}else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &n) == 1 && 0 < n && n <= 65535) {
+			port = n;
+			i ++;
+		}else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc
+		&& sscanf(argv[i + 1], "%u", &n) == 1 && 0 < n && n <= MAX_ROUNDS) {
+			nr_rounds = n;
+			i ++;
+		}else{
+			eprintf("usage: %s [-s <feed>] [-p <port>] [-r <rounds per second>]\n"
+					"  -s  feed published by ./server -s, %s by default\n"
+					"  -p  port of viewers, %d by default\n"
+					"  -r  frames per second sent to viewers, at most %d\n",
+					argv[0], FEED_PATH, SPECTATOR_PORT, MAX_ROUNDS);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	log_init();
+	parse_args(argc, argv);
+
+	signal(SIGINT, on_terminate);
+	signal(SIGTERM, on_terminate);
+
+	feed = feed_open(feed_path);
+	if(!feed) exit(1);
+
+	for(int i = 0; i < MAX_VIEWERS; i++) {
+		viewers[i].fd = -1;
+		viewers[i].bid = -1;
+	}
+
+	raise_fd_limit();
+	listen_fd = spectator_start();
+	log("spectator on port %d, %d rounds per second\n", port, nr_rounds);
+
+	run_spectator();
+
+	log("terminate spectator\n");
+	for(int i = 0; i < MAX_VIEWERS; i++) {
+		if(viewers[i].fd >= 0)
+			close_viewer(&viewers[i]);
+	}
+	close(listen_fd);
+	log_shutdown();
+	return 0;
+}
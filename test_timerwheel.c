@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timerwheel.h"
+
+/* checks of the timing wheel
+ *
+ *   usage: ./test_timerwheel
+ *
+ *   a timer re-adding itself from its callback some ticks ahead must
+ *   fire once per period, whichever level the period lands on.
+ */
+
+struct rearm_t {
+	timer_wheel_t *tw;
+	tw_timer_t timer;
+	uint64_t period;
+	int nr_fired;
+	uint64_t last;           // tick of the latest fire
+	int nr_bad;
+};
+
+static void rearm(void *arg) {
+	struct rearm_t *r = arg;
+	uint64_t tick = r->tw->now - 1;
+	if(r->nr_fired > 0 && tick != r->last + r->period)
+		r->nr_bad ++;
+	r->nr_fired ++;
+	r->last = tick;
+	tw_add(r->tw, &r->timer, tick + r->period);
+}
+
+static int check_rearm(uint64_t period, int nr_periods) {
+	timer_wheel_t tw;
+	struct rearm_t r = {.tw = &tw, .period = period};
+	tw_init(&tw, 0);
+	tw_timer_init(&r.timer, rearm, &r);
+	tw_add(&tw, &r.timer, 10);
+
+	uint64_t end = 10 + period * (nr_periods - 1);
+	for(uint64_t now = 0; now <= end; now++) {
+		int fired = r.nr_fired;
+		tw_advance(&tw, now);
+		if(r.nr_fired - fired > 1)
+			r.nr_bad ++;
+	}
+
+	int ok = r.nr_bad == 0 && r.nr_fired == nr_periods;
+	printf("%-4s rearm at +%llu: fired %d times, %d expected\n", ok ? "ok" : "FAIL",
+			(unsigned long long)period, r.nr_fired, nr_periods);
+	return ok;
+}
+
+int main() {
+	int ok = 1;
+	ok &= check_rearm(1, 100);
+	ok &= check_rearm(TW_SLOTS - 1, 20);
+	ok &= check_rearm(TW_SLOTS, 20);
+	ok &= check_rearm(TW_SLOTS + 1, 20);
+	ok &= check_rearm(TW_SLOTS * 2, 20);
+	ok &= check_rearm(TW_SLOTS * 5, 20);
+	ok &= check_rearm(TW_SLOTS * TW_SLOTS, 5);
+	ok &= check_rearm(TW_SLOTS * TW_SLOTS * 3, 3);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+void tw_init(timer_wheel_t *tw, uint64_t now) {
+	memset(tw, 0, sizeof(timer_wheel_t));
+	tw->now = now;
+}
+
+void tw_timer_init(tw_timer_t *t, void (*fn)(void *arg), void *arg) {
+	memset(t, 0, sizeof(tw_timer_t));
+	t->fn = fn;
+	t->arg = arg;
+}
+
+static void link_timer(timer_wheel_t *tw, tw_timer_t *t) {
+	uint64_t delta = t->expires - tw->now;
+	tw_timer_t **slot;
+
+	if((int64_t)delta < 0) {
+		// already due, run by the next tick
+		slot = &tw->slots[0][tw->now & TW_MASK];
+	}else{
+		if(delta >= TW_MAX_TICKS) {
+			delta = TW_MAX_TICKS - 1;
+			t->expires = tw->now + delta;
+		}
+
+		int level = 0;
+		while(delta >= ((uint64_t)1 << (TW_BITS * (level + 1))))
+			level ++;
+		slot = &tw->slots[level][(t->expires >> (TW_BITS * level)) & TW_MASK];
+	}
+
+	t->next = *slot;
+	if(t->next) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+void tw_add(timer_wheel_t *tw, tw_timer_t *t, uint64_t expires) {
+	tw_del(t);
+	t->expires = expires;
+	link_timer(tw, t);
+}
+
+void tw_del(tw_timer_t *t) {
+	if(!t->pprev) return;
+
+	*t->pprev = t->next;
+	if(t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+// move the timers of the current slot of `level` to lower levels
+static void cascade(timer_wheel_t *tw, int level) {
+	tw_timer_t **slot = &tw->slots[level][(tw->now >> (TW_BITS * level)) & TW_MASK];
+	tw_timer_t *t = *slot;
+	*slot = NULL;
+
+	while(t) {
+		tw_timer_t *next = t->next;
+		link_timer(tw, t);
+		t = next;
+	}
+}
+
+int tw_advance(timer_wheel_t *tw, uint64_t now) {
+	int nr_run = 0;
+
+	while((int64_t)(now - tw->now) >= 0) {
+		int index = tw->now & TW_MASK;
+		for(int level = 1; level < TW_LEVELS && index == 0; level++) {
+			cascade(tw, level);
+			index = (tw->now >> (TW_BITS * level)) & TW_MASK;
+		}
+
+		/* detach the slot first, a timer re-added by a callback
+		 * TW_SLOTS ticks ahead hashes to this very slot */
+		tw_timer_t **slot = &tw->slots[0][tw->now & TW_MASK];
+		tw_timer_t *list = *slot;
+		*slot = NULL;
+		if(list) list->pprev = &list;
+		tw->now ++;
+
+		// callbacks may delete the others, take one timer at a time
+		while(list) {
+			tw_timer_t *t = list;
+			tw_del(t);
+			t->fn(t->arg);
+			nr_run ++;
+		}
+	}
+	return nr_run;
+}
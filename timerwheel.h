@@ -0,0 +1,56 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+/* hierarchical timing wheel
+ *
+ *   time goes by ticks of whatever length the owner advances the wheel
+ *   with. TW_LEVELS wheels of TW_SLOTS slots each, a slot of level n
+ *   spans TW_SLOTS^n ticks. A timer is linked into the slot of its
+ *   expiry on the lowest level that reaches it, and when level 0 wraps
+ *   around the next slot of level 1 is cascaded down, and so on. Adding
+ *   and deleting are O(1), a tick is O(1) plus the timers that expire
+ *   or cascade on it, however many timers are pending.
+ *
+ *   timers are embedded by the owner and not allocated. The wheel does
+ *   no locking, callbacks run from `tw_advance` and may add or delete
+ *   any timer, themselves included.
+ */
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+#define TW_MAX_TICKS ((uint64_t)1 << (TW_BITS * TW_LEVELS))
+
+typedef struct tw_timer_t {
+	struct tw_timer_t *next;
+	struct tw_timer_t **pprev;   // NULL if not pending
+	uint64_t expires;            // tick
+	void (*fn)(void *arg);
+	void *arg;
+} tw_timer_t;
+
+typedef struct timer_wheel_t {
+	uint64_t now;                // next tick to run
+	tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+} timer_wheel_t;
+
+void tw_init(timer_wheel_t *tw, uint64_t now);
+
+void tw_timer_init(tw_timer_t *t, void (*fn)(void *arg), void *arg);
+
+/* (re)schedule `t` at tick `expires`, ticks already past run on the
+ * next advance, too far ones are kept at the farthest slot and
+ * cascade down from there */
+void tw_add(timer_wheel_t *tw, tw_timer_t *t, uint64_t expires);
+
+void tw_del(tw_timer_t *t);
+
+static inline int tw_pending(const tw_timer_t *t) {
+	return t->pprev != NULL;
+}
+
+/* run the timers expiring up to tick `now` included, return how many */
+int tw_advance(timer_wheel_t *tw, uint64_t now);
+
+#endif
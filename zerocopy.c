@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+#include "zerocopy.h"
+
+int zc_init(zc_socket_t *zc, int fd, void (*get)(void *), void (*put)(void *)) {
+	memset(zc, 0, sizeof(zc_socket_t));
+	zc->fd = fd;
+	zc->get = get;
+	zc->put = put;
+
+	int one = 1;
+	if(setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+		loge("zero-copy isn't supported on fd %d: %s\n", fd, strerror(errno));
+		return -1;
+	}
+
+	zc->enabled = true;
+	return 0;
+}
+
+static void zc_complete(zc_socket_t *zc, uint32_t lo, uint32_t hi, int copied) {
+	for(uint32_t seq = lo; seq - lo <= hi - lo; seq++) {
+		void **slot = &zc->pending[seq % ZC_MAX_PENDING];
+		if(*slot) {
+			zc->put(*slot);
+			*slot = NULL;
+		}
+		if(copied)
+			zc->nr_copied ++;
+	}
+}
+
+void zc_reap(zc_socket_t *zc) {
+	if(!zc->enabled) return;
+
+	while(1) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if(recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if(errno == EINTR)
+				continue;
+			return;  // EAGAIN: no more completions
+		}
+
+		for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+			&& !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			struct sock_extended_err *serr = (void *)CMSG_DATA(cm);
+			if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			zc_complete(zc, serr->ee_info, serr->ee_data,
+					serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+		}
+	}
+}
+
+void zc_release_all(zc_socket_t *zc) {
+	for(int i = 0; i < ZC_MAX_PENDING; i++) {
+		if(zc->pending[i]) {
+			zc->put(zc->pending[i]);
+			zc->pending[i] = NULL;
+		}
+	}
+}
+
+int zc_send_iov(zc_socket_t *zc, struct iovec *iov, int iovcnt, void *buf) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while(msg.msg_iovlen > 0) {
+		void **slot = &zc->pending[zc->next_seq % ZC_MAX_PENDING];
+		if(zc->enabled && *slot)
+			zc_reap(zc);
+
+		int flags = MSG_NOSIGNAL;
+		if(zc->enabled && !*slot)
+			flags |= MSG_ZEROCOPY;
+
+		ssize_t sent = sendmsg(zc->fd, &msg, flags);
+		if(sent < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				// out of optmem for notifications, copy this time
+				zc_reap(zc);
+				sent = sendmsg(zc->fd, &msg, MSG_NOSIGNAL);
+				flags &= ~MSG_ZEROCOPY;
+			}
+			if(sent < 0)
+				return -1;
+		}
+
+		if(flags & MSG_ZEROCOPY) {
+			zc->get(buf);
+			*slot = buf;
+			zc->next_seq ++;
+			zc->nr_sent ++;
+		}
+
+		while(msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov ++;
+			msg.msg_iovlen --;
+		}
+
+		if(msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
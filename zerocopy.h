@@ -0,0 +1,46 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* zero-copy send path (SO_ZEROCOPY / MSG_ZEROCOPY)
+ *
+ *   the kernel sends straight from user pages, so a buffer given to
+ *   `zc_send_iov` must not change until the kernel reports the send
+ *   as completed on the error queue of the socket. Every zero-copy
+ *   sendmsg() takes a reference of the buffer by `get` and keeps it in
+ *   a ring indexed by the send sequence number, `zc_reap` reads the
+ *   completions and drops those references by `put`.
+ *
+ *   it only pays off for large frames, small control messages should
+ *   keep using the normal path. When the ring is full or the socket
+ *   doesn't support it, data is sent by a normal copying sendmsg().
+ */
+#define ZC_MAX_PENDING 64
+
+typedef struct zc_socket_t {
+	int fd;
+	int enabled;
+	uint32_t next_seq;   // sequence number of next zero-copy send
+	uint64_t nr_sent;    // zero-copy sends
+	uint64_t nr_copied;  // completions where kernel copied anyway
+	void *pending[ZC_MAX_PENDING];
+	void (*get)(void *buf);
+	void (*put)(void *buf);
+} zc_socket_t;
+
+/* return -1 if the socket doesn't support zero-copy, `zc` is still
+ * usable and sends by copying */
+int zc_init(zc_socket_t *zc, int fd, void (*get)(void *), void (*put)(void *));
+
+/* send all of `iov` which points into `buf`, return -1 on error */
+int zc_send_iov(zc_socket_t *zc, struct iovec *iov, int iovcnt, void *buf);
+
+/* handle completions on error queue without blocking */
+void zc_reap(zc_socket_t *zc);
+
+/* drop all pending references, e.g. when the socket is closed */
+void zc_release_all(zc_socket_t *zc);
+
+#endif